@@ -87,7 +87,8 @@ void select_new_color (int *col_c, Scalar& new_col);
 void flood_fill_filter(Mat& src, vector<Mat>& labMask, int threshold);
 
 /**
- * Flood fill procedure.
+ * Flood fill procedure. rdf::LabelFilter does the same smoothing in
+ * parallel on the label planes of the classifier.
  * @param src source image matrix.
  * @param labMask Probability mask per label.
  * @param iter Number of iterations of flood fill.
@@ -0,0 +1,282 @@
+/** \file ClassifyService.h
+ *
+ *  \brief Classification service that serves the depth frames of several
+ *  client processes through a shared memory queue.
+ */
+#ifndef RGBD_RF_CLASSIFY_SERVICE_HH__
+#define RGBD_RF_CLASSIFY_SERVICE_HH__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <rdf/common.h>
+#include <rdf/Image.h>
+#include <rdf/RandomForest.h>
+
+#define CLASSIFY_SERVICE_MAGIC 0x53434452
+#define CLASSIFY_SERVICE_VERSION 3
+
+/**
+ *  Name of the shared memory segment of the service, and its default
+ *  number of frame slots.
+ */
+#define CLASSIFY_SERVICE_NAME "/rdf_classify"
+#define CLASSIFY_SERVICE_SLOTS 16
+
+/**
+ *  Alignment of the planes of the slots in the segment.
+ */
+#define CLASSIFY_SERVICE_ALIGN 64
+
+/**
+ *  Period in milliseconds at which a waiting client checks that the
+ *  process of the service is alive.
+ */
+#define CLASSIFY_SERVICE_POLL_MS 100
+
+namespace rdf {
+
+/** \brief State of a frame slot of the service. */
+enum serviceSlotState {
+    FREE_SLOT,      // Available to the clients
+    CLAIMED_SLOT,   // Filled by a client
+    QUEUED_SLOT,    // Waiting for the service
+    BUSY_SLOT,      // Classified by the service
+    DONE_SLOT       // Labels ready for the client
+};
+
+/** \brief Entry of a frame slot in the table of the segment. The owner
+ *  is the process id of the client that claimed the slot.
+ */
+struct ServiceSlot {
+    uint32_t state;
+    uint32_t owner;
+    uint64_t ticket;
+};
+
+/** \brief Header of the shared memory segment of the service.
+ *
+ *  The header is followed by the table of slotNum ServiceSlot and by the
+ *  planes of each slot, every one aligned to CLASSIFY_SERVICE_ALIGN: the
+ *  width * height sensor depths written by the client, then the labels
+ *  and the float probabilities written by the service. The mutex and the
+ *  conditions are shared by the processes, and the mutex is robust so a
+ *  client that dies while holding it does not block the others. The
+ *  clients check the process id of the service while they wait, so they
+ *  fail when the service dies instead of waiting forever.
+ */
+struct ServiceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slotNum;
+    uint32_t labelNum;
+    uint32_t running;
+    uint32_t service;
+    uint64_t tickets;
+    uint64_t frames;
+    uint64_t batches;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+};
+
+/** \brief Mapping of the shared memory segment of a service, with the
+ *  layout of the slots. Base of the service and of the clients.
+ */
+class ServiceSegment {
+    public:
+        /** \brief Unmaps the segment. **/
+        virtual ~ServiceSegment();
+
+        ServiceSegment(const ServiceSegment&) = delete;
+        ServiceSegment& operator=(const ServiceSegment&) = delete;
+
+        /** \brief Returns the width of the frames. */
+        int width() const { return header->width; }
+
+        /** \brief Returns the height of the frames. */
+        int height() const { return header->height; }
+
+        /** \brief Returns the number of frame slots. */
+        int slots() const { return header->slotNum; }
+
+        /** \brief Returns the number of labels of the forest. */
+        int labels() const { return header->labelNum; }
+
+    protected:
+        std::string name;
+        char* base;
+        size_t size;
+        ServiceHeader* header;
+        ServiceSlot* table;
+
+        /** \brief Constructor of an unmapped segment. */
+        ServiceSegment(const std::string& segName);
+
+        /** \brief Size of the planes of a slot, each one aligned. */
+        static size_t slotBytes(int w, int h);
+
+        /** \brief Size of the header and of the table of the slots,
+         *  aligned.
+         */
+        static size_t tableBytes(int slotNum);
+
+        /** \brief Size of a segment. */
+        static size_t segmentBytes(int w, int h, int slotNum);
+
+        /** \brief Planes of a slot in the mapping. */
+        unsigned short* slotDepth(int slot) const;
+        Label* slotLabels(int slot) const;
+        float* slotProbs(int slot) const;
+
+        /** \brief Maps the segment of a file descriptor.
+         *  \param[in] fd Descriptor from shm_open.
+         *  \param[in] bytes Size of the segment.
+         */
+        void mapSegment(int fd, size_t bytes);
+
+        /** \brief Locks the mutex of the header, making it consistent
+         *  again if its owner died.
+         */
+        void lock();
+
+        /** \brief Unlocks the mutex of the header. */
+        void unlock();
+
+        /** \brief Waits on a condition of the header with the mutex
+         *  locked, like lock() if the owner of the mutex died.
+         */
+        void waitOn(pthread_cond_t& cond);
+
+        /** \brief Like waitOn, returning after at most a number of
+         *  milliseconds.
+         *  \param[in] cond Condition of the header.
+         *  \param[in] ms Longest wait.
+         */
+        void waitFor(pthread_cond_t& cond, long ms);
+};
+
+/** \brief Long running service that classifies the depth frames of
+ *  several client processes with one forest.
+ *
+ *  The service creates a shared memory segment with a queue of frame
+ *  slots. A client claims a free slot, writes its depths in place and
+ *  queues it. The service takes every queued frame at once and classifies
+ *  the batch with RandomForest::classifyFrames on its thread pool, writing
+ *  the labels and the probabilities into the slots, where the client reads
+ *  them in place. The forest is loaded once by the service, so the clients
+ *  neither load it nor keep a copy of it.
+ */
+class ClassifyService : public ServiceSegment {
+    public:
+        /** \brief Creates the segment of the service, replacing the one
+         *  left by a service with the same name that did not end.
+         *
+         *  \param[in] f Compiled or mapped forest, it must outlive the
+         *  service.
+         *  \param[in] segName Name of the shared memory segment.
+         *  \param[in] slotNum Number of frame slots.
+         *  \param[in] w Width of the frames.
+         *  \param[in] h Height of the frames.
+         */
+        ClassifyService(RandomForest& f,
+                        const std::string& segName = CLASSIFY_SERVICE_NAME,
+                        int slotNum = CLASSIFY_SERVICE_SLOTS,
+                        int w = WIDTH,
+                        int h = HEIGHT);
+
+        /** \brief Stops the clients and removes the segment. **/
+        ~ClassifyService();
+
+        /** \brief Classifies the queued frames until stop() is called. */
+        void run();
+
+        /** \brief Makes run() return after the current batch, and the
+         *  calls of the clients fail. Can be called from another thread.
+         */
+        void stop();
+
+        /** \brief Returns the number of frames classified. */
+        uint64_t frames() const { return header->frames; }
+
+        /** \brief Returns the number of batches classified. */
+        uint64_t batches() const { return header->batches; }
+
+    private:
+        RandomForest& forest;
+
+        // Padded copy of each slot for the non-virtual lookups.
+        std::vector<PaddedDepthImage> padded;
+};
+
+/** \brief Client of a ClassifyService running in another process.
+ *
+ *  A frame goes through claim(), the depths written in depth(slot),
+ *  submit() and wait(), then the results read in labels(slot) and
+ *  probs(slot) until release(). Several frames can be in flight, up to the
+ *  slots of the service shared by all the clients. classify() does it all
+ *  with copies for the callers that keep their own planes. The calls
+ *  print an error and exit when the service has stopped or died.
+ */
+class ClassifyClient : public ServiceSegment {
+    public:
+        /** \brief Opens the segment of a running service.
+         *  \param[in] segName Name of the shared memory segment.
+         */
+        ClassifyClient(const std::string& segName = CLASSIFY_SERVICE_NAME);
+
+        /** \brief Takes a free slot, waiting for one if every slot is
+         *  taken. The slots left by dead clients are freed first.
+         *  \return Index of the slot.
+         */
+        int claim();
+
+        /** \brief Returns the plane of width * height depths of a claimed
+         *  slot, in millimeters and 0 where there is no depth.
+         */
+        unsigned short* depth(int slot) const { return slotDepth(slot); }
+
+        /** \brief Queues a claimed slot to the service. */
+        void submit(int slot);
+
+        /** \brief Waits for the service to classify a queued slot. */
+        void wait(int slot);
+
+        /** \brief Returns the labels of a classified slot. */
+        const Label* labels(int slot) const { return slotLabels(slot); }
+
+        /** \brief Returns the probabilities of a classified slot. */
+        const float* probs(int slot) const { return slotProbs(slot); }
+
+        /** \brief Gives a slot back to the service. */
+        void release(int slot);
+
+        /** \brief Classifies a frame and waits for the result.
+         *  \param[in] d Plane of width * height depths.
+         *  \param[out] labels Caller owned plane of width * height labels.
+         *  \param[out] probs Caller owned plane of width * height floats,
+         *  or nullptr.
+         */
+        void classify(const unsigned short* d, Label* labels, float* probs);
+
+    private:
+        /** \brief Exits if the service has stopped or its process is
+         *  gone. Called with the mutex locked.
+         */
+        void checkRunning();
+
+        /** \brief Frees the slots of the clients that died, except the
+         *  ones the service is classifying. Called with the mutex locked.
+         *  \return Number of slots freed.
+         */
+        int reclaimSlots();
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_CLASSIFY_SERVICE_HH__
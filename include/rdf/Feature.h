@@ -0,0 +1,160 @@
+/** \file Feature.h
+ *
+ *  \brief Depth comparison feature shared by the training and the
+ *  inference code paths.
+ */
+#ifndef RGBD_RF_FEATURE_HH__
+#define RGBD_RF_FEATURE_HH__
+
+#include <rdf/Image.h>
+#include <rdf/PixelInfo.h>
+
+namespace rdf {
+
+/** \brief Scales one offset component by the depth at the pixel.
+ *
+ *  Same arithmetic as Offset::operator/(const unsigned&): the division is
+ *  done in unsigned arithmetic and a zero depth leaves the offset at 0.
+ *
+ *  \param[in] off Offset component.
+ *  \param[in] depth Depth at the pixel.
+ *  \return The scaled offset component.
+ */
+inline int scaleOffset(const int off, const unsigned depth) {
+    return (depth != 0) ? static_cast<int>(off / depth) : 0;
+}
+
+/** \brief Calculates the difference of depths of the feature function in
+ *  integer arithmetic, given the offsets, the pixel and the depth at the
+ *  pixel. featureResponse is this difference converted to float.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] pi Pixel where the feature is calculated.
+ *  \param[in] dx Depth of the image at the pixel.
+ *  \param[in] img Image of the pixel.
+ *  \return The difference of depths, modulo 2^32.
+ */
+inline uint32_t depthDifference(
+    const int ux, 
+    const int uy,
+    const int vx,
+    const int vy,
+    const PixelInfo& pi,
+    const uint32_t dx,
+    const Image& img
+) {
+    // Normalize offsets by the depth at pixel
+    const uint32_t ux_ = pi.x + scaleOffset(ux, dx);
+    const uint32_t uy_ = pi.y + scaleOffset(uy, dx);
+    const uint32_t vx_ = pi.x + scaleOffset(vx, dx);
+    const uint32_t vy_ = pi.y + scaleOffset(vy, dx);
+
+    const uint32_t uDepth = img.getDepth(ux_, uy_);
+    const uint32_t vDepth = img.getDepth(vx_, vy_);
+
+    return uDepth - vDepth;
+}
+
+/** \brief Same as depthDifference on a padded depth frame, with
+ *  non-virtual loads clamped to the guard band.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] pi Pixel where the feature is calculated.
+ *  \param[in] dx Depth of the frame at the pixel.
+ *  \param[in] img Padded frame of the pixel.
+ *  \return The difference of depths, modulo 2^32.
+ */
+inline uint32_t depthDifference(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const PixelInfo& pi,
+    const uint32_t dx,
+    const PaddedDepthImage& img
+) {
+    const uint32_t uDepth = img.depthAt(pi.x + scaleOffset(ux, dx),
+                                        pi.y + scaleOffset(uy, dx));
+    const uint32_t vDepth = img.depthAt(pi.x + scaleOffset(vx, dx),
+                                        pi.y + scaleOffset(vy, dx));
+
+    return uDepth - vDepth;
+}
+
+/** \brief Calculates the feature function given the offsets, the pixel
+ *  and the depth at the pixel.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] pi Pixel where the feature is calculated.
+ *  \param[in] dx Depth of the image at the pixel.
+ *  \param[in] img Image of the pixel.
+ *  \return value of the calculated feature.
+ */
+inline float featureResponse(
+    const int ux, 
+    const int uy,
+    const int vx,
+    const int vy,
+    const PixelInfo& pi,
+    const uint32_t dx,
+    const Image* img
+) {
+    return depthDifference(ux, uy, vx, vy, pi, dx, *img);
+}
+
+/** \brief Calculates the feature function given the offsets and the pixel.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] pi Pixel where the feature is calculated.
+ *  \param[in] img Image of the pixel.
+ *  \return value of the calculated feature.
+ */
+inline float featureResponse(
+    const int ux, 
+    const int uy,
+    const int vx,
+    const int vy,
+    const PixelInfo& pi,
+    const Image* img
+) {
+    return featureResponse(ux, uy, vx, vy, pi, img->getDepth(pi.x, pi.y), img);
+}
+
+/** \brief Calculates the feature function on a padded depth frame, with
+ *  the same result as on any other image but with non-virtual loads
+ *  clamped to the guard band instead of checked.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] pi Pixel where the feature is calculated.
+ *  \param[in] img Padded frame of the pixel.
+ *  \return value of the calculated feature.
+ */
+inline float featureResponse(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const PixelInfo& pi,
+    const PaddedDepthImage& img
+) {
+    return depthDifference(ux, uy, vx, vy, pi, img.depthAt(pi.x, pi.y), img);
+}
+
+} // namespace rdf
+
+#endif // RGBD_RF_FEATURE_HH__
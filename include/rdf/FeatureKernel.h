@@ -0,0 +1,106 @@
+/** \file FeatureKernel.h
+ *
+ *  \brief Vectorized evaluation of the depth comparison feature on blocks
+ *  of pixels of images in dense storage.
+ */
+#ifndef RGBD_RF_FEATURE_KERNEL_HH__
+#define RGBD_RF_FEATURE_KERNEL_HH__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rdf/Image.h>
+
+namespace rdf {
+
+/** \brief Structure of arrays of a block of pixels. The depth at each
+ *  pixel is looked up once when the block is filled and shared by all the
+ *  offset pairs evaluated on the block.
+ */
+struct FeatureBlock {
+    std::vector<int32_t> x;
+    std::vector<int32_t> y;
+    std::vector<uint32_t> depth;
+    std::vector<int32_t> img;
+
+    /** \brief Changes the number of pixels of the block. */
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        depth.resize(n);
+        img.resize(n);
+    }
+
+    /** \brief Returns the number of pixels of the block. */
+    size_t size() const { return x.size(); }
+};
+
+/** \brief Depth of a pixel of a dense plane, with the same result as
+ *  TrainImage::getDepth in DENSE_STORAGE.
+ *
+ *  \param[in] plane Dense depth plane.
+ *  \param[in] x Pixel X-axis coordinate.
+ *  \param[in] y Pixel Y-axis coordinate.
+ *  \return depth of the pixel or DEFAULT_DEPTH.
+ */
+inline unsigned planeDepth(const DepthPlane& plane, const short x, const short y) {
+    if ((x < 0) || (x >= plane.height) || (y < 0) || (y >= plane.width)) {
+        return DEFAULT_DEPTH;
+    }
+
+    const unsigned d = plane.data[x * plane.width + y];
+    return (d != 0) ? d : DEFAULT_DEPTH;
+}
+
+/** \brief Feature responses of a block of pixels for one offset pair.
+ *
+ *  Gives exactly the results of featureResponse: the offsets are divided
+ *  by the depth in unsigned arithmetic, the coordinates wrap to 16 bits
+ *  and the difference of depths is converted to float as an unsigned
+ *  number. Uses AVX-512, AVX2 or NEON when the compiler targets them, and
+ *  plain C++ otherwise.
+ *
+ *  \param[in] ux X component of the first offset.
+ *  \param[in] uy Y component of the first offset.
+ *  \param[in] vx X component of the second offset.
+ *  \param[in] vy Y component of the second offset.
+ *  \param[in] block Pixels where the feature is calculated.
+ *  \param[in] planes Dense depth plane of each image, indexed by the img
+ *  array of the block.
+ *  \param[out] responses Feature response of each pixel of the block.
+ */
+void featureResponses(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    float* responses
+);
+
+/** \brief Portable version of featureResponses, used for the pixels that
+ *  do not fill a vector register.
+ *
+ *  \param[in] begin First pixel of the block to evaluate.
+ *  \param[in] end Last pixel of the block to evaluate plus one.
+ */
+void featureResponsesScalar(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    size_t begin,
+    size_t end,
+    float* responses
+);
+
+/** \brief Name of the instruction set used by featureResponses. */
+const char* featureKernelName();
+
+} // namespace rdf
+
+#endif // RGBD_RF_FEATURE_KERNEL_HH__
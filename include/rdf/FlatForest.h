@@ -0,0 +1,201 @@
+/** \file FlatForest.h
+ *
+ *  \brief Compact representation of a trained forest used for inference.
+ */
+#ifndef RGBD_RF_FLAT_FOREST_HH__
+#define RGBD_RF_FLAT_FOREST_HH__
+
+#include <string>
+#include <vector>
+
+#include <rdf/Feature.h>
+#include <rdf/MappedFile.h>
+#include <rdf/Image.h>
+#include <rdf/Node.h>
+#include <rdf/PixelInfo.h>
+
+#define FLAT_FOREST_MAGIC 0x46464452
+#define FLAT_FOREST_VERSION 1
+#define FLAT_FOREST_EXT ".bforest"
+
+namespace rdf {
+
+/** \brief Packed split record of a flattened tree.
+ *
+ *  The children are indices in the split array when they are positive or
+ *  zero, and the one's complement of an index in the leaf table when they
+ *  are negative.
+ */
+struct FlatSplit {
+    int32_t ux;
+    int32_t uy;
+    int32_t vx;
+    int32_t vy;
+    float t;
+    int32_t left;
+    int32_t right;
+    int32_t pad;
+};
+
+/** \brief Header of the binary forest format.
+ *
+ *  The header is followed by the flattened arrays in native byte order:
+ *  the roots (treeNum x int32), padding up to a multiple of
+ *  sizeof(FlatSplit) from the start of the file, the split records
+ *  (splitNum x FlatSplit) and the leaf table (leafNum x labelNum floats).
+ */
+struct FlatForestHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t labelNum;
+    uint32_t treeNum;
+    uint32_t splitNum;
+    uint32_t leafNum;
+};
+
+/** \brief Trained forest flattened for inference.
+ *
+ *  The split nodes of all the trees are stored in one contiguous array in
+ *  breadth-first order, so the top levels of each tree share a few cache
+ *  lines. The probability distributions of the leaves are stored in a
+ *  separate table with one row of labelNum floats per leaf.
+ *
+ *  The arrays are either built from the trees or mapped from a binary
+ *  forest file and used in place, so many processes that map the same
+ *  file share one read-only copy of the model.
+ */
+class FlatForest {
+    public:
+
+        /** \brief Default empty constructor. **/
+        FlatForest() : labelNum(0) {}
+
+        FlatForest(const FlatForest&) = delete;
+        FlatForest& operator=(const FlatForest&) = delete;
+
+        /** \brief Flattens the trees of a forest.
+         *  \param[in] trees Roots of the trees.
+         *  \param[in] numLabels Number of labels of the leaf distributions.
+         */
+        void build(const std::vector<Node*>& trees, const int numLabels);
+
+        /** \brief Writes the forest in the binary format.
+         *  \param[in] fileName Path to the output file.
+         */
+        void write(const std::string& fileName) const;
+
+        /** \brief Maps a forest in the binary format, replacing the
+         *  current one. The arrays are used from the mapping.
+         *  \param[in] fileName Path to the binary forest.
+         */
+        void map(const std::string& fileName);
+
+        /** \brief Returns true if no forest has been flattened. */
+        bool empty() const { return rootNum == 0; }
+
+        /** \brief Returns the number of trees of the forest. */
+        int treeNum() const { return static_cast<int>(rootNum); }
+
+        /** \brief Returns the number of labels of the leaf distributions. */
+        int labels() const { return labelNum; }
+
+        /** \brief Drops a pixel down a tree.
+         *  \param[in] tree Index of the tree.
+         *  \param[in] img Image of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \return The probability distribution of the leaf reached.
+         */
+        const float* leafDistribution(
+            const int tree, 
+            const Image* img, 
+            const PixelInfo& pixel
+        ) const {
+            int32_t idx = rootView[tree];
+
+            while (idx >= 0) {
+                const FlatSplit& s = splitView[idx];
+                idx = (featureResponse(s.ux, s.uy, s.vx, s.vy, pixel, img) < s.t) ?
+                    s.left : s.right;
+            }
+
+            return &leafView[static_cast<size_t>(~idx) * labelNum];
+        }
+
+        /** \brief Drops a pixel of a padded depth frame down a tree.
+         *  \param[in] tree Index of the tree.
+         *  \param[in] img Padded frame of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \return The probability distribution of the leaf reached.
+         */
+        const float* leafDistribution(
+            const int tree, 
+            const PaddedDepthImage& img, 
+            const PixelInfo& pixel
+        ) const {
+            int32_t idx = rootView[tree];
+
+            while (idx >= 0) {
+                const FlatSplit& s = splitView[idx];
+                idx = (featureResponse(s.ux, s.uy, s.vx, s.vy, pixel, img) < s.t) ?
+                    s.left : s.right;
+            }
+
+            return &leafView[static_cast<size_t>(~idx) * labelNum];
+        }
+
+        /** \brief Returns the split records of all the trees. */
+        const FlatSplit* splitData() const { return splitView; }
+
+        /** \brief Returns the number of split records. */
+        uint32_t splitCount() const { return splitNum; }
+
+        /** \brief Returns the leaf table, labelNum floats per leaf. */
+        const float* leafData() const { return leafView; }
+
+        /** \brief Returns the number of leaves. */
+        uint32_t leafCount() const { return leafNum; }
+
+        /** \brief Returns the root of each tree, encoded like the
+         *  children of FlatSplit.
+         */
+        const int32_t* rootData() const { return rootView; }
+
+        /** \brief Returns the largest absolute offset component of the
+         *  splits, the guard band a PaddedDepthImage needs so offsets
+         *  scaled by any depth stay inside it.
+         */
+        int maxOffset() const { return offsetBound; }
+
+    private:
+        int labelNum;
+
+        // Arrays of the forest flattened from the trees.
+        std::vector<FlatSplit> splits;
+        std::vector<float> leafProbs;
+        std::vector<int32_t> roots;
+
+        // Mapping of the forest loaded from a binary file.
+        MappedFile::Ptr mapping;
+
+        // Views of the arrays, either into the vectors above or into the
+        // mapping.
+        const FlatSplit* splitView = nullptr;
+        const float* leafView = nullptr;
+        const int32_t* rootView = nullptr;
+        uint32_t rootNum = 0;
+        uint32_t splitNum = 0;
+        uint32_t leafNum = 0;
+        int32_t offsetBound = 0;
+
+        /** \brief Offset of the split records from the start of a binary
+         *  forest with the given number of trees.
+         */
+        static size_t splitOffset(uint32_t trees);
+
+        /** \brief Points the views to the vectors or to the mapping. */
+        void bindViews();
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_FLAT_FOREST_HH__
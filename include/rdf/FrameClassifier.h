@@ -0,0 +1,150 @@
+/** \file FrameClassifier.h
+ *
+ *  \brief Backends that classify whole depth frames with a trained forest.
+ */
+#ifndef RGBD_RF_FRAME_CLASSIFIER_HH__
+#define RGBD_RF_FRAME_CLASSIFIER_HH__
+
+#include <memory>
+#include <vector>
+
+#include <rdf/common.h>
+#include <rdf/Image.h>
+#include <rdf/RandomForest.h>
+
+namespace rdf {
+
+/** \brief Device that evaluates the forest. GPU_CLASSIFIER is reserved
+ *  for a device backend and falls back to the CPU.
+ */
+enum classifierBackend {
+    CPU_CLASSIFIER = 0,
+    GPU_CLASSIFIER = 1
+};
+
+/** \brief Classifies depth frames with a trained forest.
+ *
+ *  The frames go through a pipeline of FRAME_CLASSIFIER_DEPTH slots:
+ *  submit() starts classifying a frame and collect() waits for the oldest
+ *  submitted frame, so a caller can prepare the next frame while the
+ *  backend works on the previous one. classify() does both for callers
+ *  that do not overlap frames, and classifyBatch() keeps the pipeline
+ *  full over a batch of frames. All the backends give the same labels and
+ *  probabilities as RandomForest::classifyFrame.
+ */
+class FrameClassifier {
+    public:
+        typedef std::unique_ptr<FrameClassifier> Ptr;
+
+        virtual ~FrameClassifier() {}
+
+        /** \brief Starts classifying a frame. The frame can be reused as
+         *  soon as the call returns. At most FRAME_CLASSIFIER_DEPTH frames
+         *  can be waiting to be collected.
+         *  \param[in] img Frame to classify.
+         */
+        virtual void submit(const PaddedDepthImage& img) = 0;
+
+        /** \brief Waits for the oldest submitted frame.
+         *  \param[out] labels Caller owned plane of width * height labels.
+         *  \param[out] probs Caller owned plane of width * height floats
+         *  with the probability of each label, or nullptr.
+         */
+        virtual void collect(Label* labels, float* probs) = 0;
+
+        /** \brief Classifies a frame and waits for the result.
+         *  \param[in] img Frame to classify.
+         *  \param[out] labels Caller owned plane of width * height labels.
+         *  \param[out] probs Caller owned plane of width * height floats,
+         *  or nullptr.
+         */
+        virtual void classify(const PaddedDepthImage& img, Label* labels, float* probs) {
+            submit(img);
+            collect(labels, probs);
+        }
+
+        /** \brief Classifies a batch of frames and waits for all the
+         *  results. Frame k + 1 is submitted before frame k is collected,
+         *  so a pipelined backend overlaps the frames of the batch.
+         *  \param[in] imgs Frames to classify.
+         *  \param[out] labels Caller owned plane of width * height labels
+         *  of each frame.
+         *  \param[out] probs Caller owned plane of width * height floats
+         *  of each frame, or nullptr entries.
+         */
+        virtual void classifyBatch(const std::vector<const PaddedDepthImage*>& imgs,
+                                   const std::vector<Label*>& labels,
+                                   const std::vector<float*>& probs) {
+            size_t next = 0;
+
+            for (size_t k = 0; k < imgs.size(); k++) {
+                while (next < imgs.size() && next < k + FRAME_CLASSIFIER_DEPTH) {
+                    submit(*imgs[next]);
+                    next++;
+                }
+                collect(labels[k], probs[k]);
+            }
+        }
+
+        /** \brief Returns the name of the backend. */
+        virtual const char* name() const = 0;
+
+        /** \brief Creates the classifier of a backend. The CPU backend is
+         *  used for the backends that are not available.
+         *
+         *  \param[in] backend Requested backend.
+         *  \param[in] forest Compiled or mapped forest, it must outlive
+         *  the classifier.
+         *  \return The new classifier.
+         */
+        static Ptr create(classifierBackend backend, RandomForest& forest);
+};
+
+/** \brief Classifier that runs RandomForest::classifyFrame on the thread
+ *  pool of the forest.
+ */
+class CpuFrameClassifier : public FrameClassifier {
+    public:
+        /** \brief Constructor.
+         *  \param[in] f Forest used to classify, it must outlive the
+         *  classifier.
+         */
+        CpuFrameClassifier(RandomForest& f)
+            : forest(f), submitted(0), collected(0) {}
+
+        /** \brief Classifies the frame into the next slot. */
+        void submit(const PaddedDepthImage& img);
+
+        /** \brief Copies the oldest slot to the caller planes. */
+        void collect(Label* labels, float* probs);
+
+        /** \brief Classifies the frame directly into the caller planes. */
+        void classify(const PaddedDepthImage& img, Label* labels, float* probs) {
+            forest.classifyFrame(img, labels, probs);
+        }
+
+        /** \brief Classifies the tiles of the whole batch in one parallel
+         *  loop with RandomForest::classifyFrames.
+         */
+        void classifyBatch(const std::vector<const PaddedDepthImage*>& imgs,
+                           const std::vector<Label*>& labels,
+                           const std::vector<float*>& probs) {
+            forest.classifyFrames(imgs, labels, probs);
+        }
+
+        const char* name() const { return "cpu"; }
+
+    private:
+        RandomForest& forest;
+
+        // Results of the frames waiting to be collected.
+        std::vector<Label> slotLabels[FRAME_CLASSIFIER_DEPTH];
+        std::vector<float> slotProbs[FRAME_CLASSIFIER_DEPTH];
+
+        uint64_t submitted;
+        uint64_t collected;
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_FRAME_CLASSIFIER_HH__
@@ -0,0 +1,125 @@
+/** \file FrameRing.h
+ *
+ *  \brief Lock-free single producer, single consumer ring of preallocated
+ *  frames between a capture thread and a processing thread.
+ */
+#ifndef RGBD_RF_FRAME_RING_HH__
+#define RGBD_RF_FRAME_RING_HH__
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace rdf {
+
+/** \brief Fixed size ring of slots shared by one producer and one consumer.
+ *
+ *  The slots are allocated once and reused, so the producer writes each
+ *  frame in place and no memory is allocated while streaming. When the
+ *  ring is full the producer gets no slot and the frame is dropped, so a
+ *  slow consumer never stalls the capture thread.
+ *
+ *  The producer calls claim(), fills the slot and calls publish(). The
+ *  consumer calls front(), reads the slot and calls pop().
+ */
+template<typename T>
+class FrameRing {
+    public:
+        /** \brief Constructor.
+         *  \param[in] size Number of slots, rounded up to a power of two.
+         */
+        FrameRing(unsigned size) : head(0), tail(0), drops(0) {
+            unsigned n = 1;
+
+            while (n < size) {
+                n <<= 1;
+            }
+            slots.resize(n);
+            mask = n - 1;
+        }
+
+        FrameRing(const FrameRing&) = delete;
+        FrameRing& operator=(const FrameRing&) = delete;
+
+        /** \brief Returns the number of slots. */
+        unsigned capacity() const { return mask + 1; }
+
+        /** \brief Returns the slot of every ring position, e.g. to size
+         *  the frames before streaming. Not safe while streaming.
+         */
+        std::vector<T>& data() { return slots; }
+
+        /** \brief Producer: returns the next free slot, or nullptr and
+         *  counts a dropped frame if the ring is full.
+         */
+        T* claim() {
+            const uint64_t h = head.load(std::memory_order_relaxed);
+
+            if (h - tail.load(std::memory_order_acquire) > mask) {
+                drops.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            return &slots[h & mask];
+        }
+
+        /** \brief Producer: makes the slot returned by claim() visible to
+         *  the consumer.
+         */
+        void publish() {
+            head.store(head.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+        }
+
+        /** \brief Consumer: returns the oldest published slot, or nullptr
+         *  if the ring is empty.
+         */
+        T* front() {
+            const uint64_t t = tail.load(std::memory_order_relaxed);
+
+            if (t == head.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &slots[t & mask];
+        }
+
+        /** \brief Consumer: releases the slot returned by front(). */
+        void pop() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+        }
+
+        /** \brief Returns the number of frames published so far. */
+        uint64_t published() const {
+            return head.load(std::memory_order_relaxed);
+        }
+
+        /** \brief Returns the number of frames dropped because the ring
+         *  was full.
+         */
+        uint64_t dropped() const {
+            return drops.load(std::memory_order_relaxed);
+        }
+
+    private:
+        /* Slots of the ring */
+        std::vector<T> slots;
+
+        /* capacity() - 1, used to wrap the positions */
+        uint64_t mask;
+
+        /* Position of the next slot to publish, written by the producer */
+        std::atomic<uint64_t> head;
+
+        /* Keeps head and tail in different cache lines */
+        char pad[64];
+
+        /* Position of the next slot to consume, written by the consumer */
+        std::atomic<uint64_t> tail;
+
+        /* Frames dropped by the producer */
+        std::atomic<uint64_t> drops;
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_FRAME_RING_HH__
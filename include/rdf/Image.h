@@ -7,18 +7,48 @@
 #ifndef RGBD_RF_IMAGE_HH__
 #define RGBD_RF_IMAGE_HH__
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include <rdf/common.h>
+#include <rdf/MappedFile.h>
 #include <rdf/PixelInfo.h>
 
 #define NOT_FOUND -1
 #define DEFAULT_LABEL 0
 #define DEFAULT_DEPTH 0x3f3f3f3f
 
+// Binary image format ("RDFI" in little endian and format version).
+#define BINARY_IMAGE_MAGIC 0x49464452
+#define BINARY_IMAGE_VERSION 1
+#define BINARY_IMAGE_EXT ".bimg"
+#define TEXT_IMAGE_EXT ".simg"
+
 namespace rdf {
 
+/** \brief Storage backend of the train images.
+ *
+ *  SPARSE_STORAGE keeps only the Yale representation of the image and needs
+ *  a binary search for every lookup. DENSE_STORAGE also keeps row-major
+ *  depth and label planes of the whole image, so every lookup is a single
+ *  load at the cost of width * height * 3 bytes per image.
+ */
+enum imageStorage {
+    SPARSE_STORAGE = 0,
+    DENSE_STORAGE  = 1
+};
+
+/** \brief Read-only view of the dense depth plane of an image. The plane
+ *  has one element after the last pixel, so 32 bit loads at any pixel stay
+ *  inside it.
+ */
+struct DepthPlane {
+    const uint16_t* data;
+    int32_t width;
+    int32_t height;
+};
+
 /** \brief This class is an abstract class to treat two kind of images
  *  in the program (Train images and kinect images). Bought images
  *  contain depth information.
@@ -44,7 +74,21 @@ class Image {
          *
          *  @return depth of the pixel coordinate in millimeters.
          */
-         virtual unsigned getDepth(const short & x, const short & y) = 0;
+         virtual unsigned getDepth(const short & x, const short & y) const = 0;
+};
+
+/** \brief Header of the binary image format.
+ *
+ *  The header is followed by the arrays of the Yale representation, in
+ *  this order so each one is naturally aligned: I (height x uint32),
+ *  depths (nnz x uint32), J (nnz x uint16) and labels (nnz x uint8).
+ */
+struct BinaryImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint16_t width;
+    uint16_t height;
+    uint32_t nnz;
 };
 
 /**
@@ -59,6 +103,10 @@ class Image {
  *  algorithm. In our case we have preprocessed the real images formats
  *  lile (bmp and exr) and write them in simple plane text files so we
  *  can read them directly py the constructor.
+ *
+ *  The images can also be stored in a binary file (see BinaryImageHeader)
+ *  that is memory mapped and used in place, without parsing or copying the
+ *  sparse arrays. The mapping is shared between the copies of the image.
  */
 class TrainImage : public Image {
     public:
@@ -70,16 +118,57 @@ class TrainImage : public Image {
 
         /**
          *  Image constructor. Loads the image representation to memory.
+         *  Files with the BINARY_IMAGE_EXT extension are memory mapped,
+         *  any other file is parsed as text.
          *  @param filename Filename of the input image in sparse 
          *  representation.
          */
         TrainImage(const std::string& fileName);
 
+        /** \brief Copy constructors, the copy points to its own arrays or
+         *  shares the mapping of the original.
+         */
+        TrainImage(const TrainImage& img);
+        TrainImage(TrainImage&& img);
+
+        TrainImage& operator=(const TrainImage& img);
+        TrainImage& operator=(TrainImage&& img);
+
         /**
          * Destructor
          */        
          ~TrainImage() {}
 
+        /** \brief Writes the image in the binary format.
+         *  \param[in] fileName Path to the output file.
+         */
+        void writeBinary(const std::string& fileName);
+
+        /** \brief Builds the dense depth and label planes of the image.
+         *
+         *  The sparse representation is kept, it is still used to sample
+         *  the pixels of the image. The dense planes store the depth in 16
+         *  bits with 0 as the background value, so images with depths that
+         *  do not fit are left in sparse storage.
+         *
+         *  \return true if the image is now in dense storage.
+         */
+        bool densify();
+
+        /** \brief Returns the storage backend used by the lookups. */
+        imageStorage storage() const { 
+            return depthPlane.empty() ? SPARSE_STORAGE : DENSE_STORAGE; 
+        }
+
+        /** \brief Returns the dense depth plane, with a null data pointer
+         *  in SPARSE_STORAGE.
+         */
+        DepthPlane plane() const {
+            DepthPlane p = {depthPlane.empty() ? nullptr : depthPlane.data(), 
+                            width, height};
+            return p;
+        }
+
         /**
          * Gets the label value of the pixel in position (x,y). 
          * @param x Pixel X-axis coordinate.
@@ -87,7 +176,7 @@ class TrainImage : public Image {
          * @return Label value of the pixel (x,y) or DEFAULT_LABEL if
          * label not found.
          */
-        Label getLabel(const short & x, const short & y);
+        Label getLabel(const short & x, const short & y) const;
 
         /**
          * Gets the depth value of the pixel in position (x,y). 
@@ -96,7 +185,7 @@ class TrainImage : public Image {
          * @return depth value of the pixel (x,y) or DEFAULT_DEPTH if
          * depth not found.
          */
-        unsigned getDepth(const short & x, const short & y);
+        unsigned getDepth(const short & x, const short & y) const;
 
         /** \brief Sample a random non-zero element from a Yale representation of a sparse 
          *  matrix.
@@ -118,6 +207,28 @@ class TrainImage : public Image {
          */
         void getRandCoordByLabel(int pixNum, std::vector<PixelInfo>& p, int imgId);
 
+        /** \brief Samples pixels of the image with a given generator.
+         *
+         *  The pixels are drawn with replacement from the non-zero
+         *  elements. With byLabel they are divided equally among the
+         *  labels of the image, as in getRandCoordByLabel, which
+         *  oversamples the rare labels. The elements are grouped by label
+         *  with a counting sort in a buffer of the caller, so the
+         *  sampling does not allocate.
+         *
+         *  \param[in] pixNum Number of pixels to sample.
+         *  \param[in] byLabel Whether to stratify the pixels by label.
+         *  \param[in] imgId Id of the image in the sampled pixels.
+         *  \param[in,out] rng Generator of the sampling.
+         *  \param[out] out Array of pixNum pixels.
+         *  \param[in,out] scratch Buffer for the elements grouped by
+         *  label, reused between calls.
+         *  \return Number of pixels sampled, pixNum or 0 for an image
+         *  without non-zero elements.
+         */
+        int samplePixels(int pixNum, bool byLabel, int imgId, Rng& rng, 
+                         PixelInfo* out, std::vector<unsigned>& scratch) const;
+
         /**
          * Prints the content labels of the entire train image.
          * @param width Width of the image.
@@ -127,11 +238,28 @@ class TrainImage : public Image {
 
     private:
 
+        // Arrays of the images parsed from text.
         std::vector<Label> pixelLabels;
         std::vector<unsigned> pixelDepths;
         std::vector<unsigned> I;
         std::vector<unsigned short> J;
 
+        // Mapping of the images loaded from a binary file.
+        MappedFile::Ptr mapping;
+
+        // Views of the Yale representation, either into the vectors above
+        // or into the mapping.
+        const Label* labelView = nullptr;
+        const unsigned* depthView = nullptr;
+        const unsigned* IView = nullptr;
+        const unsigned short* JView = nullptr;
+        unsigned rowNum = 0;
+        unsigned nnz = 0;
+
+        // Dense row-major planes, only filled in DENSE_STORAGE.
+        std::vector<uint16_t> depthPlane;
+        std::vector<Label> labelPlane;
+
 
         /** 
          * Gets the index of the content array of the element in 
@@ -141,7 +269,15 @@ class TrainImage : public Image {
          * @return index of the content array or NOT_FOUND if pixel from 
          * background.
          */
-        int getIndex(const short &x, const short &y);
+        int getIndex(const short &x, const short &y) const;
+
+        /** \brief Maps an image in the binary format.
+         *  \param[in] fileName Path to the binary image.
+         */
+        void loadBinary(const std::string& fileName);
+
+        /** \brief Points the views to the vectors or to the mapping. */
+        void bindViews();
 };
 
 /**
@@ -180,7 +316,83 @@ class KinectImage : public Image {
          * @param y Pixel Y-axis coordinate.
          * @return Depth value of the (x,y) pixel.
          */
-        unsigned getDepth(const short & x, const short & y);   
+        unsigned getDepth(const short & x, const short & y) const;
+};
+
+/**
+ *  @class PaddedDepthImage
+ *
+ *  @brief Depth frame stored in one allocation surrounded by a guard band
+ *  of DEFAULT_DEPTH pixels.
+ *
+ *  The sensor depths are copied once, with the null depths already turned
+ *  into DEFAULT_DEPTH, so a lookup is a single load without the bounds
+ *  checks of KinectImage. The coordinates are clamped to the guard band
+ *  instead of tested: every pixel outside the frame reads DEFAULT_DEPTH,
+ *  like getDepth of the other images, and when the band is as wide as
+ *  the largest offset of the forest the clamp never moves a coordinate
+ *  displaced by an offset. Both are branch-free min/max operations.
+ */
+class PaddedDepthImage final : public Image {
+    public:
+
+        /** \brief Constructor. Allocates the frame filled with
+         *  DEFAULT_DEPTH.
+         *  \param[in] band Width of the guard band in pixels, at least 1.
+         *  \param[in] w Width of the image.
+         *  \param[in] h Height of the image.
+         */
+        PaddedDepthImage(int band = 1,
+                         unsigned short w = WIDTH,
+                         unsigned short h = HEIGHT);
+
+        /** \brief Copies a row-major plane of width * height sensor depths
+         *  in the frame. The guard band is not touched.
+         *  \param[in] d Depths in millimeters, 0 where there is no depth.
+         */
+        void assign(const unsigned short* d);
+
+        /** \brief Returns the width of the guard band. */
+        int guardBand() const { return band; }
+
+        /** \brief Returns the number of elements of a padded row. */
+        int rowStride() const { return stride; }
+
+        /** \brief Returns the padded rows, starting with the guard band. */
+        const uint32_t* paddedData() const { return depth.data(); }
+
+        /** \brief Returns the number of elements of the padded rows. */
+        size_t paddedSize() const { return depth.size(); }
+
+        /** \brief Depth of the pixel (x,y) or DEFAULT_DEPTH, without the
+         *  virtual call of getDepth.
+         *  \param[in] x Pixel X-axis coordinate.
+         *  \param[in] y Pixel Y-axis coordinate.
+         */
+        unsigned depthAt(const short x, const short y) const {
+            const int cx = std::min<int>(std::max<int>(x, -band), height - 1 + band);
+            const int cy = std::min<int>(std::max<int>(y, -band), width - 1 + band);
+
+            return depth[origin + cx * stride + cy];
+        }
+
+        /**
+         * Gets the depth value of the element in position (x,y).
+         * @param x Pixel X-axis coordinate.
+         * @param y Pixel Y-axis coordinate.
+         * @return Depth value of the (x,y) pixel.
+         */
+        unsigned getDepth(const short & x, const short & y) const;
+
+    private:
+        // Padded rows of the frame and the guard band.
+        std::vector<uint32_t> depth;
+
+        // Index of the pixel (0,0) inside the padded rows.
+        int origin;
+
+        int band;
+        int stride;
 };
 
 } // namespace rdf
@@ -1,6 +1,8 @@
 #ifndef RBGD_RF_IMAGEPOOL_HH__
 #define RBGD_RF_IMAGEPOOL_HH__
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <string>
 
@@ -12,20 +14,43 @@ namespace rdf {
 
 /** \brief Container for the training images.
  *
- *  Essentially a vector of images.
+ *  Essentially a vector of images, indexed through a permutation so the
+ *  pool is shuffled without copying the images.
+ *
+ *  With a capacity the pool is out of core: only the names of the files
+ *  are read by the constructor and at most capacity images are kept in
+ *  memory, evicting the least recently used. acquire() pins the images
+ *  of a range of the pool, e.g. the images of a tree, and queues them to
+ *  the loader threads in the order of the range, so the first images can
+ *  be used while the rest are still loading. An access to an image that
+ *  is not loaded yet waits for it.
  */
-class ImagePool { 
+class ImagePool {
     public:
         typedef std::shared_ptr<ImagePool> Ptr;
 
         /** \brief Constructor.
          *  Loads the image content of the specified directory.
          *  \param[in] dirname Directory path to the image pool.
+         *  \param[in] storage Storage backend of the loaded images.
+         *  \param[in] shard Index of the subset of images to load.
+         *  \param[in] shardNum Number of subsets the directory is divided
+         *  in. The images are sorted by name and the shard s keeps the
+         *  images s, s + shardNum, s + 2 * shardNum...
+         *  \param[in] capacity Maximum number of images in memory, 0 to
+         *  load every image in the constructor.
          */
-        ImagePool(const std::string dirname);
+        ImagePool(const std::string dirname,
+                  imageStorage storage = SPARSE_STORAGE,
+                  int shard = 0,
+                  int shardNum = 1,
+                  int capacity = 0);
+
+        /** \brief Stops the loader threads. **/
+        virtual ~ImagePool();
 
-        /** \brief Default destructor **/
-        virtual ~ImagePool() {}
+        ImagePool(const ImagePool&) = delete;
+        ImagePool& operator=(const ImagePool&) = delete;
 
         /** \brief Reorder the pool given a array of index.
          *  \param[in] index_vector The vector with the indices
@@ -33,7 +58,26 @@ class ImagePool {
         void poolReorder(std::vector<int>& index_vector);
 
         /** \brief Returns the number of images in the pool. */
-        inline int size() { return static_cast<int>(images.size()); }
+        inline int size() { return static_cast<int>(order.size()); }
+
+        /** \brief Returns the maximum number of images in memory, 0 if
+         *  every image is in memory.
+         */
+        int capacity() const { return slotNum; }
+
+        /** \brief Pins the images [first, last] of the pool in memory and
+         *  starts loading the missing ones in the background. Releases the
+         *  range acquired before. Does nothing if every image is in memory.
+         *
+         *  \param[in] first Index of the first image.
+         *  \param[in] last Index of the last image.
+         */
+        void acquire(int first, int last);
+
+        /** \brief Unpins the images of the range acquired, which stay in
+         *  memory until they are evicted.
+         */
+        void release();
 
         /** \brief this functions retrieves the pixel Label of an image given a
          *  PixelInfo object.
@@ -51,12 +95,94 @@ class ImagePool {
          */
         unsigned getDepth(const PixelInfo& pi);
 
-        TrainImage* getImgPtr(unsigned i);
+        /** \brief Returns an image of the pool, loading it if needed. In
+         *  an out of core pool the images outside the range acquired stay
+         *  valid until capacity other images are loaded.
+         *
+         *  \param[in] i Index of the image in the pool.
+         */
+        inline TrainImage* getImgPtr(unsigned i) {
+            if (slotNum == 0) {
+                return &images[order[i]];
+            }
+
+            TrainImage* img = pinned[order[i]].load(std::memory_order_acquire);
+            return (img != nullptr) ? img : load(order[i]);
+        }
+
+        /** \brief Gets the dense depth plane of every image of the pool.
+         *  In an out of core pool only the images of the range acquired
+         *  have a plane, the others are empty.
+         *
+         *  \param[out] planes Plane of each image, in pool order.
+         *  \return false if some image is in sparse storage, planes is then
+         *  left empty.
+         */
+        bool densePlanes(std::vector<DepthPlane>& planes);
 
-        TrainImage& operator[] (int i) { return images[i]; }
+        TrainImage& operator[] (int i) { return *getImgPtr(i); }
 
     private:
+        /** \brief State of a slot of the cache. */
+        enum slotState {
+            EMPTY_SLOT,
+            LOADING_SLOT,
+            READY_SLOT
+        };
+
+        /** \brief Slot of the cache of an out of core pool. */
+        struct Slot {
+            int file;
+            slotState state;
+            int pins;
+            uint64_t lastUse;
+        };
+
+        std::vector<std::string> fileNames;
+        imageStorage imgStorage;
+
+        // File of each image of the pool
+        std::vector<int> order;
+
+        // Images by file, or by slot in an out of core pool
         std::vector<TrainImage> images;
+
+        // Out of core pool
+        int slotNum;
+        std::vector<Slot> slots;
+        std::vector<int> slotOf;
+        std::unique_ptr<std::atomic<TrainImage*>[]> pinned;
+        NumRange acquired;
+        uint64_t clock;
+
+        std::deque<int> queue;
+        std::vector<pthread_t> loaders;
+        pthread_mutex_t mutex;
+        pthread_cond_t work;
+        pthread_cond_t loaded;
+        bool stop;
+
+        /** \brief Returns an image of a file that is not pinned, loading
+         *  it in the calling thread or waiting for the loader threads.
+         *  \param[in] file Index of the file.
+         */
+        TrainImage* load(int file);
+
+        /** \brief Takes the empty or least recently used slot that is not
+         *  pinned for a file. Called with the mutex locked.
+         *  \param[in] file Index of the file.
+         *  \return Index of the slot, in the loading state.
+         */
+        int reserve(int file);
+
+        /** \brief Marks a slot as loaded and publishes its image if it is
+         *  pinned. Called with the mutex locked.
+         *  \param[in] s Index of the slot.
+         */
+        void ready(int s);
+
+        /** \brief Main loop of the loader threads. */
+        static void* loaderThread(void* args);
 };
 
 } // namespace rdf
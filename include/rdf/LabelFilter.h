@@ -0,0 +1,98 @@
+/** \file LabelFilter.h
+ *
+ *  \brief Connected component smoothing of the label planes produced by
+ *  the classifier.
+ */
+#ifndef RGBD_RF_LABEL_FILTER_HH__
+#define RGBD_RF_LABEL_FILTER_HH__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <rdf/common.h>
+#include <rdf/ThreadPool.h>
+
+namespace rdf {
+
+/** \brief Repaints the small connected components of a label plane.
+ *
+ *  Label plane version of flood_fill_proc. The 4-connected components of
+ *  pixels with the same label are found with a union-find over tiles of
+ *  FRAME_TILE_SIZE rows. The tiles are labeled in parallel and then
+ *  merged along their borders. Every component of at most minSize pixels
+ *  takes the label most voted by the pixels around it, each adjacent
+ *  pair of pixels giving one vote and ties going to the lowest label.
+ *  Components without labeled neighbors keep their label, and the
+ *  DEFAULT_LABEL background is never changed.
+ *
+ *  All the components of a pass are repainted at once from the labels of
+ *  the previous pass, so the result does not depend on the scan order or
+ *  on the number of threads. The buffers are kept between frames.
+ */
+class LabelFilter {
+    public:
+        typedef std::shared_ptr<LabelFilter> Ptr;
+
+        /** \brief Constructor.
+         *  \param[in] labelNum Number of labels of the planes, labels above
+         *  it neither vote nor get votes.
+         *  \param[in] p Thread pool of the parallel loops.
+         */
+        LabelFilter(
+            int labelNum = NUMBER_OF_LABELS,
+            ThreadPool::Ptr p = ThreadPool::Ptr(new ThreadPool()));
+
+        /** \brief Smooths a label plane in place.
+         *
+         *  \param[in,out] labels Row-major plane of width * height labels.
+         *  \param[in] width Width of the plane.
+         *  \param[in] height Height of the plane.
+         *  \param[in] minSize Components of at most this many pixels are
+         *  repainted.
+         *  \param[in] iter Number of passes.
+         *  \return Number of pixels whose label changed.
+         */
+        int smooth(Label* labels, int width, int height, int minSize, int iter = 1);
+
+    private:
+        int labelNum;
+        ThreadPool::Ptr pool;
+
+        // Union-find forest, the root of a component is its first pixel
+        std::vector<int> parent;
+
+        // Root of the component of each pixel
+        std::vector<int> comp;
+
+        // Size of each component, indexed by its root
+        std::unique_ptr<std::atomic<int>[]> compSize;
+
+        // Index of each small component, indexed by its root
+        std::vector<int> slot;
+
+        // labelNum votes of each small component
+        std::unique_ptr<std::atomic<int>[]> votes;
+
+        size_t pixelCapacity;
+        size_t voteCapacity;
+
+        /** \brief One pass of smooth().
+         *  \return Number of pixels whose label changed.
+         */
+        int pass(Label* labels, int width, int height, int minSize);
+
+        /** \brief Returns the root of a pixel, compressing the path.
+         *  \param[in] p Pixel index.
+         */
+        int find(int p);
+
+        /** \brief Joins the components of two pixels under the lowest
+         *  root.
+         */
+        void join(int p, int q);
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_LABEL_FILTER_HH__
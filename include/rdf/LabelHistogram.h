@@ -0,0 +1,164 @@
+/** \file LabelHistogram.h
+ *
+ *  \brief Fixed-size label counts and posteriors used by the training and
+ *  the classification.
+ */
+#ifndef RGBD_RF_LABEL_HISTOGRAM_HH__
+#define RGBD_RF_LABEL_HISTOGRAM_HH__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <rdf/common.h>
+
+#define NLOG2N_TABLE_SIZE 65536
+
+namespace rdf {
+
+/** \brief Values of n * log2(n) for n in [0, NLOG2N_TABLE_SIZE). **/
+extern const std::vector<float> nLog2nTable;
+
+/** \brief Returns n * log2(n), with 0 for n = 0. The counts below
+ *  NLOG2N_TABLE_SIZE are read from a table computed once.
+ */
+inline float nLog2n(uint32_t n) {
+    return (n < NLOG2N_TABLE_SIZE) ? nLog2nTable[n] : 
+        static_cast<float>(n * log2(static_cast<double>(n)));
+}
+
+/** \brief Counts of the labels of a set of pixels.
+ *
+ *  The counts are integers in a fixed array of N labels, so a histogram
+ *  lives on the stack and the loops over the labels have a constant trip
+ *  count. The labels above the label number of the forest stay at zero
+ *  and do not change the entropy.
+ *
+ *  The entropy of n pixels with counts c_i is
+ *  H = (n log2 n - sum c_i log2 c_i) / n, so it needs neither a division
+ *  per label nor a branch for the empty labels.
+ */
+template <int N = NUMBER_OF_LABELS>
+class LabelHistogram {
+    public:
+        LabelHistogram() { clear(); }
+
+        /** \brief Sets every count to zero. **/
+        void clear() { std::fill(counts, counts + N, 0u); }
+
+        /** \brief Counts a pixel of a label in [1, N]. **/
+        void add(Label label) { counts[label - 1]++; }
+
+        /** \brief Count of the label i + 1. **/
+        uint32_t& operator[](int i) { return counts[i]; }
+        const uint32_t& operator[](int i) const { return counts[i]; }
+
+        /** \brief Returns the number of pixels. */
+        uint32_t total() const {
+            uint32_t n = 0;
+            for (int i = 0; i < N; i++) {
+                n += counts[i];
+            }
+            return n;
+        }
+
+        /** \brief Returns the number of labels with some pixel. */
+        int nonZero() const {
+            int n = 0;
+            for (int i = 0; i < N; i++) {
+                n += counts[i] > 0;
+            }
+            return n;
+        }
+
+        LabelHistogram& operator+=(const LabelHistogram& h) {
+            for (int i = 0; i < N; i++) {
+                counts[i] += h.counts[i];
+            }
+            return *this;
+        }
+
+        LabelHistogram operator-(const LabelHistogram& h) const {
+            LabelHistogram d;
+            for (int i = 0; i < N; i++) {
+                d.counts[i] = counts[i] - h.counts[i];
+            }
+            return d;
+        }
+
+        /** \brief Returns the sum of c log2 c over the counts. */
+        float sumNLog2n() const {
+            float s = 0.0f;
+            for (int i = 0; i < N; i++) {
+                s += nLog2n(counts[i]);
+            }
+            return s;
+        }
+
+        /** \brief Returns the Shannon entropy of the label distribution,
+         *  0 for an empty set.
+         */
+        float entropy() const {
+            const uint32_t n = total();
+            return (n > 0) ? (nLog2n(n) - sumNLog2n()) / float(n) : 0.0f;
+        }
+
+        /** \brief Writes the normalized distribution of the first labels.
+         *  \param[out] p Distribution, all zero for an empty set.
+         *  \param[in] labelNum Number of labels to write, at most N.
+         */
+        void distribution(float* p, int labelNum) const {
+            const uint32_t n = total();
+            for (int i = 0; i < labelNum; i++) {
+                p[i] = (n > 0) ? float(counts[i]) / float(n) : 0.0f;
+            }
+        }
+
+    private:
+        uint32_t counts[N];
+};
+
+/** \brief Information gain of a split given the label counts of each side.
+ *
+ *  A split with an empty side has a gain of exactly 0, so it is never
+ *  chosen over the first candidate with a positive gain.
+ *
+ *  \param[in] l Label counts of the left set.
+ *  \param[in] r Label counts of the right set.
+ *  \param[in] setEntropy The entropy of the set before the split.
+ *  \return The information gain of the split.
+ */
+template <int N>
+float splitGain(
+    const LabelHistogram<N>& l,
+    const LabelHistogram<N>& r,
+    const float setEntropy
+) {
+    const uint32_t lSize = l.total();
+    const uint32_t rSize = r.total();
+
+    return setEntropy - 
+        ((nLog2n(lSize) - l.sumNLog2n()) + (nLog2n(rSize) - r.sumNLog2n())) / 
+        float(lSize + rSize);
+}
+
+/** \brief Posterior probabilities of N labels, on the stack. **/
+template <int N = NUMBER_OF_LABELS>
+class LabelPosterior {
+    public:
+        LabelPosterior() { std::fill(p, p + N, 0.0f); }
+
+        /** \brief Returns the number of labels. */
+        static constexpr int size() { return N; }
+
+        float* data() { return p; }
+        const float* data() const { return p; }
+
+    private:
+        float p[N];
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_LABEL_HISTOGRAM_HH__
@@ -0,0 +1,61 @@
+/** \file MPIUtils.h
+ *
+ *  \brief MPI datatypes and reductions used to exchange the training
+ *  structures between the processes of the cluster.
+ */
+#ifndef RGBD_RF_MPI_UTILS_HH__
+#define RGBD_RF_MPI_UTILS_HH__
+
+#include <mpi.h>
+
+#include <rdf/common.h>
+#include <rdf/PixelInfo.h>
+#include <rdf/SplitCandidate.h>
+#include <rdf/TrainData.h>
+
+namespace rdf {
+
+/** \brief Datatype of a SplitCandidate.
+ *
+ *  Only the offsets, the threshold and the gain are transferred, the
+ *  virtual table pointers of the offsets are skipped. The extent is the
+ *  size of the class, so arrays of candidates are sent directly.
+ *
+ *  \return The committed datatype, created on the first call.
+ */
+MPI_Datatype splitCandidateType();
+
+/** \brief Datatype of a PixelInfo (id, x and y as 32 bit integers).
+ *  \return The committed datatype, created on the first call.
+ */
+MPI_Datatype pixelInfoType();
+
+/** \brief Datatype of a NumRange (start and end).
+ *  \return The committed datatype, created on the first call.
+ */
+MPI_Datatype numRangeType();
+
+/** \brief Reduction that keeps the split candidate with the largest gain,
+ *  element wise, for arrays of splitCandidateType().
+ *
+ *  The operation is not commutative: on equal gains the candidate of the
+ *  lowest rank wins, so every run selects the same candidates as the
+ *  master process would comparing them in rank order.
+ *
+ *  \return The operation, created on the first call.
+ */
+MPI_Op maxGainOp();
+
+/** \brief Broadcasts the whole training data in a single message. The
+ *  receivers are resized to the number of pixels of the root.
+ *
+ *  \param[in,out] td Training data, read at the root and written at the
+ *  other processes.
+ *  \param[in] root Rank of the process that holds the training data.
+ *  \param[in] comm Communicator.
+ */
+void broadcastTrainData(TrainData& td, int root, MPI_Comm comm);
+
+} // namespace rdf
+
+#endif // RGBD_RF_MPI_UTILS_HH__
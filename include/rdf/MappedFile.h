@@ -0,0 +1,47 @@
+/** \file MappedFile.h
+ *
+ *  \brief Read-only memory mapping of a file, shared by the structures that
+ *  use its content without copying it.
+ */
+#ifndef RGBD_RF_MAPPED_FILE_HH__
+#define RGBD_RF_MAPPED_FILE_HH__
+
+#include <memory>
+#include <string>
+
+namespace rdf {
+
+/** \brief Read-only memory map of a whole file.
+ *
+ *  The mapping lives as long as the object, so the structures that point
+ *  into it keep a shared pointer to the MappedFile.
+ */
+class MappedFile {
+    public:
+        typedef std::shared_ptr<const MappedFile> Ptr;
+
+        /** \brief Maps the whole file in memory.
+         *  \param[in] fileName Path to the file.
+         */
+        MappedFile(const std::string& fileName);
+
+        /** \brief Unmaps the file. **/
+        ~MappedFile();
+
+        /** \brief Returns a pointer to the beginning of the mapping. */
+        const char* data() const { return data_; }
+
+        /** \brief Returns the size of the mapping in bytes. */
+        size_t size() const { return size_; }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+    private:
+        const char* data_;
+        size_t size_;
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_MAPPED_FILE_HH__
@@ -1,11 +1,15 @@
 #ifndef RGBD_RF_NODE_HH__
 #define RGBD_RF_NODE_HH__
 
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <utility>
 
 #include <rdf/SplitCandidate.h>
 
+#define NODE_ARENA_BLOCK 1024
+
 namespace rdf {
 
 enum nodeType {
@@ -59,6 +63,44 @@ class SplitNode : public Node {
 };
 
 
+/** \brief Probability distribution of a leaf, a view of labelNum floats
+ *  in the slab of the arena of its tree.
+ */
+class LeafDistribution {
+    public:
+        LeafDistribution(float* d = nullptr, size_t n = 0)
+            : data_(d)
+            , size_(n) {}
+
+        size_t size() const { return size_; }
+
+        float* data() { return data_; }
+        const float* data() const { return data_; }
+
+        float* begin() { return data_; }
+        float* end() { return data_ + size_; }
+        const float* begin() const { return data_; }
+        const float* end() const { return data_ + size_; }
+
+        float& operator[](size_t i) { return data_[i]; }
+        const float& operator[](size_t i) const { return data_[i]; }
+
+        /** \brief Copies a distribution into the view, the values that do
+         *  not fit are dropped.
+         *  \param[in] prob The distribution to copy.
+         */
+        void assign(const std::vector<float>& prob) {
+            std::copy(prob.begin(), 
+                      prob.begin() + std::min(prob.size(), size_), 
+                      data_);
+        }
+
+    private:
+        float* data_;
+        size_t size_;
+};
+
+
 /** \brief The leaf nodes contain a vector with the learned probability 
  * distribution of the classes after training.
  */
@@ -66,14 +108,84 @@ class LeafNode : public Node {
     public: 
         LeafNode() {}
 
-        LeafNode(const std::vector<float>& prob)
+        LeafNode(const LeafDistribution& prob)
             : pDist(prob) {}
 
         virtual ~LeafNode() {}
     
         bool nodeType() { return LEAF; }
 
-        std::vector<float> pDist;
+        LeafDistribution pDist;
+};
+
+
+/** \brief Storage of the nodes of a tree.
+ *
+ *  The nodes are constructed in blocks of NODE_ARENA_BLOCK nodes of each
+ *  type, and the distributions of the leaves are taken from blocks of a
+ *  float slab, so growing a tree makes a few large allocations instead of
+ *  one or two per node. The nodes never move and live as long as the
+ *  arena: destroying or clearing the arena frees the whole tree at once.
+ */
+class NodeArena {
+    public:
+        typedef std::shared_ptr<NodeArena> Ptr;
+
+        NodeArena() = default;
+
+        NodeArena(const NodeArena&) = delete;
+        NodeArena& operator=(const NodeArena&) = delete;
+
+        /** \brief Creates a split node without parent, children and split
+         *  candidate.
+         */
+        SplitNode* split() { return create(splits); }
+
+        /** \brief Creates a split node with a split candidate.
+         *  \param[in] phi The split candidate of the node.
+         */
+        SplitNode* split(const SplitCandidate& phi) { 
+            return create(splits, phi); 
+        }
+
+        /** \brief Creates a leaf node with a zero distribution.
+         *  \param[in] labelNum Number of labels of the distribution.
+         */
+        LeafNode* leaf(size_t labelNum);
+
+        /** \brief Creates a leaf node with a copy of a distribution.
+         *  \param[in] prob The distribution of the leaf.
+         */
+        LeafNode* leaf(const std::vector<float>& prob);
+
+        /** \brief Returns the number of nodes of the arena. */
+        size_t size() const { return nodeNum; }
+
+        /** \brief Destroys every node of the arena. **/
+        void clear();
+
+    private:
+        template <typename T, typename... Args>
+        T* create(std::vector<std::vector<T> >& blocks, Args&&... args) {
+            // A block never grows past its capacity, so its nodes stay
+            // in place.
+            if (blocks.empty() || 
+                (blocks.back().size() == blocks.back().capacity())) {
+                blocks.emplace_back();
+                blocks.back().reserve(NODE_ARENA_BLOCK);
+            }
+
+            blocks.back().emplace_back(std::forward<Args>(args)...);
+            nodeNum++;
+
+            return &blocks.back().back();
+        }
+
+        size_t nodeNum = 0;
+
+        std::vector<std::vector<SplitNode> > splits;
+        std::vector<std::vector<LeafNode> > leaves;
+        std::vector<std::vector<float> > slab;
 };
 
 } // namespace rdf
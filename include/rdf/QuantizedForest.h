@@ -0,0 +1,234 @@
+/** \file QuantizedForest.h
+ *
+ *  \brief Quantized representation of a flattened forest, classified in
+ *  integer arithmetic.
+ */
+#ifndef RGBD_RF_QUANTIZED_FOREST_HH__
+#define RGBD_RF_QUANTIZED_FOREST_HH__
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <rdf/common.h>
+#include <rdf/Feature.h>
+#include <rdf/FlatForest.h>
+#include <rdf/MappedFile.h>
+#include <rdf/Image.h>
+#include <rdf/PixelInfo.h>
+
+#define QUANT_FOREST_MAGIC 0x46514452
+#define QUANT_FOREST_VERSION 1
+#define QUANT_FOREST_EXT ".qforest"
+
+/**
+ *  Largest number of labels of a quantized forest, the labels of the top-k
+ *  entries of the leaves are stored in 8 bits.
+ */
+#define QUANT_FOREST_MAX_LABELS 256
+
+/**
+ *  Fixed point scale of the probabilities of the leaves.
+ */
+#define QUANT_PROB_ONE 255
+
+namespace rdf {
+
+/** \brief Packed split record of a quantized tree.
+ *
+ *  The offsets are the ones of the FlatSplit divided by 2^shift, the shift
+ *  of the whole forest, and the threshold is compared with the integer
+ *  difference of depths. The children are encoded like the ones of
+ *  FlatSplit.
+ */
+struct QuantSplit {
+    int16_t ux;
+    int16_t uy;
+    int16_t vx;
+    int16_t vy;
+    uint16_t t;
+    uint16_t pad;
+    int32_t left;
+    int32_t right;
+};
+
+/** \brief Header of the binary quantized forest format.
+ *
+ *  The header is followed by the arrays in native byte order: the roots
+ *  (treeNum x int32), the split records (splitNum x QuantSplit) and the
+ *  leaf table (leafNum rows of leafBytes() bytes).
+ */
+struct QuantForestHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t labelNum;
+    uint32_t treeNum;
+    uint32_t splitNum;
+    uint32_t leafNum;
+    uint32_t topK;
+    uint32_t offsetShift;
+};
+
+/** \brief Flattened forest with 16 bit splits and 8 bit leaves.
+ *
+ *  The thresholds are rounded up to integers, since the difference of
+ *  depths they are compared with is an integer, so the splits are exact.
+ *  The thresholds must be at most 65535, build() fails on larger ones.
+ *  The offsets keep 16 bits: the forest is shifted right until its
+ *  largest offset fits, which is exact when the offsets already fit. The
+ *  leaves keep each probability as a fixed point
+ *  value of 8 bits, or only the k most probable labels as pairs of 8 bit
+ *  label and probability.
+ *
+ *  A pixel is classified without floating point: the probabilities of the
+ *  leaves are added as integers and only the probability returned is
+ *  converted. The arrays are either built from a FlatForest or mapped from
+ *  a binary file, like the ones of FlatForest.
+ */
+class QuantizedForest {
+    public:
+
+        /** \brief Default empty constructor. **/
+        QuantizedForest() : labelNum(0), topK(0), shift(0) {}
+
+        QuantizedForest(const QuantizedForest&) = delete;
+        QuantizedForest& operator=(const QuantizedForest&) = delete;
+
+        /** \brief Quantizes a flattened forest, exits if a threshold is
+         *  above 65535.
+         *  \param[in] flat Flattened forest.
+         *  \param[in] k Number of labels kept per leaf, 0 or at least the
+         *  number of labels to keep every label.
+         */
+        void build(const FlatForest& flat, const int k);
+
+        /** \brief Writes the forest in the binary format.
+         *  \param[in] fileName Path to the output file.
+         */
+        void write(const std::string& fileName) const;
+
+        /** \brief Maps a forest in the binary format, replacing the
+         *  current one. The arrays are used from the mapping.
+         *  \param[in] fileName Path to the binary quantized forest.
+         */
+        void map(const std::string& fileName);
+
+        /** \brief Drops the forest. */
+        void clear();
+
+        /** \brief Returns true if no forest has been quantized. */
+        bool empty() const { return rootNum == 0; }
+
+        /** \brief Returns the number of trees of the forest. */
+        int treeNum() const { return static_cast<int>(rootNum); }
+
+        /** \brief Returns the number of labels of the leaf distributions. */
+        int labels() const { return labelNum; }
+
+        /** \brief Returns the number of labels kept per leaf, 0 if every
+         *  label is kept.
+         */
+        int topEntries() const { return topK; }
+
+        /** \brief Returns the size of a row of the leaf table. */
+        int leafBytes() const { return (topK > 0) ? 2 * topK : labelNum; }
+
+        /** \brief Returns the size of the arrays of the forest. */
+        size_t bytes() const {
+            return rootNum * sizeof(int32_t) + splitNum * sizeof(QuantSplit) +
+                   size_t(leafNum) * leafBytes();
+        }
+
+        /** \brief Returns the largest absolute offset component of the
+         *  splits, like FlatForest::maxOffset.
+         */
+        int maxOffset() const { return offsetBound; }
+
+        /** \brief Drops a pixel down every tree and returns the label with
+         *  the highest posterior probability. The ties go to the lowest
+         *  label, like RandomForest::predict.
+         *
+         *  \param[in] img Image or padded frame of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \param[out] prob Posterior probability of the returned label.
+         *  \return Label of the classification.
+         */
+        template <typename Img>
+        Label classify(const Img& img, const PixelInfo& pixel, float& prob) const {
+            uint32_t postSum[QUANT_FOREST_MAX_LABELS];
+            const uint32_t dx = img.getDepth(pixel.x, pixel.y);
+            const int width = leafBytes();
+            uint32_t i;
+            int j;
+
+            std::fill(postSum, postSum + labelNum, 0u);
+
+            for (i = 0; i < rootNum; i++) {
+                int32_t idx = rootView[i];
+
+                while (idx >= 0) {
+                    const QuantSplit& s = splitView[idx];
+                    const uint32_t d = depthDifference(
+                        s.ux * (1 << shift), s.uy * (1 << shift),
+                        s.vx * (1 << shift), s.vy * (1 << shift),
+                        pixel, dx, img);
+
+                    idx = (d < s.t) ? s.left : s.right;
+                }
+
+                const uint8_t* q = &leafView[static_cast<size_t>(~idx) * width];
+
+                if (topK == 0) {
+                    for (j = 0; j < labelNum; j++) {
+                        postSum[j] += q[j];
+                    }
+                }
+                else {
+                    for (j = 0; j < topK; j++) {
+                        postSum[q[2 * j]] += q[2 * j + 1];
+                    }
+                }
+            }
+
+            int maxLabel = 0;
+
+            for (j = 1; j < labelNum; j++) {
+                if (postSum[j] > postSum[maxLabel]) {
+                    maxLabel = j;
+                }
+            }
+
+            prob = postSum[maxLabel] / (float(QUANT_PROB_ONE) * rootNum);
+            return maxLabel + 1;
+        }
+
+    private:
+        int labelNum;
+        int topK;
+        int shift;
+
+        // Arrays of the forest quantized from a FlatForest.
+        std::vector<QuantSplit> splits;
+        std::vector<uint8_t> leafProbs;
+        std::vector<int32_t> roots;
+
+        // Mapping of the forest loaded from a binary file.
+        MappedFile::Ptr mapping;
+
+        // Views of the arrays, either into the vectors above or into the
+        // mapping.
+        const QuantSplit* splitView = nullptr;
+        const uint8_t* leafView = nullptr;
+        const int32_t* rootView = nullptr;
+        uint32_t rootNum = 0;
+        uint32_t splitNum = 0;
+        uint32_t leafNum = 0;
+        int32_t offsetBound = 0;
+
+        /** \brief Points the views to the vectors or to the mapping. */
+        void bindViews();
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_QUANTIZED_FOREST_HH__
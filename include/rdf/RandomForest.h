@@ -2,12 +2,26 @@
 #define RGBD_RF_RANDOM_FOREST_HH__
 
 #include <rdf/common.h>
+#include <rdf/FeatureKernel.h>
+#include <rdf/FlatForest.h>
 #include <rdf/Image.h>
+#include <rdf/LabelHistogram.h>
 #include <rdf/PixelInfo.h>
+#include <rdf/QuantizedForest.h>
 #include <rdf/TrainData.h>
 #include <rdf/Node.h>
 #include <rdf/Offset.h>
 #include <rdf/SplitCandidate.h>
+#include <rdf/ThreadPool.h>
+#include <rdf/TrainStats.h>
+
+/** \brief Tag of the messages that carry a serialized tree. */
+#define TREE_TAG 90
+
+// Tree checkpoint format ("RDCK" in little endian and format version).
+#define CHECKPOINT_MAGIC 0x4b434452
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_EXT ".ckpt"
 
 namespace rdf {
 
@@ -18,6 +32,57 @@ enum pixelSet {
     RIGHT = 1
 };
 
+/** \brief Strategy used to score the thresholds of a split candidate.
+ *
+ *  EXHAUSTIVE_SPLIT evaluates G() once per (offset pair, threshold), reading
+ *  every pixel of the range each time. HISTOGRAM_SPLIT computes the feature
+ *  response once per offset pair, bins the responses by the sorted
+ *  thresholds and scores all of them in one sweep over the bins.
+ */
+enum splitEval {
+    EXHAUSTIVE_SPLIT = 0,
+    HISTOGRAM_SPLIT  = 1
+};
+
+/** \brief Order in which the nodes of a tree are grown.
+ *
+ *  DEPTH_FIRST_GROWTH splits one node at a time from a stack, with one
+ *  MPI round trip per node. LEVEL_WISE_GROWTH splits every open node of a
+ *  depth in one batch, with one MPI round trip per level.
+ */
+enum treeGrowth {
+    DEPTH_FIRST_GROWTH = 0,
+    LEVEL_WISE_GROWTH  = 1
+};
+
+/** \brief Distribution of the training work among the MPI processes.
+ *
+ *  CANDIDATE_PARALLEL replicates the images and the training data in every
+ *  process and divides the split candidates among them. DATA_PARALLEL
+ *  gives each process a shard of the images and of the training data: all
+ *  the processes evaluate the same candidates on their pixels and the label
+ *  histograms are reduced in the cluster.
+ */
+enum trainDistribution {
+    CANDIDATE_PARALLEL = 0,
+    DATA_PARALLEL      = 1
+};
+
+/** \brief Random streams of the training, derived with streamSeed().
+ *
+ *  PERMUTATION_STREAM shuffles the images of the pool and TREE_STREAM
+ *  holds one stream per tree, both derived from the seed of the training
+ *  parameters. From the stream of a tree, SAMPLE_STREAM samples its pixels
+ *  and SPLIT_STREAM generates the candidates of each round of split
+ *  search, one stream per node, process and task.
+ */
+enum randomStream {
+    PERMUTATION_STREAM = 0,
+    TREE_STREAM        = 1,
+    SAMPLE_STREAM      = 2,
+    SPLIT_STREAM       = 3
+};
+
 /** \brief Random forest training parameters.
  *
  *  This structure is used to specify all the training parameters of the
@@ -42,6 +107,44 @@ enum pixelSet {
  *  the offsets.
  *  @param thresholdRange is the range of values that can be generated 
  *  for the thresholds.
+ *  @param splitMode is the strategy used to evaluate the thresholds of
+ *  each offset pair (HISTOGRAM_SPLIT by default).
+ *  @param storage is the storage backend of the training images
+ *  (DENSE_STORAGE by default, SPARSE_STORAGE for memory constrained runs).
+ *  @param growth is the order in which the nodes are grown
+ *  (DEPTH_FIRST_GROWTH by default).
+ *  @param distribution is the division of the training work among the MPI
+ *  processes (CANDIDATE_PARALLEL by default). DATA_PARALLEL always grows
+ *  the trees depth first.
+ *  @param groupNum is the number of groups of MPI processes that train
+ *  different trees at the same time (1 by default). The trees are handed
+ *  to the groups as they become idle, or by their ids modulo groupNum
+ *  when groupNum does not divide the number of processes, since the
+ *  trees depend on the size of the group that trains them.
+ *  @param seed is the seed of every random stream of the training (1 by
+ *  default). Two trainings with the same seed and the same numbers of
+ *  processes and groups produce the same forest, whatever the number of
+ *  threads.
+ *  @param statsFile is the JSON file where the master process writes the
+ *  counters of every node, tree and process of the training (empty by
+ *  default, no file).
+ *  @param progress is whether the leader of each group prints the
+ *  progress of the tree it trains (false by default).
+ *  @param checkpointDir is the directory where the leader of each group
+ *  saves every tree it finishes (empty by default, no checkpoints). A
+ *  training with the same directory and parameters loads the saved
+ *  trees and only trains the others. Each tree only depends on the seed
+ *  and on the size of the group that trains it, which is fixed by the
+ *  numbers of processes and groups, so with the same processes and
+ *  groups the resumed forest is the one of an uninterrupted run.
+ *  @param imageCache is the number of training images each process keeps
+ *  in memory (0 by default, every image is loaded before the training).
+ *  With a cache the images of a tree are loaded when the tree starts,
+ *  while its train data is sampled, so only the images of a tree must
+ *  fit in memory.
+ *  @param sampleByLabel is whether the pixels sampled from each image are
+ *  divided equally among its labels, which oversamples the rare body
+ *  parts (false by default, uniform sampling).
  */
 class  trainParams {
     public:
@@ -57,8 +160,75 @@ class  trainParams {
             int thresholdNum;
             NumRange offsetRange;
             NumRange thresholdRange;
+            splitEval splitMode;
+            imageStorage storage;
+            treeGrowth growth;
+            trainDistribution distribution;
+            int groupNum;
+            uint64_t seed;
+            string statsFile;
+            bool progress;
+            string checkpointDir;
+            int imageCache;
+            bool sampleByLabel;
 
-            trainParams() {};
+            trainParams() 
+                : splitMode(HISTOGRAM_SPLIT)
+                , storage(DENSE_STORAGE)
+                , growth(DEPTH_FIRST_GROWTH)
+                , distribution(CANDIDATE_PARALLEL)
+                , groupNum(1)
+                , seed(1)
+                , progress(false)
+                , imageCache(0)
+                , sampleByLabel(false) {};
+};
+
+/**
+ *  @class classifyParams
+ *
+ *  Options of the sparse inference mode of RandomForest::classifyFrame.
+ *  The pixels that are not classified get DEFAULT_LABEL and probability
+ *  0. The default options classify every pixel with depth with all the
+ *  trees.
+ *
+ *  @param rows is the range [start, end) of rows of the region of
+ *  interest, clipped to the frame.
+ *  @param cols is the range [start, end) of columns of the region of
+ *  interest, clipped to the frame.
+ *  @param mask is a width * height foreground mask, only the pixels with a
+ *  non-zero value are classified (nullptr to classify all of them).
+ *  @param stride is the side of the blocks of pixels that share the
+ *  result of their first pixel (1 to classify every pixel).
+ *  @param earlyExit is the mean probability of the leading label that
+ *  stops evaluating the trees of a pixel, which also stop when the
+ *  leading label is already decided (0 to always use every tree).
+ */
+class classifyParams {
+    public:
+            NumRange rows;
+            NumRange cols;
+            const uint8_t* mask;
+            int stride;
+            float earlyExit;
+
+            classifyParams()
+                : rows(0, std::numeric_limits<int>::max())
+                , cols(0, std::numeric_limits<int>::max())
+                , mask(nullptr)
+                , stride(1)
+                , earlyExit(0.0f) {};
+};
+
+/** \brief Header of a tree checkpoint, followed by the tree serialized
+ *  by RandomForest::packTree.
+ */
+struct CheckpointHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    int32_t treeID;
+    uint32_t size;
 };
 
 /**
@@ -67,14 +237,15 @@ class  trainParams {
  *  This structure is used for the function bestSplitCandidate to
  *  generate a Split Canditate to separate the train data examples.
  *
+ *  @param trainDataRange is the range of the training data to split.
+ *  @param offsetNum is the number of offset pairs to generate.
  */
 struct SCParams {
     RandomForest* forest;
     NumRange trainDataRange;
+    unsigned offsetNum;
 };
 
-void* findSplitThread (void* args);
-
 
 
 /** \brief Random forest algorithm.
@@ -85,6 +256,9 @@ class RandomForest {
         // Training parameters
         trainParams* tp;
 
+        /* Parameters created by the loaders, owned by the forest */
+        std::unique_ptr<trainParams> ownParams;
+
         /* Images */
         ImagePool::Ptr image_pool;
 
@@ -94,6 +268,40 @@ class RandomForest {
         /* Array of the trees of the forest */
         std::vector <Node *> trees;
 
+        /* Storage of the nodes of each tree */
+        std::vector <NodeArena::Ptr> arenas;
+
+        /* Storage of the tree being trained or loaded */
+        NodeArena::Ptr arena;
+
+        /* Flattened trees used by predict */
+        FlatForest flat;
+
+        /* Quantized trees, used by predict instead when not empty */
+        QuantizedForest quant;
+
+        /* Workers of the parallel loops */
+        ThreadPool::Ptr pool;
+
+        /* Posterior buffer of each worker of classifyFrame */
+        std::vector<std::vector<float> > scratch;
+
+        /* Processes that train the current tree */
+        MPI_Comm comm;
+
+        /* Dense depth planes of the pool, empty unless all are dense. With
+           an image cache only the images of the current tree have one. */
+        std::vector<DepthPlane> planes;
+
+        /* Random stream of the tree being trained */
+        uint64_t treeSeed;
+
+        /* Rounds of split search of the tree being trained */
+        uint64_t splitRound;
+
+        /* Counters of the last training */
+        TrainStats stats;
+
         /** \brief Returns the information gain by splitting the training set by the 
          * specified SplitCandidate.
          *
@@ -113,22 +321,60 @@ class RandomForest {
 
         /** \brief Shannon Entropy function
          *
-         *  \param[in] probabilities is a vector that contains the percentage of
-         *  each label occurrence in a set.
+         *  \param[in] counts The label counts of a set.
          *
-         *  \return the entroply associated with this percentages.
+         *  \return the entroply of the distribution of the labels.
          */
-        float H(const std::vector<float>& percentage);
+        float H(const LabelHistogram<>& counts) { return counts.entropy(); }
+
+        /** \brief Computes the feature response of every pixel in the range
+         *  for the given pair of offsets.
+         *
+         *  \param[in] u First pixel offset.
+         *  \param[in] v Second pixel offset.
+         *  \param[in] range The range of the training data.
+         *  \param[in] block The pixels of the range filled by pixelBlock,
+         *  evaluated with the vectorized kernel unless empty.
+         *  \param[out] responses Feature response of each pixel of the range.
+         */
+        void featureResponses(
+            const Offset& u,
+            const Offset& v,
+            NumRange range,
+            const FeatureBlock& block,
+            std::vector<float>& responses
+        );
 
-        /** \brief Returns a normalized vector with the dirstribution of each 
-         * type of label in the TrainData vector.
+        /** \brief Fills the structure of arrays of the pixels of a range
+         *  of the training data, shared by all the offset pairs evaluated
+         *  on the range. The block is left empty if some image of the pool
+         *  is in sparse storage.
+         *
+         *  \param[in] range The range of the training data.
+         *  \param[out] block The pixels of the range.
+         */
+        void pixelBlock(NumRange range, FeatureBlock& block);
+
+        /** \brief Histogram based version of bestSplitCandidate.
+         *
+         *  The feature response of every pixel is computed once per offset
+         *  pair and placed in the bin delimited by the sorted thresholds, so
+         *  the left and right label counts of every threshold come out of a
+         *  prefix sum over the bins.
+         *
+         *  \param[in] params The information to generate a split candidate.
+         *  \return The best split candidate generated.
+         */
+        SplitCandidate bestSplitHistogram(SCParams& params);
+
+        /** \brief Returns the counts of each type of label in a range of
+         *  the TrainData vector.
          *
          *  \param[in] begin First range index of the TrainData vector  
-         *  \param[in] begin Second range index of the TrainData vector  
-         *  \return A normalize vector with the distribution of each type of 
-         *  label
+         *  \param[in] end Last range index of the TrainData vector  
+         *  \return The label counts of the range.
          */
-        std::vector<float> labelDistribution(const size_t begin, const size_t end);
+        LabelHistogram<> labelCounts(const int begin, const int end);
 
         /**
          *  This function determines if the given node stays as a leaf
@@ -145,6 +391,57 @@ class RandomForest {
                        Node *currentNode,
                        NumRange range);
 
+        /** \brief Creates a new node for the range of training data.
+         *
+         *  Decides with testNode whether the node is a leaf, in which case
+         *  its distribution is computed, or a split node to be trained.
+         *
+         *  \param[out] n The new node.
+         *  \param[in] parent Parent of the new node, nullptr for the root.
+         *  \param[in] range Range of the training data of the node.
+         *  \param[in,out] nodeCount Id of the next node of the tree.
+         *  \return SPLIT or LEAF.
+         */
+        bool growNode(
+            Node** n, 
+            Node* parent, 
+            NumRange range, 
+            unsigned& nodeCount
+        );
+
+        /** \brief Creates a new node from the label counts of its training
+         *  data in the whole cluster. Used by the data parallel training,
+         *  where each process only holds a shard of the data of the node.
+         *
+         *  \param[out] n The new node.
+         *  \param[in] parent Parent of the new node, nullptr for the root.
+         *  \param[in] counts Number of pixels of each label in the node.
+         *  \param[in,out] nodeCount Id of the next node of the tree.
+         *  \return SPLIT or LEAF.
+         */
+        bool growShardedNode(
+            Node** n, 
+            Node* parent, 
+            const LabelHistogram<>& counts, 
+            unsigned& nodeCount
+        );
+
+        /** \brief Counts the pixels of each label that go to the left set of
+         *  every candidate, for the local shard of the training data.
+         *
+         *  \param[in] range Range of the local training data of the node.
+         *  \param[in] pairs Offset pairs of the candidates.
+         *  \param[in] thresholds Thresholds of each offset pair, thresholdNum
+         *  consecutive values per pair.
+         *  \param[out] counts Left label counts of each candidate.
+         */
+        void shardHistograms(
+            NumRange range,
+            const std::vector<SplitCandidate>& pairs,
+            const std::vector<float>& thresholds,
+            std::vector<LabelHistogram<> >& counts
+        );
+
         /** \brief Traverse the tree up to the root to figure out the nodes 
          * depth.
          *  \param[in] n Pointer to the node.
@@ -166,7 +463,7 @@ class RandomForest {
             const Offset& u, 
             const Offset& v,
             const PixelInfo& pi,
-            Image *img
+            const Image *img
         );
 
         /** 
@@ -180,6 +477,51 @@ class RandomForest {
          * @return index that defines the best split of the array.
          */
         int sortData (NumRange range, SplitCandidate f);
+
+        /** \brief Sets the bits of the pixels of a range that a split
+         *  candidate sends to the left set, evaluating the feature kernel
+         *  once over the range.
+         *
+         *  \param[in] range The range of the training data.
+         *  \param[in] f The split candidate.
+         *  \param[in] maskStart Bit of the mask of the first pixel.
+         *  \param[in,out] mask Bitmask of the left set, with the bits of
+         *  the range cleared.
+         */
+        void splitMask (
+            NumRange range,
+            const SplitCandidate& f,
+            int maskStart,
+            std::vector<uint8_t>& mask
+        );
+
+        /** \brief Sorts the train data of several nodes given their best
+         *  split, and returns the index that splits each range.
+         *
+         *  The sides of the pixels are decided once per level: the bits of
+         *  the pixels of all the ranges, one after another, are divided in
+         *  whole bytes among the processes of the communicator, evaluated in
+         *  tasks of the thread pool and gathered by every process, instead
+         *  of each process classifying every pixel again. Levels of fewer
+         *  than SHARED_MASK_MIN_PIXELS pixels, and the local shards of the
+         *  data-parallel mode, are decided by each process alone. The
+         *  ranges are then partitioned through an index array, one node per
+         *  task, or with the whole pool for a single node.
+         *
+         *  Every process of the communicator must call it with the same
+         *  ranges and splits when shared is true.
+         *
+         *  \param[in] ranges Ranges of the train data of the nodes.
+         *  \param[in] splits Best split of each node.
+         *  \param[out] pivots First index of the right set of each node.
+         *  \param[in] shared Whether the processes hold the same train data.
+         */
+        void partitionNodes (
+            const std::vector<NumRange>& ranges,
+            const std::vector<SplitCandidate>& splits,
+            std::vector<int>& pivots,
+            bool shared = true
+        );
      
         /**
          *  classifyPixel
@@ -194,7 +536,115 @@ class RandomForest {
          *  @return LEFT or RIGHT depending on the classification of the
          *  pixel x by the feature phi.
          */
-        pixelSet classifyPixel(SplitCandidate phi, PixelInfo x, Image *img); 
+        pixelSet classifyPixel(SplitCandidate phi, PixelInfo x, const Image *img); 
+
+        /** \brief Classifies the pixel i of the training data, with the
+         *  depth at the pixel cached in the training data.
+         *
+         *  \param[in] phi The split candidate.
+         *  \param[in] i Index of the pixel in the training data.
+         *  \return LEFT or RIGHT.
+         */
+        pixelSet classifyTrainPixel(const SplitCandidate& phi, int i);
+
+        /** \brief Drops a pixel down every tree and returns the label with
+         *  the highest posterior probability.
+         *
+         *  \param[in] img Image of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \param[out] postProb Buffer of labelNum floats for the posterior.
+         *  \param[out] prob Posterior probability of the returned label.
+         *  \return Label of the classification.
+         */
+        Label posteriorLabel(
+            const Image* img, 
+            const PixelInfo& pixel, 
+            float* postProb,
+            float& prob
+        );
+
+        /** \brief Drops a pixel down one tree.
+         *
+         *  \param[in] tree Index of the tree.
+         *  \param[in] img Image of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \return The probability distribution of the leaf reached.
+         */
+        const float* treeLeaf(
+            const int tree,
+            const Image& img,
+            const PixelInfo& pixel
+        );
+
+        /** \brief Drops a pixel of a padded frame down one tree. */
+        const float* treeLeaf(
+            const int tree,
+            const PaddedDepthImage& img,
+            const PixelInfo& pixel
+        );
+
+        /** \brief Adds the leaf distributions of the trees for a pixel
+         *  and returns the label with the highest posterior probability,
+         *  stopping early if earlyExit > 0 (see classifyParams).
+         *
+         *  \param[in] img Image of the pixel.
+         *  \param[in] pixel Pixel to classify.
+         *  \param[out] postProb Buffer of labelNum floats for the
+         *  posterior.
+         *  \param[out] prob Posterior probability of the returned label.
+         *  \param[in] earlyExit Probability that stops the trees.
+         *  \return Label of the classification.
+         */
+        template<typename Img>
+        Label pixelPosterior(
+            const Img& img,
+            const PixelInfo& pixel,
+            float* postProb,
+            float& prob,
+            const float earlyExit
+        );
+
+        /** \brief Classifies one pixel of a frame into the planes of
+         *  classifyFrame.
+         *
+         *  \param[in] img Frame of the pixel.
+         *  \param[in] x Row of the pixel.
+         *  \param[in] y Column of the pixel.
+         *  \param[in] worker Worker of the thread pool, owner of the
+         *  posterior buffer.
+         *  \param[out] labels Plane of width * height labels.
+         *  \param[out] probs Plane of width * height floats, or nullptr.
+         *  \param[in] cp Options of the inference.
+         */
+        template<typename Img>
+        void framePixel(
+            const Img& img,
+            const int x,
+            const int y,
+            const int worker,
+            Label* labels,
+            float* probs,
+            const classifyParams& cp
+        );
+
+        /** \brief Classifies the pixels of a frame selected by the
+         *  parameters, see classifyFrame.
+         */
+        template<typename Img>
+        void classifyRegion(
+            const Img& img,
+            Label* labels,
+            float* probs,
+            const classifyParams& cp
+        );
+
+        /** \brief Returns the label with the highest posterior probability.
+         *
+         *  \param[in] postProb Sum of the leaf distributions of the trees.
+         *  \param[out] prob Posterior probability of the returned label.
+         *  \return Label of the classification.
+         */
+        Label maxPosterior(const float* postProb, float& prob) const;
 
          /**
          *  This function run the training of a single tree.
@@ -208,6 +658,151 @@ class RandomForest {
          */
         void train (int treeID);
 
+        /** \brief Trains a single tree one level at a time.
+         *
+         *  All the open nodes of a depth are split in one batch: the
+         *  candidates of every node go to the thread pool as one job, the
+         *  cluster exchanges one broadcast and one reduction per level and
+         *  the partitions of the nodes are sorted in parallel.
+         *
+         *  \param[in] treeID Id of the tree to train.
+         */
+        void trainLevelWise (int treeID);
+
+        /** \brief Trains a single tree with the training data sharded among
+         *  the MPI processes.
+         *
+         *  The master process generates the candidates of each node, every
+         *  process counts the labels of its pixels on each side of every
+         *  candidate and a sum reduction gives all of them the same counts
+         *  to choose the split and to stop. Each process sorts only its own
+         *  pixels, and every process ends with the same tree.
+         *
+         *  \param[in] treeID Id of the tree to train.
+         */
+        void trainSharded (int treeID);
+
+        /** \brief Samples the training data of a tree and trains it with
+         *  the processes of the group.
+         *
+         *  \param[in] treeID Id of the tree to train.
+         *  \param[in] images Range of images of the pool of the tree.
+         */
+        void trainTree (int treeID, NumRange images);
+
+        /** \brief Divides the processes in groups and loads the images of
+         *  the training. Checks the parameters in tp.
+         */
+        void beginTraining ();
+
+        /** \brief Returns the number of groups of processes of the
+         *  training, tp->groupNum bounded by the number of processes.
+         */
+        int groupCount ();
+
+        /** \brief Trains trees with the groups of processes, collects them
+         *  in the master and compiles the forest. Ends the groups of
+         *  beginTraining. When the groups have different sizes each tree
+         *  is trained by the group of its id modulo the number of groups.
+         *
+         *  \param[in] treeIDs Ids of the trees to train.
+         *  \param[in] images Range of images of the pool of each tree.
+         *  \param[in] fingerprint Hash of the training parameters of the
+         *  checkpoints of the trees, 0 to not save them.
+         */
+        void trainTrees (
+            const std::vector<int>& treeIDs,
+            const std::vector<NumRange>& images,
+            uint64_t fingerprint
+        );
+
+        /** \brief Serializes a tree to send it through MPI.
+         *
+         *  \param[in] root Root of the tree.
+         *  \param[out] buffer Serialized tree.
+         */
+        static void packTree (Node* root, std::vector<char>& buffer);
+
+        /** \brief Returns a hash of the training parameters that define
+         *  the trees, which must match to resume from a checkpoint.
+         */
+        uint64_t paramsFingerprint ();
+
+        /** \brief Saves a finished tree in the checkpoint directory. The
+         *  file is written under a temporary name and renamed, so an
+         *  interrupted write never leaves a truncated checkpoint.
+         *
+         *  \param[in] treeID Id of the tree.
+         *  \param[in] fingerprint Hash of the training parameters.
+         */
+        void writeCheckpoint (int treeID, uint64_t fingerprint);
+
+        /** \brief Loads a tree from the checkpoint directory.
+         *
+         *  \param[in] treeID Id of the tree.
+         *  \param[in] fingerprint Hash of the training parameters.
+         *  \return true if there is a valid checkpoint of the tree.
+         */
+        bool readCheckpoint (int treeID, uint64_t fingerprint);
+
+        /** \brief Builds the tree serialized by packTree.
+         *
+         *  \param[in] buffer Serialized tree.
+         *  \param[in,out] arena Storage of the nodes of the tree.
+         *  \return Root of the tree.
+         */
+        static Node* unpackTree (const std::vector<char>& buffer, 
+                                 NodeArena& arena);
+
+        /** \brief Worker side of the training of a tree, runs the split
+         *  searches broadcast by the master process.
+         */
+        void trainWorker ();
+
+        /** \brief Finds the best split candidate of a set of ranges.
+         *
+         *  The candidates of all the ranges are evaluated as a single job
+         *  of the thread pool.
+         *
+         *  \param[in] ranges Ranges of the training data.
+         *  \return The best split candidate of each range.
+         */
+        std::vector<SplitCandidate> bestSplits(
+            const std::vector<NumRange>& ranges
+        );
+
+        /** \brief Broadcasts the ranges of the nodes to split from the
+         *  master process to the workers. An empty set of ranges signals
+         *  the end of the tree.
+         *
+         *  \param[in,out] ranges Ranges of the training data, read at the
+         *  master and written at the workers.
+         *  \return The number of ranges.
+         */
+        int shareRanges (std::vector<NumRange>& ranges);
+
+        /** \brief Keeps in every process the best split candidate of each
+         *  range found in the cluster.
+         *
+         *  \param[in,out] splits Best split candidates of this process.
+         */
+        void reduceSplits (std::vector<SplitCandidate>& splits);
+
+        /** \brief Finds the best split candidate of each range in the
+         *  whole cluster. Called by the master process.
+         *
+         *  \param[in] ranges Ranges of the training data.
+         *  \return The best split candidate of each range.
+         */
+        std::vector<SplitCandidate> clusterSplits (
+            std::vector<NumRange>& ranges
+        );
+
+        /** \brief Returns the number of candidates evaluated in the cluster
+         *  for each node of a round of split search.
+         */
+        uint64_t roundCandidates ();
+
         /**
          *  writeNodeToFile
          *
@@ -259,19 +854,22 @@ class RandomForest {
     public:
 
         /** \brief Constructor */
-        RandomForest () : tp(nullptr) {}
+        RandomForest () 
+            : tp(nullptr)
+            , pool(new ThreadPool())
+            , comm(MPI_COMM_WORLD)
+            , treeSeed(1)
+            , splitRound(0) {}
 
-        /**
-         *  TODO: implement the destructor
-         */
-        virtual ~RandomForest () {}
+        /** \brief Destructor. The trees are freed with their arenas. **/
+        virtual ~RandomForest ();
  
         /**
          *  bestSplitThreadFun
          *
-         *  This function runs the bestSplitCandidate in diferent
-         *  threads. It divides the work between them by the macro
-         *  THREADS_PER_NODE.
+         *  This function runs the bestSplitCandidate in the thread
+         *  pool. The offset pairs are divided in tasks of
+         *  OFFSETS_PER_TASK pairs.
          *
          *  @param structure with the parameter to generate a split
          *  candidate.
@@ -303,6 +901,27 @@ class RandomForest {
          */
         void traversal(int treeID);
 
+        /** \brief Builds the flattened inference layout of the trees.
+         *
+         *  Called after loading or training the forest. Once built,
+         *  predict walks the flattened trees instead of the node graph.
+         *  A mapped binary forest is kept when there is no node graph.
+         */
+        void compile();
+
+        /** \brief Builds the quantized trees from the flattened ones.
+         *
+         *  From then on predict and classifyFrame walk the quantized trees
+         *  in integer arithmetic, and compile() quantizes the trees again
+         *  with the same k, so testClassification measures the accuracy of
+         *  the quantized model. The early exit of classifyParams is not
+         *  used by the quantized trees.
+         *
+         *  \param[in] topK Number of labels kept per leaf, 0 to keep every
+         *  label.
+         */
+        void quantize(const int topK = 0);
+
         /**
          *  This function classify a pixel of a given image by the
          *  random forest.
@@ -314,6 +933,88 @@ class RandomForest {
          */
         Label predict (Image* img, PixelInfo pixel, float& prob);
 
+        /** \brief Classifies every pixel of a depth frame.
+         *
+         *  The frame is split in tiles of FRAME_TILE_SIZE x FRAME_TILE_SIZE
+         *  pixels that are classified in parallel by the thread pool, each
+         *  worker reusing its own posterior buffer. Pixels without depth
+         *  get DEFAULT_LABEL and probability 0. The options restrict the
+         *  classification to a region of interest or a foreground mask,
+         *  subsample it with a stride and stop the trees early.
+         *
+         *  \param[in] img Frame to classify.
+         *  \param[out] labels Caller owned plane of width * height labels.
+         *  \param[out] probs Caller owned plane of width * height floats
+         *  with the probability of each label, or nullptr.
+         *  \param[in] cp Options of the sparse inference mode.
+         */
+        void classifyFrame(const Image& img, Label* labels, float* probs,
+                           const classifyParams& cp = classifyParams());
+
+        /** \brief Classifies every pixel of a padded depth frame.
+         *
+         *  Same result as classifyFrame on any other image. The flattened
+         *  trees are walked with the non-virtual lookups of the frame, so
+         *  its guard band should be at least guardBand() pixels wide.
+         *
+         *  \param[in] img Frame to classify.
+         *  \param[out] labels Caller owned plane of width * height labels.
+         *  \param[out] probs Caller owned plane of width * height floats
+         *  with the probability of each label, or nullptr.
+         *  \param[in] cp Options of the sparse inference mode.
+         */
+        void classifyFrame(const PaddedDepthImage& img, Label* labels, float* probs,
+                           const classifyParams& cp = classifyParams());
+
+        /** \brief Classifies every pixel of a batch of padded depth
+         *  frames, like classifyFrame with the default options.
+         *
+         *  The tiles of all the frames are classified in one parallel
+         *  loop, so a batch of small frames keeps every worker busy
+         *  without waiting for the slowest tile of each frame.
+         *
+         *  \param[in] imgs Frames to classify.
+         *  \param[out] labels Caller owned plane of width * height labels
+         *  of each frame.
+         *  \param[out] probs Caller owned plane of width * height floats
+         *  of each frame, or nullptr entries.
+         */
+        void classifyFrames(const std::vector<const PaddedDepthImage*>& imgs,
+                            const std::vector<Label*>& labels,
+                            const std::vector<float*>& probs);
+
+        /** \brief Returns the number of labels of the forest. */
+        int labels() const { return tp -> labelNum; }
+
+        /** \brief Returns the counters of the last training of this
+         *  process.
+         */
+        const TrainStats& trainStats() const { return stats; }
+
+        /** \brief Returns the flattened trees, empty until compile(). */
+        const FlatForest& flatForest() const { return flat; }
+
+        /** \brief Returns the quantized trees, empty until quantize(). */
+        const QuantizedForest& quantizedForest() const { return quant; }
+
+        /** \brief Returns the guard band of a PaddedDepthImage for the
+         *  offsets of the forest, at most MAX_GUARD_BAND pixels. Offsets
+         *  that reach further are clamped to the band, which gives the
+         *  same DEFAULT_DEPTH.
+         */
+        int guardBand() const {
+            return std::min(std::max(std::max(flat.maxOffset(), quant.maxOffset()), 1),
+                            MAX_GUARD_BAND);
+        }
+
+        /** \brief Replaces the thread pool used by the parallel loops.
+         *  \param[in] p The new thread pool.
+         */
+        void setThreadPool(ThreadPool::Ptr p);
+
+        /** \brief Returns the thread pool used by the parallel loops. */
+        ThreadPool::Ptr threadPool() const { return pool; }
+
         /**
          *  This function start the training of the forest.
          *
@@ -327,6 +1028,36 @@ class RandomForest {
          */
         void trainForest(trainParams& tparams);
 
+        /** \brief Trains the given trees on a new set of images and keeps
+         *  the others, without training the whole forest again.
+         *
+         *  The ids below the number of trees replace a tree and the rest
+         *  are added at the end, so they must cover every id up to the new
+         *  number of trees. The images of tparams.imgDir are divided among
+         *  the trees to train. Collective on MPI_COMM_WORLD, the forest
+         *  updated is the one of the master process. Ignores
+         *  tparams.checkpointDir.
+         *
+         *  \param[in,out] tparams Parameters of the training, the number of
+         *  labels must be the one of the forest. treeNum is set to the new
+         *  number of trees.
+         *  \param[in] treeIDs Ids of the trees to train.
+         */
+        void updateForest(trainParams& tparams, const std::vector<int>& treeIDs);
+
+        /** \brief Estimates again the distributions of the leaves with the
+         *  labeled pixels of a set of images, keeping the splits.
+         *
+         *  Every pixel with a label is dropped down each tree and the
+         *  distribution of a leaf becomes the one of the pixels that reach
+         *  it. The leaves that no pixel reaches keep their distribution.
+         *  It is a single pass over the images with the threads of the
+         *  pool, in the calling process only.
+         *
+         *  \param[in] imgDir Directory of the labeled images.
+         */
+        void refitLeaves(const std::string& imgDir);
+
         /**
          *  Write the traided trees to diferent text files in a
          *  directory especified. The trees are saved in files named
@@ -338,12 +1069,44 @@ class RandomForest {
 
         /**
          *  Load the trees contained in a directori with the name
-         *  "i-Tree.txt".
+         *  "i.tree" or "i-tree.txt".
          *
          *  @param path to the directory
          */
         void loadForest(int numTrees, int numLabels, const std::string& dirName);
 
+        /** \brief Writes the compiled forest to a binary forest file, in
+         *  the flattened layout walked by predict.
+         *
+         *  \param[in] fileName Path to the output file.
+         */
+        void writeFlatForest(const std::string& fileName);
+
+        /** \brief Maps a binary forest file written by writeFlatForest.
+         *
+         *  The file is not parsed: predict walks the mapped records in
+         *  place, and the processes that load the same file share its
+         *  pages. The node graph is not rebuilt, so a forest loaded this
+         *  way can only be used for classification.
+         *
+         *  \param[in] fileName Path to the binary forest.
+         */
+        void loadFlatForest(const std::string& fileName);
+
+        /** \brief Writes the quantized forest to a binary file.
+         *
+         *  \param[in] fileName Path to the output file.
+         */
+        void writeQuantizedForest(const std::string& fileName);
+
+        /** \brief Maps a binary file written by writeQuantizedForest, like
+         *  loadFlatForest. The forest loaded this way can only be used for
+         *  classification, in integer arithmetic.
+         *
+         *  \param[in] fileName Path to the binary quantized forest.
+         */
+        void loadQuantizedForest(const std::string& fileName);
+
         /**
          *  Return the percentage of classification of an image.
          *
@@ -0,0 +1,107 @@
+/** \file ThreadPool.h
+ *
+ *  \brief Persistent pool of worker threads used by the parallel loops of
+ *  the library.
+ */
+#ifndef RGBD_RF_THREAD_POOL_HH__
+#define RGBD_RF_THREAD_POOL_HH__
+
+#include <pthread.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace rdf {
+
+/** \brief Persistent work-stealing pool of worker threads.
+ *
+ *  The threads are created once, by default one per core, and wait for
+ *  work between jobs. The thread that submits a job also works on it, so a
+ *  pool of size N has N - 1 background threads. Jobs are run one at a
+ *  time.
+ *
+ *  The iterations of a job are split in one contiguous range per worker.
+ *  Each worker takes iterations from the front of its own range and, when
+ *  it runs out, steals the back half of the largest range left, so uneven
+ *  iterations (e.g. split candidates of nodes of different sizes) do not
+ *  leave workers idle.
+ */
+class ThreadPool {
+    public:
+        typedef std::shared_ptr<ThreadPool> Ptr;
+
+        /** \brief Body of a parallel loop, called with the index of the
+         *  iteration and the index of the worker in [0, size()).
+         */
+        typedef std::function<void(int, int)> LoopBody;
+
+        /** \brief Constructor.
+         *  \param[in] threadNum Number of workers, 0 to use one per core.
+         */
+        ThreadPool(int threadNum = 0);
+
+        /** \brief Stops and joins the worker threads. **/
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /** \brief Returns the number of workers, including the caller. */
+        int size() const { return static_cast<int>(threads.size()) + 1; }
+
+        /** \brief Runs body(i, worker) for every i in [0, n) across the
+         *  workers and returns when all the iterations are done.
+         *
+         *  \param[in] n Number of iterations.
+         *  \param[in] body Body of the loop.
+         */
+        void parallelFor(int n, const LoopBody& body);
+
+    private:
+        /** \brief Main loop of the background threads. */
+        static void* workerThread(void* args);
+
+        /** \brief Runs iterations of the current job until none is left.
+         *  \param[in] worker Index of the worker.
+         */
+        void work(int worker);
+
+        /** \brief Takes the next iteration of the range of a worker.
+         *  \return false if the range is empty.
+         */
+        bool pop(int worker, int& i);
+
+        /** \brief Moves the back half of the largest range to the range of
+         *  a worker.
+         *  \return false if there was nothing left to steal.
+         */
+        bool steal(int worker);
+
+        /** \brief Range of iterations owned by a worker. */
+        struct WorkRange {
+            pthread_mutex_t mutex;
+            int begin;
+            int end;
+        };
+
+        std::vector<pthread_t> threads;
+        std::vector<WorkRange> ranges;
+
+        // Serializes the jobs submitted from different threads.
+        pthread_mutex_t jobMutex;
+
+        // Protects the job state below.
+        pthread_mutex_t mutex;
+        pthread_cond_t jobReady;
+        pthread_cond_t jobDone;
+
+        const LoopBody* body;
+        unsigned generation;
+        int busy;
+        bool stop;
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_THREAD_POOL_HH__
@@ -4,13 +4,16 @@
 #include <memory>
 #include <rdf/PixelInfo.h>
 #include <rdf/ImagePool.h>
+#include <rdf/ThreadPool.h>
 
 namespace rdf {
 
 /** \brief Container for the training data.
  *
  *  The training data consist of a vector of pixels. These pixels can belong to 
- *  different images.
+ *  different images. The label and the depth of each pixel are cached in
+ *  arrays parallel to the pixels, so the training does not look them up in
+ *  the images again.
  */
 class TrainData {
     public:
@@ -27,14 +30,31 @@ class TrainData {
         TrainData(int num_imgs, int num_pixels)
             : pixels(num_imgs * num_pixels) {}
 
-        /**
-         * Selects random pixels from the image imgId
+        /** \brief Samples numPixels pixels of each image of a range of
+         *  the pool and caches their labels and depths.
+         *
+         *  The pixels of each image are written to their own slice of the
+         *  arrays, which are allocated once, and each image is sampled
+         *  with its own generator seeded from the generator of the calling
+         *  thread. With a thread pool the images are sampled in parallel,
+         *  and the train data is the same whatever the number of threads.
+         *  The images without non-zero elements give no pixels.
+         *
+         *  \param[in] numPixels Number of pixels per image.
+         *  \param[in] imgPool Image pool to sample.
+         *  \param[in] startIdx Index of the first image of the range.
+         *  \param[in] endIdx Index of the last image of the range.
+         *  \param[in] byLabel Whether to divide the pixels of each image
+         *  equally among its labels, which oversamples the rare labels.
+         *  \param[in] pool Thread pool to use, nullptr to run in the
+         *  calling thread.
          */
         TrainData (int numPixels, 
                    ImagePool& imgPool,
                    int startIdx,
                    int endIdx,
-                   bool byLabel = false);
+                   bool byLabel = false,
+                   ThreadPool* pool = nullptr);
 
         /** \brief Returns the number of pixels
          *  \return The number of pixels.
@@ -43,6 +63,66 @@ class TrainData {
         
         PixelInfo& operator[] (int i) { return pixels[i]; }
 
+        /** \brief Returns the cached label of the pixel i. */
+        Label label (int i) const { return labels[i]; }
+
+        /** \brief Returns the cached depth of the pixel i. */
+        unsigned depth (int i) const { return depths[i]; }
+
+        /** \brief Swaps two pixels and their cached values.
+         *  \param[in] i Index of the first pixel.
+         *  \param[in] j Index of the second pixel.
+         */
+        void swap (int i, int j) {
+            std::swap(pixels[i], pixels[j]);
+            std::swap(labels[i], labels[j]);
+            std::swap(depths[i], depths[j]);
+        }
+
+        /** \brief Moves the pixels of a range marked in a bitmask to the
+         *  front of the range, keeping the relative order of both sides.
+         *
+         *  The destination of each pixel is written to a compact index
+         *  array first, and the pixels and their cached values are then
+         *  gathered once through it. With a thread pool, large ranges are
+         *  split in tasks of PARTITION_TASK_SIZE pixels that count their
+         *  sides, and the prefix sums of the counts give the place of each
+         *  task in the index array.
+         *
+         *  \param[in] range Range of the pixels to partition.
+         *  \param[in] mask Bitmask with a set bit for the pixels of the
+         *  left side, bit k of byte k / 8 for the pixel range.start + k -
+         *  maskStart.
+         *  \param[in] maskStart Bit of the mask of the first pixel.
+         *  \param[in] pool Thread pool to use, nullptr to run in the
+         *  calling thread.
+         *  \return Index of the first pixel of the right side.
+         */
+        int partition (NumRange range,
+                       const std::vector<uint8_t>& mask,
+                       int maskStart = 0,
+                       ThreadPool* pool = nullptr);
+
+        /** \brief Caches the label and the depth of every pixel from the
+         *  images of the pool. The sampling constructor fills the cache
+         *  itself, so this is only needed when the pixels are written
+         *  from outside, e.g. after a broadcast.
+         *  \param[in] imgPool Image pool the pixels belong to.
+         *  \param[in] pool Thread pool to use, nullptr to run in the
+         *  calling thread.
+         */
+        void cache (ImagePool& imgPool, ThreadPool* pool = nullptr);
+
+        /** \brief Changes the number of pixels.
+         *  \param[in] n New number of pixels.
+         */
+        void resize (int n) { pixels.resize(n); }
+
+        /** \brief Returns a pointer to the contiguous array of pixels.
+         *  \return Pointer to the first pixel.
+         */
+        PixelInfo* data () { return pixels.data(); }
+
         /** \brief Returns a pointer to the beginning of the pixel vector.
          *  \return Iterator to the beginning of the pixel vector.
          */
@@ -56,6 +136,10 @@ class TrainData {
     private:
         /* Pixels from image to train */
         std::vector<PixelInfo> pixels;
+
+        /* Cached label and depth of each pixel */
+        std::vector<Label> labels;
+        std::vector<unsigned> depths;
 };
 
 } // namespace rdf 
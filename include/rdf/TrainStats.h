@@ -0,0 +1,203 @@
+/** \file TrainStats.h
+ *
+ *  \brief Counters and timers of the training of a forest.
+ */
+#ifndef RGBD_RF_TRAIN_STATS_HH__
+#define RGBD_RF_TRAIN_STATS_HH__
+
+#include <mpi.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <rdf/common.h>
+
+namespace rdf {
+
+/** \brief Counters of a node of a tree.
+ *
+ *  The search time is the time spent by the threads of the process that
+ *  trained the tree scoring the candidates of the node, added over the
+ *  threads. The sort and wait times are wall times of the round of split
+ *  search of the node. In the level wise growth a round splits every
+ *  node of a depth, and its sort and wait times are divided among the
+ *  nodes by their number of pixels.
+ */
+struct NodeStats {
+    int tree;
+    unsigned id;
+    int depth;
+    int leaf;
+    uint64_t pixels;
+    uint64_t candidates;
+    float gain;
+    double search;
+    double sort;
+    double wait;
+};
+
+/** \brief Summary of a tree, kept by the leader of its group. */
+struct TreeStats {
+    int tree;
+    int rank;
+    int group;
+    unsigned nodes;
+    unsigned leaves;
+    int depth;
+    uint64_t pixels;
+    double time;
+    double sample;
+    double search;
+    double sort;
+    double wait;
+};
+
+/** \brief Summary of a process over the whole training.
+ *
+ *  The search time is the wall time of the split search, the wait time
+ *  the time blocked in the collective calls of the split rounds and of the
+ *  distribution of the train data, and the sample time the time spent
+ *  sampling and caching the train data. A straggler has a larger search
+ *  time than the rest of its group, which shows up as wait time in the
+ *  other processes.
+ */
+struct RankStats {
+    int rank;
+    int group;
+    unsigned trees;
+    uint64_t candidates;
+    uint64_t evaluations;
+    double time;
+    double sample;
+    double search;
+    double sort;
+    double wait;
+};
+
+/** \brief Instrumentation of RandomForest::trainForest.
+ *
+ *  Every process keeps its own summary. The leader of each group records
+ *  the nodes of the trees it trains, in the order of their ids, and prints
+ *  the progress of the current tree when enabled. write() gathers
+ *  everything in the master process as a JSON document with the arrays
+ *  "ranks", "trees" and "nodes".
+ */
+class TrainStats {
+    public:
+        TrainStats();
+
+        /** \brief Starts the statistics of a training.
+         *  \param[in] rank Rank of the process in MPI_COMM_WORLD.
+         *  \param[in] group Group of processes of the process.
+         *  \param[in] progress Whether the leaders print the progress of
+         *  their trees.
+         */
+        void reset(int rank, int group, bool progress);
+
+        /** \brief Starts the statistics of a tree.
+         *  \param[in] treeID Id of the tree.
+         *  \param[in] leader Whether the process records the nodes.
+         */
+        void beginTree(int treeID, bool leader);
+
+        /** \brief Ends the current tree and adds its summary. */
+        void endTree();
+
+        /** \brief Records a new node of the current tree. The nodes must
+         *  be recorded in the order of their ids.
+         *  \param[in] id Id of the node in the tree, from 1.
+         *  \param[in] depth Depth of the node, 0 for the root.
+         *  \param[in] pixels Pixels of the node in the cluster.
+         *  \param[in] leaf Whether the node is a leaf.
+         */
+        void node(unsigned id, int depth, uint64_t pixels, bool leaf);
+
+        /** \brief Starts a round of split search.
+         *  \param[in] nodes Number of nodes split in the round.
+         */
+        void beginRound(unsigned nodes);
+
+        /** \brief Adds the thread time spent scoring candidates of a node
+         *  of the round. Not thread safe.
+         *  \param[in] k Index of the node in the round.
+         *  \param[in] seconds Time of the task.
+         */
+        void nodeSearch(unsigned k, double seconds) {
+            if (k >= roundSearch.size()) {
+                roundSearch.resize(k + 1, 0.0);
+            }
+            roundSearch[k] += seconds;
+        }
+
+        /** \brief Ends a round of split search of the leader.
+         *  \param[in] ids Ids of the nodes split in the round.
+         *  \param[in] gains Gain of the best candidate of each node.
+         *  \param[in] candidates Candidates evaluated per node in the
+         *  cluster.
+         */
+        void endRound(
+            const std::vector<unsigned>& ids,
+            const std::vector<float>& gains,
+            uint64_t candidates
+        );
+
+        /** \brief Adds the wall time of a split search.
+         *  \param[in] seconds Wall time.
+         *  \param[in] candidates Candidates scored by the process.
+         *  \param[in] evaluations Pairs of candidate and pixel scored.
+         */
+        void addSearch(double seconds, uint64_t candidates, uint64_t evaluations);
+
+        /** \brief Adds the wall time of a partition of the train data. */
+        void addSort(double seconds);
+
+        /** \brief Adds the wall time blocked in collective calls. */
+        void addWait(double seconds);
+
+        /** \brief Adds the wall time of the sampling of the train data. */
+        void addSample(double seconds);
+
+        /** \brief Writes the statistics of every process to a JSON file.
+         *  Collective on the communicator, only its rank 0 writes.
+         *  \param[in] fileName Path of the file.
+         *  \param[in] world Communicator of all the processes.
+         */
+        void write(const std::string& fileName, MPI_Comm world);
+
+        /** \brief Returns the summary of the process. */
+        const RankStats& rankStats() const { return rs; }
+
+        /** \brief Returns the summaries of the trees of the process. */
+        const std::vector<TreeStats>& treeStats() const { return treeLog; }
+
+        /** \brief Returns the nodes of the trees of the process. */
+        const std::vector<NodeStats>& nodeStats() const { return nodeLog; }
+
+    private:
+        RankStats rs;
+        std::vector<TreeStats> treeLog;
+        std::vector<NodeStats> nodeLog;
+
+        bool progress;
+        bool leader;
+        double start;
+
+        // Current tree
+        int treeID;
+        size_t firstNode;
+        double treeStart;
+        double lastPrint;
+        TreeStats current;
+
+        // Current round
+        std::vector<double> roundSearch;
+        double roundSort;
+        double roundWait;
+
+        /** \brief Prints the size and the time of the current tree. */
+        void printProgress(const char* state);
+};
+
+} // namespace rdf
+
+#endif // RGBD_RF_TRAIN_STATS_HH__
@@ -32,6 +32,8 @@
 
 #include <random>
 #include <numeric>
+#include <atomic>
+#include <stdint.h>
 
 using namespace cv;
 
@@ -66,6 +68,85 @@ class NumRange {
         int size () { return end - start; }
 };
 
+/** \brief xoshiro256** pseudo random number generator.
+ *
+ *  The 256 bits of state are expanded from a 64 bit seed with splitmix64.
+ *  Every thread uses its own generator, see threadRng(), so the sampling
+ *  of the workers does not contend on the lock of rand(), and the streams
+ *  seeded with streamSeed() give the same numbers whatever thread runs
+ *  them.
+ */
+class Rng {
+    public:
+        typedef uint64_t result_type;
+
+        /** \brief Constructor.
+         *  \param[in] s Seed of the generator.
+         */
+        explicit Rng(uint64_t s = 1) { seed(s); }
+
+        /** \brief Restarts the generator from a seed.
+         *  \param[in] s Seed of the generator.
+         */
+        void seed(uint64_t s);
+
+        /** \brief Returns the next 64 random bits. */
+        uint64_t operator()() {
+            const uint64_t result = rotl(state[1] * 5, 7) * 9;
+            const uint64_t t = state[1] << 17;
+
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3], 45);
+
+            return result;
+        }
+
+        /** \brief Returns a random integer in [0, n).
+         *  \param[in] n Number of values, greater than 0.
+         */
+        uint32_t below(uint32_t n) {
+            return static_cast<uint32_t>(((*this)() >> 32) * n >> 32);
+        }
+
+        /** \brief Returns a random double in [0, 1). */
+        double uniform() {
+            return ((*this)() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        static constexpr uint64_t min() { return 0; }
+        static constexpr uint64_t max() { return UINT64_MAX; }
+
+    private:
+        static uint64_t rotl(uint64_t x, int k) {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        uint64_t state[4];
+};
+
+/** \brief Derives the seed of an independent stream from a parent seed,
+ *  e.g. the stream of a node from the stream of its tree.
+ *
+ *  \param[in] parent Seed of the parent stream.
+ *  \param[in] id Identifier of the stream among its siblings.
+ *  \return The seed of the stream.
+ */
+uint64_t streamSeed(uint64_t parent, uint64_t id);
+
+/** \brief Returns the generator of the calling thread. Until it is
+ *  seeded, every thread starts from a different stream.
+ */
+Rng& threadRng();
+
+/** \brief Restarts the generator of the calling thread.
+ *  \param[in] seed Seed of the generator, usually from streamSeed().
+ */
+void seedThreadRng(uint64_t seed);
+
 /**
  *  randFloat
  *
@@ -96,20 +177,37 @@ void takeFinalTime(double t_initial);
 Vec3f DepthToWorld(int x, int y, unsigned int depthValue);
 
 
-/** \brief Return an unsorted vector of indices
+/** \brief Return an unsorted vector of indices, shuffled with the
+ *  generator of the calling thread.
  *
  *  \param[in] size Size of the resulting vector of indices.
  *  \return An unordered vector of indices of the specified size.
  */
 std::vector<int> permutation(const int size);
 
+/** \brief Checks the extension of a file name.
+ *
+ *  \param[in] fileName The file name.
+ *  \param[in] ext The extension, including the dot.
+ *  \return true if the file name ends with the extension.
+ */
+bool hasExtension(const std::string& fileName, const std::string& ext);
+
 // ----------------------------------------------------------------------
 // Random Forest Macros
 // ----------------------------------------------------------------------
 
 #define WIDTH 640
 #define HEIGHT 480
-#define THREADS_PER_NODE 2
+#define OFFSETS_PER_TASK 8
+#define FRAME_TILE_SIZE 64
+#define PARTITION_TASK_SIZE 8192
+#define SHARED_MASK_MIN_PIXELS 65536
+#define FRAME_RING_SIZE 4
+#define MAX_GUARD_BAND 64
+#define FRAME_CLASSIFIER_DEPTH 2
+#define TRAIN_PROGRESS_PERIOD 1.0
+#define IMAGE_LOADER_THREADS 2
 
 // ----------------------------------------------------------------------
 // Image configuration macros
@@ -0,0 +1,524 @@
+/** \file ClassifyService.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file ClassifyService.h
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <rdf/ClassifyService.h>
+
+namespace {
+
+/** \brief Rounds a size up to the alignment of the planes. */
+size_t alignUp(const size_t bytes) {
+    return (bytes + CLASSIFY_SERVICE_ALIGN - 1) / CLASSIFY_SERVICE_ALIGN *
+           CLASSIFY_SERVICE_ALIGN;
+}
+
+} // namespace
+
+
+/** \brief Constructor of an unmapped segment.
+ *  \param[in] segName Name of the shared memory segment.
+ */
+rdf::ServiceSegment::ServiceSegment(const std::string& segName)
+    : name(segName)
+    , base(nullptr)
+    , size(0)
+    , header(nullptr)
+    , table(nullptr) {
+}
+
+
+/** \brief Unmaps the segment. */
+rdf::ServiceSegment::~ServiceSegment() {
+    if (base != nullptr) {
+        munmap(base, size);
+    }
+}
+
+
+/** \brief Size of the planes of a slot, each one aligned. */
+size_t rdf::ServiceSegment::slotBytes(int w, int h) {
+    const size_t pixels = size_t(w) * h;
+
+    return alignUp(pixels * sizeof(unsigned short)) +
+           alignUp(pixels * sizeof(Label)) +
+           alignUp(pixels * sizeof(float));
+}
+
+
+/** \brief Size of the header and of the table of the slots, aligned. */
+size_t rdf::ServiceSegment::tableBytes(int slotNum) {
+    return alignUp(sizeof(ServiceHeader) + slotNum * sizeof(ServiceSlot));
+}
+
+
+/** \brief Size of a segment. */
+size_t rdf::ServiceSegment::segmentBytes(int w, int h, int slotNum) {
+    return tableBytes(slotNum) + slotNum * slotBytes(w, h);
+}
+
+
+/** \brief Plane of the depths of a slot. */
+unsigned short* rdf::ServiceSegment::slotDepth(int slot) const {
+    return reinterpret_cast<unsigned short*>(base + tableBytes(header->slotNum) +
+        slot * slotBytes(header->width, header->height));
+}
+
+
+/** \brief Plane of the labels of a slot. */
+Label* rdf::ServiceSegment::slotLabels(int slot) const {
+    const size_t pixels = size_t(header->width) * header->height;
+
+    return reinterpret_cast<Label*>(reinterpret_cast<char*>(slotDepth(slot)) +
+        alignUp(pixels * sizeof(unsigned short)));
+}
+
+
+/** \brief Plane of the probabilities of a slot. */
+float* rdf::ServiceSegment::slotProbs(int slot) const {
+    const size_t pixels = size_t(header->width) * header->height;
+
+    return reinterpret_cast<float*>(reinterpret_cast<char*>(slotLabels(slot)) +
+        alignUp(pixels * sizeof(Label)));
+}
+
+
+/** \brief Maps the segment of a file descriptor and closes it.
+ *  \param[in] fd Descriptor from shm_open.
+ *  \param[in] bytes Size of the segment.
+ */
+void rdf::ServiceSegment::mapSegment(int fd, size_t bytes) {
+    void* addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        printf("Cannot map shared memory segment %s.\n", name.c_str());
+        exit(1);
+    }
+
+    base = static_cast<char*>(addr);
+    size = bytes;
+    header = reinterpret_cast<ServiceHeader*>(base);
+    table = reinterpret_cast<ServiceSlot*>(base + sizeof(ServiceHeader));
+}
+
+
+/** \brief Locks the mutex of the header, making it consistent again if
+ *  its owner died. The slots of a dead client are freed by the claim() of
+ *  another client.
+ */
+void rdf::ServiceSegment::lock() {
+    if (pthread_mutex_lock(&header->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+
+/** \brief Unlocks the mutex of the header. */
+void rdf::ServiceSegment::unlock() {
+    pthread_mutex_unlock(&header->mutex);
+}
+
+
+/** \brief Waits on a condition of the header with the mutex locked.
+ *  \param[in] cond Condition of the header.
+ */
+void rdf::ServiceSegment::waitOn(pthread_cond_t& cond) {
+    if (pthread_cond_wait(&cond, &header->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+
+/** \brief Waits on a condition of the header with the mutex locked, at
+ *  most a number of milliseconds.
+ *  \param[in] cond Condition of the header.
+ *  \param[in] ms Longest wait.
+ */
+void rdf::ServiceSegment::waitFor(pthread_cond_t& cond, long ms) {
+    struct timespec deadline;
+
+    // The conditions of the header use the default realtime clock
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_cond_timedwait(&cond, &header->mutex, &deadline) == EOWNERDEAD) {
+        pthread_mutex_consistent(&header->mutex);
+    }
+}
+
+
+/** \brief Creates the segment of the service.
+ *
+ *  \param[in] f Compiled or mapped forest.
+ *  \param[in] segName Name of the shared memory segment.
+ *  \param[in] slotNum Number of frame slots.
+ *  \param[in] w Width of the frames.
+ *  \param[in] h Height of the frames.
+ */
+rdf::ClassifyService::ClassifyService(
+    RandomForest& f,
+    const std::string& segName,
+    int slotNum,
+    int w,
+    int h
+)
+    : ServiceSegment(segName)
+    , forest(f) {
+
+    const size_t bytes = segmentBytes(w, h, slotNum);
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    int fd;
+    int k;
+
+    if (slotNum < 1 || w < 1 || h < 1) {
+        printf("Invalid classification service of %d slots of %dx%d frames.\n",
+               slotNum, w, h);
+        exit(1);
+    }
+
+    padded.assign(slotNum, PaddedDepthImage(forest.guardBand(), w, h));
+
+    // A segment left by a service that did not end
+    shm_unlink(name.c_str());
+
+    if ((fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        printf("Cannot create shared memory segment %s.\n", name.c_str());
+        exit(1);
+    }
+
+    if (ftruncate(fd, bytes) != 0) {
+        printf("Cannot allocate shared memory segment %s.\n", name.c_str());
+        close(fd);
+        shm_unlink(name.c_str());
+        exit(1);
+    }
+
+    mapSegment(fd, bytes);
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->mutex, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&header->queued, &cattr);
+    pthread_cond_init(&header->done, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    header->version = CLASSIFY_SERVICE_VERSION;
+    header->width = w;
+    header->height = h;
+    header->slotNum = slotNum;
+    header->labelNum = forest.labels();
+    header->running = 1;
+    header->service = uint32_t(getpid());
+    header->tickets = 0;
+    header->frames = 0;
+    header->batches = 0;
+
+    for (k = 0; k < slotNum; k++) {
+        table[k].state = FREE_SLOT;
+        table[k].owner = 0;
+        table[k].ticket = 0;
+    }
+
+    // The clients check the magic, written once the rest is ready
+    __sync_synchronize();
+    header->magic = CLASSIFY_SERVICE_MAGIC;
+
+    printf("Classification service %s: %d slots of %dx%d frames, %zu bytes\n",
+           name.c_str(), slotNum, w, h, bytes);
+}
+
+
+/** \brief Stops the clients and removes the segment. */
+rdf::ClassifyService::~ClassifyService() {
+    stop();
+    shm_unlink(name.c_str());
+}
+
+
+/** \brief Classifies the queued frames until stop() is called.
+ *
+ *  Every frame queued when the service wakes up joins the batch, in the
+ *  order they were queued. The depths are copied to the padded frames in
+ *  parallel, then the whole batch is classified by one parallel loop.
+ */
+void rdf::ClassifyService::run() {
+    const int slotNum = header->slotNum;
+    std::vector<int> batch;
+    std::vector<const PaddedDepthImage*> imgs;
+    std::vector<Label*> labels;
+    std::vector<float*> probs;
+    ThreadPool::Ptr pool = forest.threadPool();
+    int k;
+
+    while (true) {
+        lock();
+
+        batch.clear();
+        while (header->running) {
+            for (k = 0; k < slotNum; k++) {
+                if (table[k].state == QUEUED_SLOT) {
+                    batch.push_back(k);
+                }
+            }
+
+            if (!batch.empty()) {
+                break;
+            }
+            waitOn(header->queued);
+        }
+
+        if (!header->running) {
+            unlock();
+            return;
+        }
+
+        std::sort(batch.begin(), batch.end(), [&](int a, int b) {
+            return table[a].ticket < table[b].ticket;
+        });
+
+        for (const int s : batch) {
+            table[s].state = BUSY_SLOT;
+        }
+        unlock();
+
+        imgs.clear();
+        labels.clear();
+        probs.clear();
+
+        pool->parallelFor(batch.size(), [&](int i, int) {
+            padded[batch[i]].assign(slotDepth(batch[i]));
+        });
+
+        for (const int s : batch) {
+            imgs.push_back(&padded[s]);
+            labels.push_back(slotLabels(s));
+            probs.push_back(slotProbs(s));
+        }
+
+        forest.classifyFrames(imgs, labels, probs);
+
+        lock();
+        for (const int s : batch) {
+            table[s].state = DONE_SLOT;
+        }
+        header->frames += batch.size();
+        header->batches++;
+        pthread_cond_broadcast(&header->done);
+        unlock();
+    }
+}
+
+
+/** \brief Makes run() return after the current batch, and the calls of
+ *  the clients fail.
+ */
+void rdf::ClassifyService::stop() {
+    lock();
+    header->running = 0;
+    pthread_cond_broadcast(&header->queued);
+    pthread_cond_broadcast(&header->done);
+    unlock();
+}
+
+
+/** \brief Opens the segment of a running service.
+ *  \param[in] segName Name of the shared memory segment.
+ */
+rdf::ClassifyClient::ClassifyClient(const std::string& segName)
+    : ServiceSegment(segName) {
+
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name.c_str(), O_RDWR, 0)) < 0) {
+        printf("No classification service %s.\n", name.c_str());
+        exit(1);
+    }
+
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ServiceHeader)) {
+        printf("Shared memory segment %s is not a classification service.\n",
+               name.c_str());
+        close(fd);
+        exit(1);
+    }
+
+    mapSegment(fd, st.st_size);
+
+    if ((header->magic != CLASSIFY_SERVICE_MAGIC) ||
+        (header->version != CLASSIFY_SERVICE_VERSION) ||
+        (size < segmentBytes(header->width, header->height, header->slotNum))) {
+        printf("Shared memory segment %s is not a classification service.\n",
+               name.c_str());
+        exit(1);
+    }
+}
+
+
+/** \brief Exits if the service has stopped or its process is gone. */
+void rdf::ClassifyClient::checkRunning() {
+    if (!header->running) {
+        unlock();
+        printf("Classification service %s stopped.\n", name.c_str());
+        exit(1);
+    }
+
+    if ((kill(pid_t(header->service), 0) != 0) && (errno == ESRCH)) {
+        unlock();
+        printf("Classification service %s died.\n", name.c_str());
+        exit(1);
+    }
+}
+
+
+/** \brief Frees the slots of the clients that died.
+ *
+ *  A busy slot is left to the service, which marks it done after the
+ *  batch, and it is freed by a later call.
+ *
+ *  \return Number of slots freed.
+ */
+int rdf::ClassifyClient::reclaimSlots() {
+    const int slotNum = header->slotNum;
+    int freed = 0;
+    int k;
+
+    for (k = 0; k < slotNum; k++) {
+        ServiceSlot& s = table[k];
+
+        if ((s.state == FREE_SLOT) || (s.state == BUSY_SLOT)) {
+            continue;
+        }
+
+        if ((kill(pid_t(s.owner), 0) != 0) && (errno == ESRCH)) {
+            s.state = FREE_SLOT;
+            s.owner = 0;
+            freed++;
+        }
+    }
+
+    // Other clients may be waiting for a free slot too
+    if (freed > 0) {
+        pthread_cond_broadcast(&header->done);
+    }
+
+    return freed;
+}
+
+
+/** \brief Takes a free slot, waiting for one if every slot is taken. The
+ *  slots of the dead clients are freed before waiting.
+ *  \return Index of the slot.
+ */
+int rdf::ClassifyClient::claim() {
+    const int slotNum = header->slotNum;
+    int k;
+
+    lock();
+    while (true) {
+        checkRunning();
+
+        for (k = 0; k < slotNum; k++) {
+            if (table[k].state == FREE_SLOT) {
+                table[k].state = CLAIMED_SLOT;
+                table[k].owner = uint32_t(getpid());
+                unlock();
+                return k;
+            }
+        }
+
+        if (reclaimSlots() == 0) {
+            waitFor(header->done, CLASSIFY_SERVICE_POLL_MS);
+        }
+    }
+}
+
+
+/** \brief Queues a claimed slot to the service.
+ *  \param[in] slot Index of the slot.
+ */
+void rdf::ClassifyClient::submit(int slot) {
+    lock();
+    checkRunning();
+    table[slot].state = QUEUED_SLOT;
+    table[slot].ticket = header->tickets++;
+    pthread_cond_signal(&header->queued);
+    unlock();
+}
+
+
+/** \brief Waits for the service to classify a queued slot.
+ *  \param[in] slot Index of the slot.
+ */
+void rdf::ClassifyClient::wait(int slot) {
+    lock();
+    while (table[slot].state != DONE_SLOT) {
+        checkRunning();
+        waitFor(header->done, CLASSIFY_SERVICE_POLL_MS);
+    }
+    unlock();
+}
+
+
+/** \brief Gives a slot back to the service, waking the clients that wait
+ *  for a free slot.
+ *  \param[in] slot Index of the slot.
+ */
+void rdf::ClassifyClient::release(int slot) {
+    lock();
+    table[slot].state = FREE_SLOT;
+    table[slot].owner = 0;
+    pthread_cond_broadcast(&header->done);
+    unlock();
+}
+
+
+/** \brief Classifies a frame and waits for the result.
+ *
+ *  \param[in] d Plane of width * height depths.
+ *  \param[out] labels Caller owned plane of width * height labels.
+ *  \param[out] probs Caller owned plane of width * height floats, or
+ *  nullptr.
+ */
+void rdf::ClassifyClient::classify(
+    const unsigned short* d,
+    Label* labels,
+    float* probs
+) {
+    const size_t pixels = size_t(width()) * height();
+    const int slot = claim();
+
+    std::copy(d, d + pixels, depth(slot));
+    submit(slot);
+    wait(slot);
+
+    std::copy(slotLabels(slot), slotLabels(slot) + pixels, labels);
+    if (probs != nullptr) {
+        std::copy(slotProbs(slot), slotProbs(slot) + pixels, probs);
+    }
+    release(slot);
+}
@@ -0,0 +1,441 @@
+/** \file FeatureKernel.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file FeatureKernel.h
+ *
+ *  All the versions follow the arithmetic of featureResponse:
+ *
+ *  - The quotient of the unsigned division of an offset by a depth is
+ *    computed in double precision. Both operands are below 2^32, so the
+ *    quotient is at least 2^-32 away (relatively) from the next integer
+ *    and the truncated double is the exact integer quotient.
+ *  - Only the low 16 bits of the displaced coordinates reach getDepth,
+ *    as a short, so the quotient is reduced modulo 2^16 before converting
+ *    it to a 32 bit integer and the coordinates are sign extended from 16
+ *    bits.
+ *  - The unsigned difference of depths r is converted as
+ *    (r >> 16) * 65536 + (r & 0xffff): both terms are exact floats, so the
+ *    sum is rounded once, like the conversion of r.
+ */
+#include <rdf/Feature.h>
+#include <rdf/FeatureKernel.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+void rdf::featureResponsesScalar(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    size_t begin,
+    size_t end,
+    float* responses
+) {
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        const DepthPlane& plane = planes[block.img[i]];
+        const uint32_t x = block.x[i];
+        const uint32_t y = block.y[i];
+        const uint32_t d = block.depth[i];
+
+        // Normalize offsets by the depth at pixel
+        const uint32_t ux_ = x + scaleOffset(ux, d);
+        const uint32_t uy_ = y + scaleOffset(uy, d);
+        const uint32_t vx_ = x + scaleOffset(vx, d);
+        const uint32_t vy_ = y + scaleOffset(vy, d);
+
+        const uint32_t uDepth = planeDepth(plane, ux_, uy_);
+        const uint32_t vDepth = planeDepth(plane, vx_, vy_);
+
+        responses[i] = uDepth - vDepth;
+    }
+}
+
+
+#if defined(__AVX512F__)
+
+namespace {
+
+/** \brief Low 16 bits of the unsigned quotients off / d of 8 depths. */
+inline __m256i quotient8(const __m512d off, const __m256i d) {
+    const __m512d q = _mm512_roundscale_pd(
+        _mm512_div_pd(off, _mm512_cvtepi32_pd(d)),
+        _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    const __m512d hi = _mm512_roundscale_pd(
+        _mm512_mul_pd(q, _mm512_set1_pd(1.0 / 65536.0)),
+        _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+
+    return _mm512_cvttpd_epi32(
+        _mm512_sub_pd(q, _mm512_mul_pd(hi, _mm512_set1_pd(65536.0))));
+}
+
+/** \brief Offset component scaled by the depths of 16 pixels. */
+inline __m512i scale16(const int off, const __m512i d) {
+    const __m512d a = _mm512_set1_pd(double(uint32_t(off)));
+    const __m512i q = _mm512_inserti64x4(
+        _mm512_castsi256_si512(quotient8(a, _mm512_castsi512_si256(d))),
+        quotient8(a, _mm512_extracti64x4_epi64(d, 1)), 1);
+
+    // A zero depth leaves the offset at 0
+    return _mm512_maskz_mov_epi32(
+        _mm512_cmpneq_epi32_mask(d, _mm512_setzero_si512()), q);
+}
+
+/** \brief Sign extends the low 16 bits of each lane. */
+inline __m512i toShort16(const __m512i c) {
+    return _mm512_srai_epi32(_mm512_slli_epi32(c, 16), 16);
+}
+
+/** \brief Depths of 16 pixels, all of them from the same plane. */
+inline __m512i gather16(
+    const rdf::DepthPlane& plane,
+    const __m512i x,
+    const __m512i y
+) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __mmask16 in =
+        _mm512_cmpge_epi32_mask(x, zero) &
+        _mm512_cmplt_epi32_mask(x, _mm512_set1_epi32(plane.height)) &
+        _mm512_cmpge_epi32_mask(y, zero) &
+        _mm512_cmplt_epi32_mask(y, _mm512_set1_epi32(plane.width));
+    const __m512i idx = _mm512_add_epi32(
+        _mm512_mullo_epi32(x, _mm512_set1_epi32(plane.width)), y);
+
+    __m512i d = _mm512_mask_i32gather_epi32(zero, in, idx, plane.data, 2);
+    d = _mm512_and_si512(d, _mm512_set1_epi32(0xffff));
+
+    // Background and out of the image pixels
+    return _mm512_mask_mov_epi32(d, _mm512_cmpeq_epi32_mask(d, zero),
+                                 _mm512_set1_epi32(DEFAULT_DEPTH));
+}
+
+/** \brief Depths of 16 pixels, looked up one at a time. */
+inline __m512i lookup16(
+    const rdf::DepthPlane* planes,
+    const int32_t* img,
+    const __m512i x,
+    const __m512i y
+) {
+    int32_t xs[16];
+    int32_t ys[16];
+    uint32_t ds[16];
+
+    _mm512_storeu_si512(xs, x);
+    _mm512_storeu_si512(ys, y);
+
+    for (int l = 0; l < 16; l++) {
+        ds[l] = rdf::planeDepth(planes[img[l]], xs[l], ys[l]);
+    }
+
+    return _mm512_loadu_si512(ds);
+}
+
+} // namespace
+
+void rdf::featureResponses(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    float* responses
+) {
+    size_t i;
+    const size_t n = block.size();
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        const __m512i x = _mm512_loadu_si512(&block.x[i]);
+        const __m512i y = _mm512_loadu_si512(&block.y[i]);
+        const __m512i d = _mm512_loadu_si512(&block.depth[i]);
+        const __m512i img = _mm512_loadu_si512(&block.img[i]);
+
+        const __m512i ux_ = toShort16(_mm512_add_epi32(x, scale16(ux, d)));
+        const __m512i uy_ = toShort16(_mm512_add_epi32(y, scale16(uy, d)));
+        const __m512i vx_ = toShort16(_mm512_add_epi32(x, scale16(vx, d)));
+        const __m512i vy_ = toShort16(_mm512_add_epi32(y, scale16(vy, d)));
+
+        __m512i uDepth;
+        __m512i vDepth;
+
+        // A single gather needs all the pixels in the same image
+        if (_mm512_cmpeq_epi32_mask(img, _mm512_set1_epi32(block.img[i]))
+                == 0xffff) {
+            uDepth = gather16(planes[block.img[i]], ux_, uy_);
+            vDepth = gather16(planes[block.img[i]], vx_, vy_);
+        }
+        else {
+            uDepth = lookup16(planes, &block.img[i], ux_, uy_);
+            vDepth = lookup16(planes, &block.img[i], vx_, vy_);
+        }
+
+        const __m512i r = _mm512_sub_epi32(uDepth, vDepth);
+        const __m512 hi = _mm512_cvtepi32_ps(_mm512_srli_epi32(r, 16));
+        const __m512 lo = _mm512_cvtepi32_ps(
+            _mm512_and_si512(r, _mm512_set1_epi32(0xffff)));
+
+        _mm512_storeu_ps(&responses[i], _mm512_add_ps(
+            _mm512_mul_ps(hi, _mm512_set1_ps(65536.0f)), lo));
+    }
+
+    featureResponsesScalar(ux, uy, vx, vy, block, planes, i, n, responses);
+}
+
+const char* rdf::featureKernelName() {
+    return "AVX-512";
+}
+
+#elif defined(__AVX2__)
+
+namespace {
+
+/** \brief Low 16 bits of the unsigned quotients off / d of 4 depths. */
+inline __m128i quotient4(const __m256d off, const __m128i d) {
+    const __m256d q = _mm256_round_pd(
+        _mm256_div_pd(off, _mm256_cvtepi32_pd(d)),
+        _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    const __m256d hi = _mm256_floor_pd(
+        _mm256_mul_pd(q, _mm256_set1_pd(1.0 / 65536.0)));
+
+    return _mm256_cvttpd_epi32(
+        _mm256_sub_pd(q, _mm256_mul_pd(hi, _mm256_set1_pd(65536.0))));
+}
+
+/** \brief Offset component scaled by the depths of 8 pixels. */
+inline __m256i scale8(const int off, const __m256i d) {
+    const __m256d a = _mm256_set1_pd(double(uint32_t(off)));
+    const __m256i q = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(quotient4(a, _mm256_castsi256_si128(d))),
+        quotient4(a, _mm256_extracti128_si256(d, 1)), 1);
+
+    // A zero depth leaves the offset at 0
+    return _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(d, _mm256_setzero_si256()), q);
+}
+
+/** \brief Sign extends the low 16 bits of each lane. */
+inline __m256i toShort8(const __m256i c) {
+    return _mm256_srai_epi32(_mm256_slli_epi32(c, 16), 16);
+}
+
+/** \brief Depths of 8 pixels, all of them from the same plane. */
+inline __m256i gather8(
+    const rdf::DepthPlane& plane,
+    const __m256i x,
+    const __m256i y
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    const __m256i in = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_cmpgt_epi32(x, minusOne),
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(plane.height), x)),
+        _mm256_and_si256(
+            _mm256_cmpgt_epi32(y, minusOne),
+            _mm256_cmpgt_epi32(_mm256_set1_epi32(plane.width), y)));
+    const __m256i idx = _mm256_and_si256(in, _mm256_add_epi32(
+        _mm256_mullo_epi32(x, _mm256_set1_epi32(plane.width)), y));
+
+    __m256i d = _mm256_mask_i32gather_epi32(
+        zero, (const int*) plane.data, idx, in, 2);
+    d = _mm256_and_si256(d, _mm256_set1_epi32(0xffff));
+
+    // Background and out of the image pixels
+    return _mm256_blendv_epi8(d, _mm256_set1_epi32(DEFAULT_DEPTH),
+                              _mm256_cmpeq_epi32(d, zero));
+}
+
+/** \brief Depths of 8 pixels, looked up one at a time. */
+inline __m256i lookup8(
+    const rdf::DepthPlane* planes,
+    const int32_t* img,
+    const __m256i x,
+    const __m256i y
+) {
+    int32_t xs[8];
+    int32_t ys[8];
+    uint32_t ds[8];
+
+    _mm256_storeu_si256((__m256i*) xs, x);
+    _mm256_storeu_si256((__m256i*) ys, y);
+
+    for (int l = 0; l < 8; l++) {
+        ds[l] = rdf::planeDepth(planes[img[l]], xs[l], ys[l]);
+    }
+
+    return _mm256_loadu_si256((const __m256i*) ds);
+}
+
+} // namespace
+
+void rdf::featureResponses(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    float* responses
+) {
+    size_t i;
+    const size_t n = block.size();
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*) &block.x[i]);
+        const __m256i y = _mm256_loadu_si256((const __m256i*) &block.y[i]);
+        const __m256i d = _mm256_loadu_si256((const __m256i*) &block.depth[i]);
+        const __m256i img = _mm256_loadu_si256((const __m256i*) &block.img[i]);
+
+        const __m256i ux_ = toShort8(_mm256_add_epi32(x, scale8(ux, d)));
+        const __m256i uy_ = toShort8(_mm256_add_epi32(y, scale8(uy, d)));
+        const __m256i vx_ = toShort8(_mm256_add_epi32(x, scale8(vx, d)));
+        const __m256i vy_ = toShort8(_mm256_add_epi32(y, scale8(vy, d)));
+
+        __m256i uDepth;
+        __m256i vDepth;
+
+        // A single gather needs all the pixels in the same image
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+                img, _mm256_set1_epi32(block.img[i]))) == -1) {
+            uDepth = gather8(planes[block.img[i]], ux_, uy_);
+            vDepth = gather8(planes[block.img[i]], vx_, vy_);
+        }
+        else {
+            uDepth = lookup8(planes, &block.img[i], ux_, uy_);
+            vDepth = lookup8(planes, &block.img[i], vx_, vy_);
+        }
+
+        const __m256i r = _mm256_sub_epi32(uDepth, vDepth);
+        const __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(r, 16));
+        const __m256 lo = _mm256_cvtepi32_ps(
+            _mm256_and_si256(r, _mm256_set1_epi32(0xffff)));
+
+        _mm256_storeu_ps(&responses[i], _mm256_add_ps(
+            _mm256_mul_ps(hi, _mm256_set1_ps(65536.0f)), lo));
+    }
+
+    featureResponsesScalar(ux, uy, vx, vy, block, planes, i, n, responses);
+}
+
+const char* rdf::featureKernelName() {
+    return "AVX2";
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+namespace {
+
+/** \brief Low 16 bits of the unsigned quotients off / d of 2 depths. */
+inline int32x2_t quotient2(const float64x2_t off, const uint32x2_t d) {
+    const float64x2_t q = vrndq_f64(
+        vdivq_f64(off, vcvtq_f64_u64(vmovl_u32(d))));
+    const float64x2_t hi = vrndmq_f64(vmulq_n_f64(q, 1.0 / 65536.0));
+
+    return vmovn_s64(vcvtq_s64_f64(vsubq_f64(q, vmulq_n_f64(hi, 65536.0))));
+}
+
+/** \brief Offset component scaled by the depths of 4 pixels. */
+inline int32x4_t scale4(const int off, const uint32x4_t d) {
+    const float64x2_t a = vdupq_n_f64(double(uint32_t(off)));
+    const int32x4_t q = vcombine_s32(quotient2(a, vget_low_u32(d)),
+                                     quotient2(a, vget_high_u32(d)));
+
+    // A zero depth leaves the offset at 0
+    return vbicq_s32(q, vreinterpretq_s32_u32(vceqq_u32(d, vdupq_n_u32(0))));
+}
+
+/** \brief Sign extends the low 16 bits of each lane. */
+inline int32x4_t toShort4(const int32x4_t c) {
+    return vshrq_n_s32(vshlq_n_s32(c, 16), 16);
+}
+
+/** \brief Depths of 4 pixels, NEON has no gather instruction. */
+inline uint32x4_t lookup4(
+    const rdf::DepthPlane* planes,
+    const int32_t* img,
+    const int32x4_t x,
+    const int32x4_t y
+) {
+    int32_t xs[4];
+    int32_t ys[4];
+    uint32_t ds[4];
+
+    vst1q_s32(xs, x);
+    vst1q_s32(ys, y);
+
+    for (int l = 0; l < 4; l++) {
+        ds[l] = rdf::planeDepth(planes[img[l]], xs[l], ys[l]);
+    }
+
+    return vld1q_u32(ds);
+}
+
+} // namespace
+
+void rdf::featureResponses(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    float* responses
+) {
+    size_t i;
+    const size_t n = block.size();
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        const int32x4_t x = vld1q_s32(&block.x[i]);
+        const int32x4_t y = vld1q_s32(&block.y[i]);
+        const uint32x4_t d = vld1q_u32(&block.depth[i]);
+
+        const int32x4_t ux_ = toShort4(vaddq_s32(x, scale4(ux, d)));
+        const int32x4_t uy_ = toShort4(vaddq_s32(y, scale4(uy, d)));
+        const int32x4_t vx_ = toShort4(vaddq_s32(x, scale4(vx, d)));
+        const int32x4_t vy_ = toShort4(vaddq_s32(y, scale4(vy, d)));
+
+        const uint32x4_t uDepth = lookup4(planes, &block.img[i], ux_, uy_);
+        const uint32x4_t vDepth = lookup4(planes, &block.img[i], vx_, vy_);
+
+        const uint32x4_t r = vsubq_u32(uDepth, vDepth);
+        const float32x4_t hi = vcvtq_f32_u32(vshrq_n_u32(r, 16));
+        const float32x4_t lo = vcvtq_f32_u32(vandq_u32(r, vdupq_n_u32(0xffff)));
+
+        vst1q_f32(&responses[i], vaddq_f32(vmulq_n_f32(hi, 65536.0f), lo));
+    }
+
+    featureResponsesScalar(ux, uy, vx, vy, block, planes, i, n, responses);
+}
+
+const char* rdf::featureKernelName() {
+    return "NEON";
+}
+
+#else
+
+void rdf::featureResponses(
+    const int ux,
+    const int uy,
+    const int vx,
+    const int vy,
+    const FeatureBlock& block,
+    const DepthPlane* planes,
+    float* responses
+) {
+    featureResponsesScalar(ux, uy, vx, vy, block, planes, 0, block.size(),
+                           responses);
+}
+
+const char* rdf::featureKernelName() {
+    return "scalar";
+}
+
+#endif
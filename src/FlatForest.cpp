@@ -0,0 +1,207 @@
+/** \file FlatForest.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file FlatForest.h
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+
+#include <rdf/FlatForest.h>
+
+
+/** \brief Flattens the trees of a forest.
+ *
+ *  Every tree is walked in breadth-first order. A child gets its index when
+ *  its parent is visited, so the split records are written in the same
+ *  order they are numbered.
+ *
+ *  \param[in] trees Roots of the trees.
+ *  \param[in] numLabels Number of labels of the leaf distributions.
+ */
+void rdf::FlatForest::build(
+    const std::vector<Node*>& trees, 
+    const int numLabels
+) {
+    labelNum = numLabels;
+    splits.clear();
+    leafProbs.clear();
+    roots.clear();
+    mapping.reset();
+
+    // Returns the index of the node in the flat arrays, leaves are written
+    // right away and splits are queued to be written when visited.
+    std::queue<std::pair<SplitNode*, int32_t> > q;
+
+    auto place = [&](Node* n) -> int32_t {
+        if (n->nodeType() == LEAF) {
+            const LeafDistribution& pDist = ((LeafNode*) n)->pDist;
+            const int32_t leaf = 
+                static_cast<int32_t>(leafProbs.size() / labelNum);
+
+            leafProbs.resize(leafProbs.size() + labelNum, 0.0f);
+            std::copy(pDist.begin(), 
+                      pDist.begin() + std::min<size_t>(pDist.size(), labelNum),
+                      leafProbs.end() - labelNum);
+            return ~leaf;
+        }
+
+        const int32_t split = static_cast<int32_t>(splits.size());
+        splits.push_back(FlatSplit());
+        q.push(std::make_pair((SplitNode*) n, split));
+        return split;
+    };
+
+    for (const auto root : trees) {
+        roots.push_back(place(root));
+
+        while (!q.empty()) {
+            SplitNode* sNode = q.front().first;
+            const int32_t idx = q.front().second;
+            q.pop();
+
+            FlatSplit s;
+            s.ux = sNode->phi.u.x;
+            s.uy = sNode->phi.u.y;
+            s.vx = sNode->phi.v.x;
+            s.vy = sNode->phi.v.y;
+            s.t = sNode->phi.t;
+            s.left = place(sNode->left_);
+            s.right = place(sNode->right_);
+            s.pad = 0;
+
+            splits[idx] = s;
+        }
+    }
+
+    bindViews();
+}
+
+
+/** \brief Offset of the split records in a binary forest.
+ *
+ *  \param[in] trees Number of trees of the forest.
+ *  \return Offset from the start of the file, a multiple of the size of a
+ *  split record so no record straddles two cache lines.
+ */
+size_t rdf::FlatForest::splitOffset(uint32_t trees) {
+    const size_t end = sizeof(FlatForestHeader) + trees * sizeof(int32_t);
+
+    return (end + sizeof(FlatSplit) - 1) / sizeof(FlatSplit) * sizeof(FlatSplit);
+}
+
+
+/** \brief Writes the forest in the binary format.
+ *
+ *  \param[in] fileName Path to the output file.
+ */
+void rdf::FlatForest::write(const std::string& fileName) const {
+    FILE* fp;
+    FlatForestHeader header;
+
+    if ((fp = fopen(fileName.c_str(), "wb")) == NULL) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header.magic = FLAT_FOREST_MAGIC;
+    header.version = FLAT_FOREST_VERSION;
+    header.labelNum = labelNum;
+    header.treeNum = rootNum;
+    header.splitNum = splitNum;
+    header.leafNum = leafNum;
+
+    const std::vector<char> pad(splitOffset(rootNum) - sizeof(header) - 
+                                rootNum * sizeof(int32_t), 0);
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(rootView, sizeof(int32_t), rootNum, fp);
+    fwrite(pad.data(), 1, pad.size(), fp);
+    fwrite(splitView, sizeof(FlatSplit), splitNum, fp);
+    fwrite(leafView, sizeof(float), size_t(leafNum) * labelNum, fp);
+
+    if (fclose(fp) != 0) {
+        printf("Cannot write file %s.\n", fileName.c_str());
+        exit(1);
+    }
+}
+
+
+/** \brief Maps a forest in the binary format.
+ *
+ *  \param[in] fileName Path to the binary forest.
+ */
+void rdf::FlatForest::map(const std::string& fileName) {
+    const FlatForestHeader* header;
+    size_t expected;
+
+    MappedFile::Ptr file(new MappedFile(fileName));
+
+    if (file->size() < sizeof(FlatForestHeader)) {
+        printf("File %s is not a binary forest.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header = reinterpret_cast<const FlatForestHeader*>(file->data());
+
+    if ((header->magic != FLAT_FOREST_MAGIC) || 
+        (header->version != FLAT_FOREST_VERSION)) {
+        printf("File %s is not a binary forest.\n", fileName.c_str());
+        exit(1);
+    }
+
+    expected = splitOffset(header->treeNum) + 
+               size_t(header->splitNum) * sizeof(FlatSplit) + 
+               size_t(header->leafNum) * header->labelNum * sizeof(float);
+
+    if (file->size() < expected) {
+        printf("Binary forest %s is truncated.\n", fileName.c_str());
+        exit(1);
+    }
+
+    splits.clear();
+    leafProbs.clear();
+    roots.clear();
+    mapping = file;
+    labelNum = header->labelNum;
+
+    bindViews();
+}
+
+
+/** \brief Points the views to the vectors or to the mapping. */
+void rdf::FlatForest::bindViews() {
+    const FlatForestHeader* header;
+
+    if (mapping == nullptr) {
+        rootView = roots.data();
+        splitView = splits.data();
+        leafView = leafProbs.data();
+        rootNum = static_cast<uint32_t>(roots.size());
+        splitNum = static_cast<uint32_t>(splits.size());
+        leafNum = (labelNum > 0) 
+            ? static_cast<uint32_t>(leafProbs.size() / labelNum) : 0;
+    }
+    else {
+        header = reinterpret_cast<const FlatForestHeader*>(mapping->data());
+        rootNum = header->treeNum;
+        splitNum = header->splitNum;
+        leafNum = header->leafNum;
+
+        rootView = reinterpret_cast<const int32_t*>(
+            mapping->data() + sizeof(FlatForestHeader));
+        splitView = reinterpret_cast<const FlatSplit*>(
+            mapping->data() + splitOffset(rootNum));
+        leafView = reinterpret_cast<const float*>(splitView + splitNum);
+    }
+
+    offsetBound = 0;
+    for (uint32_t i = 0; i < splitNum; i++) {
+        const FlatSplit& s = splitView[i];
+
+        offsetBound = std::max(offsetBound, std::max(
+            std::max(std::abs(s.ux), std::abs(s.uy)),
+            std::max(std::abs(s.vx), std::abs(s.vy))));
+    }
+}
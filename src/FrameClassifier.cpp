@@ -0,0 +1,68 @@
+/** \file FrameClassifier.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file FrameClassifier.h
+ */
+#include <algorithm>
+
+#include <rdf/FrameClassifier.h>
+
+
+/** \brief Creates the classifier of a backend. There is no GPU backend
+ *  yet, it falls back to the CPU one.
+ *
+ *  \param[in] backend Requested backend.
+ *  \param[in] forest Compiled or mapped forest.
+ *  \return The new classifier.
+ */
+rdf::FrameClassifier::Ptr rdf::FrameClassifier::create(
+    classifierBackend backend,
+    RandomForest& forest
+) {
+    if (backend == GPU_CLASSIFIER) {
+        printf("No GPU classifier in this build, using the CPU classifier\n");
+    }
+
+    return Ptr(new CpuFrameClassifier(forest));
+}
+
+
+/** \brief Classifies the frame into the next slot.
+ *  \param[in] img Frame to classify.
+ */
+void rdf::CpuFrameClassifier::submit(const PaddedDepthImage& img) {
+    if (submitted - collected == FRAME_CLASSIFIER_DEPTH) {
+        printf("Error: more than %d frames submitted without collect\n",
+               FRAME_CLASSIFIER_DEPTH);
+        exit(1);
+    }
+
+    const int k = submitted % FRAME_CLASSIFIER_DEPTH;
+    const size_t n = static_cast<size_t>(img.width) * img.height;
+
+    slotLabels[k].resize(n);
+    slotProbs[k].resize(n);
+    forest.classifyFrame(img, slotLabels[k].data(), slotProbs[k].data());
+    submitted++;
+}
+
+
+/** \brief Copies the oldest slot to the caller planes.
+ *  \param[out] labels Caller owned plane of width * height labels.
+ *  \param[out] probs Caller owned plane of width * height floats, or
+ *  nullptr.
+ */
+void rdf::CpuFrameClassifier::collect(Label* labels, float* probs) {
+    if (submitted == collected) {
+        printf("Error: no frame submitted to collect\n");
+        exit(1);
+    }
+
+    const int k = collected % FRAME_CLASSIFIER_DEPTH;
+
+    std::copy(slotLabels[k].begin(), slotLabels[k].end(), labels);
+    if (probs != nullptr) {
+        std::copy(slotProbs[k].begin(), slotProbs[k].end(), probs);
+    }
+    collected++;
+}
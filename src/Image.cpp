@@ -15,6 +15,10 @@ rdf::TrainImage::TrainImage(const std::string& fileName) {
     unsigned d;
     FILE* fp;
 
+    if (hasExtension(fileName, BINARY_IMAGE_EXT)) {
+        loadBinary(fileName);
+        return;
+    }
 
     if ((fp = fopen(fileName.c_str(), "r")) == NULL) {
         printf("Cannot open file %s.\n", fileName.c_str());
@@ -48,6 +52,201 @@ rdf::TrainImage::TrainImage(const std::string& fileName) {
         J.push_back(s);
     }
     fclose(fp);
+
+    bindViews();
+}
+
+
+/** \brief Copy constructor.
+ *  \param[in] img Image to copy.
+ */
+rdf::TrainImage::TrainImage(const TrainImage& img) 
+    : Image(img)
+    , id(img.id)
+    , pixelLabels(img.pixelLabels)
+    , pixelDepths(img.pixelDepths)
+    , I(img.I)
+    , J(img.J)
+    , mapping(img.mapping)
+    , depthPlane(img.depthPlane)
+    , labelPlane(img.labelPlane) {
+    bindViews();
+}
+
+
+/** \brief Move constructor.
+ *  \param[in] img Image to move.
+ */
+rdf::TrainImage::TrainImage(TrainImage&& img) 
+    : Image(img)
+    , id(img.id)
+    , pixelLabels(std::move(img.pixelLabels))
+    , pixelDepths(std::move(img.pixelDepths))
+    , I(std::move(img.I))
+    , J(std::move(img.J))
+    , mapping(std::move(img.mapping))
+    , depthPlane(std::move(img.depthPlane))
+    , labelPlane(std::move(img.labelPlane)) {
+    bindViews();
+}
+
+
+/** \brief Copy assignment.
+ *  \param[in] img Image to copy.
+ */
+rdf::TrainImage& rdf::TrainImage::operator=(const TrainImage& img) {
+    Image::operator=(img);
+    id = img.id;
+    pixelLabels = img.pixelLabels;
+    pixelDepths = img.pixelDepths;
+    I = img.I;
+    J = img.J;
+    depthPlane = img.depthPlane;
+    labelPlane = img.labelPlane;
+    mapping = img.mapping;
+    bindViews();
+    return *this;
+}
+
+
+/** \brief Move assignment.
+ *  \param[in] img Image to move.
+ */
+rdf::TrainImage& rdf::TrainImage::operator=(TrainImage&& img) {
+    Image::operator=(img);
+    id = img.id;
+    pixelLabels = std::move(img.pixelLabels);
+    pixelDepths = std::move(img.pixelDepths);
+    I = std::move(img.I);
+    J = std::move(img.J);
+    depthPlane = std::move(img.depthPlane);
+    labelPlane = std::move(img.labelPlane);
+    mapping = std::move(img.mapping);
+    bindViews();
+    return *this;
+}
+
+
+/** \brief Maps an image in the binary format.
+ *  \param[in] fileName Path to the binary image.
+ */
+void rdf::TrainImage::loadBinary(const std::string& fileName) {
+    const BinaryImageHeader* header;
+    size_t expected;
+    unsigned x;
+    unsigned idx;
+    unsigned rowBegin;
+
+    mapping = MappedFile::Ptr(new MappedFile(fileName));
+
+    if (mapping->size() < sizeof(BinaryImageHeader)) {
+        printf("File %s is not a binary image.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header = reinterpret_cast<const BinaryImageHeader*>(mapping->data());
+
+    if ((header->magic != BINARY_IMAGE_MAGIC) || 
+        (header->version != BINARY_IMAGE_VERSION)) {
+        printf("File %s is not a binary image.\n", fileName.c_str());
+        exit(1);
+    }
+
+    expected = sizeof(BinaryImageHeader) + 
+               header->height * sizeof(uint32_t) + 
+               header->nnz * (sizeof(uint32_t) + sizeof(uint16_t) + 
+                              sizeof(Label));
+
+    if (mapping->size() < expected) {
+        printf("Binary image %s is truncated.\n", fileName.c_str());
+        exit(1);
+    }
+
+    width = header->width;
+    height = header->height;
+
+    bindViews();
+
+    // The lookups read J[I[x - 1]] ... J[I[x] - 1] and index the rows of
+    // the dense planes with J, so the index arrays are checked once here.
+    // The columns of a row are sorted for the binary search of getDepth.
+    for (x = 0; x < rowNum; x++) {
+        rowBegin = (x == 0) ? 0 : IView[x - 1];
+
+        if ((IView[x] < rowBegin) || (IView[x] > nnz)) {
+            printf("File %s is not a binary image.\n", fileName.c_str());
+            exit(1);
+        }
+
+        for (idx = rowBegin; idx < IView[x]; idx++) {
+            if ((JView[idx] >= width) || 
+                ((idx > rowBegin) && (JView[idx] <= JView[idx - 1]))) {
+                printf("File %s is not a binary image.\n", fileName.c_str());
+                exit(1);
+            }
+        }
+    }
+}
+
+
+/** \brief Points the views to the vectors or to the mapping. */
+void rdf::TrainImage::bindViews() {
+    const char* ptr;
+    const BinaryImageHeader* header;
+
+    if (mapping == nullptr) {
+        labelView = pixelLabels.data();
+        depthView = pixelDepths.data();
+        IView = I.data();
+        JView = J.data();
+        rowNum = static_cast<unsigned>(I.size());
+        nnz = static_cast<unsigned>(J.size());
+        return;
+    }
+
+    header = reinterpret_cast<const BinaryImageHeader*>(mapping->data());
+    rowNum = header->height;
+    nnz = header->nnz;
+
+    ptr = mapping->data() + sizeof(BinaryImageHeader);
+    IView = reinterpret_cast<const unsigned*>(ptr);
+    ptr += rowNum * sizeof(uint32_t);
+    depthView = reinterpret_cast<const unsigned*>(ptr);
+    ptr += nnz * sizeof(uint32_t);
+    JView = reinterpret_cast<const unsigned short*>(ptr);
+    ptr += nnz * sizeof(uint16_t);
+    labelView = reinterpret_cast<const Label*>(ptr);
+}
+
+
+/** \brief Writes the image in the binary format.
+ *  \param[in] fileName Path to the output file.
+ */
+void rdf::TrainImage::writeBinary(const std::string& fileName) {
+    FILE* fp;
+    BinaryImageHeader header;
+
+    if ((fp = fopen(fileName.c_str(), "wb")) == NULL) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header.magic = BINARY_IMAGE_MAGIC;
+    header.version = BINARY_IMAGE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.nnz = nnz;
+
+    // The binary format has one row entry per image row.
+    std::vector<uint32_t> rows(height, nnz);
+    std::copy(IView, IView + std::min<unsigned>(rowNum, height), rows.begin());
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(rows.data(), sizeof(uint32_t), rows.size(), fp);
+    fwrite(depthView, sizeof(uint32_t), nnz, fp);
+    fwrite(JView, sizeof(uint16_t), nnz, fp);
+    fwrite(labelView, sizeof(Label), nnz, fp);
+    fclose(fp);
 }
 
 
@@ -58,12 +257,11 @@ rdf::TrainImage::TrainImage(const std::string& fileName) {
  * \return index of the content array, NOT_FOUND if pixel from 
  * background.
  */
-int rdf::TrainImage::getIndex(const short& x, const short& y) {
-    int index;
+int rdf::TrainImage::getIndex(const short& x, const short& y) const {
+    unsigned rowBegin;
+    unsigned rowEnd;
 
-    std::vector<unsigned short>::iterator it;
-    std::vector<unsigned short>::iterator begin;
-    std::vector<unsigned short>::iterator end;
+    const unsigned short* it;
 
     // Check the range of x
     if ((x < 0) || (x >= height)) {
@@ -74,43 +272,79 @@ int rdf::TrainImage::getIndex(const short& x, const short& y) {
         return NOT_FOUND;
     }
     
-    // If the 'I' vector in the position X is equal to 0, then there is
-    // any element in that row and return the default value;
-    if (I[x] == 0) {
+    // The elements of the row x are in J[I[x - 1]] ... J[I[x] - 1]. If
+    // the range is empty there is no element in that row.
+    if (static_cast<unsigned>(x) >= rowNum) {
         return NOT_FOUND;
     }
 
-    // Set the index to start searching for y
-    if (x == 0) {
-        begin = J.begin();
-    }
-    else {
-        begin = J.begin() + I[x - 1];
+    rowBegin = (x == 0) ? 0 : IView[x - 1];
+    rowEnd = IView[x];
+
+    if (rowBegin == rowEnd) {
+        return NOT_FOUND;
     }
 
-    end = J.begin() + I[x] - 1;
-    
-    it = lower_bound (begin, end, y);
-    index = it - J.begin();
+    it = std::lower_bound (JView + rowBegin, JView + rowEnd, y);
 
-    if (J[index] == y) {
-        return index;
+    if ((it != JView + rowEnd) && (*it == y)) {
+        return it - JView;
     }
 
     return NOT_FOUND;
 }
 
+
+/** \brief Builds the dense depth and label planes of the image.
+ *  \return true if the image is now in dense storage.
+ */
+bool rdf::TrainImage::densify() {
+    unsigned x;
+    unsigned idx;
+    unsigned rowBegin;
+
+    // Depth 0 is the background value of the dense plane.
+    for (idx = 0; idx < nnz; idx++) {
+        if ((depthView[idx] == 0) || (depthView[idx] > 0xffff)) {
+            return false;
+        }
+    }
+
+    // One guard element for the 32 bit gathers of the feature kernels.
+    depthPlane.assign(width * height + 1, 0);
+    labelPlane.assign(width * height, DEFAULT_LABEL);
+
+    for (x = 0; x < std::min<unsigned>(rowNum, height); x++) {
+        rowBegin = (x == 0) ? 0 : IView[x - 1];
+
+        for (idx = rowBegin; idx < IView[x]; idx++) {
+            depthPlane[x * width + JView[idx]] = depthView[idx];
+            labelPlane[x * width + JView[idx]] = labelView[idx];
+        }
+    }
+
+    return true;
+}
+
 /** \brief Gets the label value of the pixel in position (x,y). 
  * \param[in] x Pixel X-axis coordinate.
  * \param[in] y Pixel Y-axis coordinate.
  * \return Label value of the pixel (x,y) or DEFAULT_LABEL if
  * label not found.
  */
-Label rdf::TrainImage::getLabel(const short& x, const short& y) {
+Label rdf::TrainImage::getLabel(const short& x, const short& y) const {
     int index;
+
+    if (!labelPlane.empty()) {
+        if ((x < 0) || (x >= height) || (y < 0) || (y >= width)) {
+            return DEFAULT_LABEL;
+        }
+        return labelPlane[x * width + y];
+    }
+
     index = getIndex(x,y);
     if (index != NOT_FOUND) {
-        return pixelLabels[index];
+        return labelView[index];
     }
     else {
         return DEFAULT_LABEL;
@@ -124,12 +358,20 @@ Label rdf::TrainImage::getLabel(const short& x, const short& y) {
  * \return depth value of the pixel (x,y) or DEFAULT_DEPTH if
  * depth not found.
  */
-unsigned rdf::TrainImage::getDepth(const short& x, const short& y) {
+unsigned rdf::TrainImage::getDepth(const short& x, const short& y) const {
     int index;
+
+    if (!depthPlane.empty()) {
+        if ((x < 0) || (x >= height) || (y < 0) || (y >= width)) {
+            return DEFAULT_DEPTH;
+        }
+        const unsigned d = depthPlane[x * width + y];
+        return (d != 0) ? d : DEFAULT_DEPTH;
+    }
     
     index = getIndex(x,y);
     if (index != NOT_FOUND) {
-        return pixelDepths[index];
+        return depthView[index];
     }
     else {
         return DEFAULT_DEPTH;
@@ -145,14 +387,14 @@ unsigned rdf::TrainImage::getDepth(const short& x, const short& y) {
  */
 void rdf::TrainImage::getRandomCoord(uint32_t& row, uint32_t& col) {
     // pick a random non-zero element.
-    const auto ind = static_cast<uint32_t>(rand() % J.size());
+    const auto ind = static_cast<uint32_t>(threadRng().below(nnz));
 
     // get the col.
-    col = J[ind];
+    col = JView[ind];
     
     // get the row.
-    const auto& it = std::upper_bound(I.begin(), I.end(), ind);
-    row = static_cast<uint32_t>(it - I.begin());
+    const auto it = std::upper_bound(IView, IView + rowNum, ind);
+    row = static_cast<uint32_t>(it - IView);
 }
 
 /** \brief This function get a random coord of a given label group of
@@ -162,58 +404,99 @@ void rdf::TrainImage::getRandomCoord(uint32_t& row, uint32_t& col) {
  *  \return a random coordinate of pixel of the given label.
  */
 void rdf::TrainImage::getRandCoordByLabel(int pixNum, std::vector<PixelInfo>& p, int imgId) {
+    std::vector<unsigned> scratch;
+
+    p.resize(pixNum);
+    p.resize(samplePixels(pixNum, true, imgId, threadRng(), p.data(), scratch));
+}
+
+/** \brief Samples pixels of the image with a given generator.
+ *
+ *  \param[in] pixNum Number of pixels to sample.
+ *  \param[in] byLabel Whether to stratify the pixels by label.
+ *  \param[in] imgId Id of the image in the sampled pixels.
+ *  \param[in,out] rng Generator of the sampling.
+ *  \param[out] out Array of pixNum pixels.
+ *  \param[in,out] scratch Buffer for the elements grouped by label.
+ *  \return Number of pixels sampled.
+ */
+int rdf::TrainImage::samplePixels(
+    int pixNum,
+    bool byLabel,
+    int imgId,
+    Rng& rng,
+    PixelInfo* out,
+    std::vector<unsigned>& scratch
+) const {
     unsigned i;
-    unsigned j;
-    unsigned ind;
-    unsigned x;
-    unsigned short y;
-    vector <unsigned> Jind[NUMBER_OF_LABELS];
-    vector <bool> labImg(NUMBER_OF_LABELS, false);
-    vector <unsigned> :: iterator it;
+    int j;
+    int k = 0;
     int labFound = 0;
-    unsigned pixPerLab;
-    unsigned rest;
-    unsigned pixToTake;
- 
-    p.clear();
-
-    // Find all the label index and organize them in Jind matrix
-    for (i = 0; i < pixelLabels.size(); i++) {
-        if (labImg[pixelLabels[i] - 1] == false) {
-            labImg[pixelLabels[i] - 1] = true;
-            labFound++;
+    unsigned start[NUMBER_OF_LABELS + 1] = {0};
+    unsigned next[NUMBER_OF_LABELS];
+
+    // Row of an element from the row starts of the Yale representation
+    auto pixel = [&](unsigned ind) {
+        const unsigned* it = std::upper_bound(IView, IView + rowNum, ind);
+        return PixelInfo(int(it - IView), JView[ind], imgId);
+    };
+
+    if (nnz == 0) {
+        return 0;
+    }
+
+    if (byLabel) {
+        for (i = 0; i < nnz; i++) {
+            if ((labelView[i] >= 1) && (labelView[i] <= NUMBER_OF_LABELS)) {
+                start[labelView[i]]++;
+            }
+        }
+
+        for (j = 0; j < NUMBER_OF_LABELS; j++) {
+            labFound += start[j + 1] > 0;
+            start[j + 1] += start[j];
+            next[j] = start[j];
         }
-        Jind[pixelLabels[i] - 1].push_back(i);
     }
 
-    pixPerLab = pixNum / labFound;
+    // Without labels the stratification falls back to every element
+    if (labFound == 0) {
+        for (k = 0; k < pixNum; k++) {
+            out[k] = pixel(rng.below(nnz));
+        }
+        return pixNum;
+    }
 
-    rest = pixNum - (pixPerLab * labFound);
+    scratch.resize(start[NUMBER_OF_LABELS]);
 
-    for (i = 0; i < NUMBER_OF_LABELS; i++) {
-        if (labImg[i] == true) {
-            if (rest > 0) {
-                pixToTake = pixPerLab + 1;
-                rest--;
-            }
-            else {
-                pixToTake = pixPerLab;
-            }
-            for (j = 0; j < pixToTake; j++) {
-                // Get random index from the label group
-                ind = Jind[i][ rand() % Jind[i].size() ];
+    for (i = 0; i < nnz; i++) {
+        if ((labelView[i] >= 1) && (labelView[i] <= NUMBER_OF_LABELS)) {
+            scratch[next[labelView[i] - 1]++] = i;
+        }
+    }
 
-                // get the col number
-                y = J[ind];
-                
-                it = upper_bound (I.begin(), I.end(), ind);
+    const int pixPerLab = pixNum / labFound;
+    int rest = pixNum - pixPerLab * labFound;
 
-                x = int(it - I.begin());
+    for (j = 0; j < NUMBER_OF_LABELS; j++) {
+        const unsigned size = start[j + 1] - start[j];
+        int pixToTake = pixPerLab;
 
-                p.push_back(PixelInfo(x, y, imgId));
-            }
+        if (size == 0) {
+            continue;
+        }
+
+        if (rest > 0) {
+            pixToTake++;
+            rest--;
+        }
+
+        for (; pixToTake > 0; pixToTake--) {
+            out[k++] = pixel(scratch[start[j] + rng.below(size)]);
         }
     }
+
+    return k;
 }
 
 /** \brief Prints the content labels of the entire train image.
@@ -234,7 +517,7 @@ void rdf::TrainImage::print(const int width, const int height) {
  *  \return Depth value of the (x,y) pixel.
  *  \param[in] y Pixel Y-axis coordinate.
  */
-unsigned rdf::KinectImage::getDepth(const short& x, const short& y)
+unsigned rdf::KinectImage::getDepth(const short& x, const short& y) const
 {
     // Check the range of x
     if ((x < 0) || (x >= height)) {
@@ -253,3 +536,47 @@ unsigned rdf::KinectImage::getDepth(const short& x, const short& y)
     }
     return d;
 }
+
+/** \brief Constructor. Allocates the frame filled with DEFAULT_DEPTH.
+ *  \param[in] band Width of the guard band in pixels, at least 1.
+ *  \param[in] w Width of the image.
+ *  \param[in] h Height of the image.
+ */
+rdf::PaddedDepthImage::PaddedDepthImage(
+    int band,
+    unsigned short w,
+    unsigned short h
+) : Image(w, h), band(std::max(band, 1)) {
+    stride = width + 2 * this->band;
+    origin = this->band * stride + this->band;
+    depth.assign(static_cast<size_t>(height + 2 * this->band) * stride, 
+                 DEFAULT_DEPTH);
+}
+
+/** \brief Copies a row-major plane of width * height sensor depths in the
+ *  frame. The guard band is not touched.
+ *  \param[in] d Depths in millimeters, 0 where there is no depth.
+ */
+void rdf::PaddedDepthImage::assign(const unsigned short* d) {
+    int x;
+    int y;
+
+    for (x = 0; x < height; x++) {
+        uint32_t* row = &depth[origin + x * stride];
+        const unsigned short* src = d + x * width;
+
+        for (y = 0; y < width; y++) {
+            row[y] = (src[y] != 0) ? src[y] : DEFAULT_DEPTH;
+        }
+    }
+}
+
+/** \brief Gets the depth value of the element in position (x,y).
+ *  \param[in] x Pixel X-axis coordinate.
+ *  \param[in] y Pixel Y-axis coordinate.
+ *  \return Depth value of the (x,y) pixel.
+ */
+unsigned rdf::PaddedDepthImage::getDepth(const short& x, const short& y) const
+{
+    return depthAt(x, y);
+}
@@ -1,15 +1,90 @@
+#include <unistd.h>
+
+#include <algorithm>
+
 #include <rdf/ImagePool.h>
 
+namespace {
+
+/** \brief Arguments of the image loading threads. Each thread loads the
+ *  images first, first + step, first + 2 * step...
+ */
+struct ImageLoaderArgs {
+    const std::vector<std::string>* fileNames;
+    std::vector<rdf::TrainImage>* images;
+    rdf::imageStorage storage;
+    unsigned first;
+    unsigned step;
+};
+
+/** \brief Loads an image file in the given storage.
+ *  \param[out] img The image.
+ *  \param[in] fileName Path to the image file.
+ *  \param[in] storage Storage backend of the image.
+ *  \param[in] id Index of the file.
+ */
+void loadImage(
+    rdf::TrainImage& img,
+    const std::string& fileName,
+    rdf::imageStorage storage,
+    int id
+) {
+    // Initialize train image structure
+    img = rdf::TrainImage(fileName);
+    img.id = id;
+
+    if ((storage == rdf::DENSE_STORAGE) && !img.densify()) {
+        printf("Image %s kept in sparse storage\n", fileName.c_str());
+    }
+}
+
+/** \brief Thread function that loads a slice of the image files. */
+void* loadImagesThread(void* args) {
+    ImageLoaderArgs& params = *((ImageLoaderArgs*) args);
+    unsigned i;
+
+    for (i = params.first; i < params.fileNames->size(); i += params.step) {
+        const std::string& fileName = (*params.fileNames)[i];
+
+        loadImage((*params.images)[i], fileName, params.storage, i);
+
+        printf("Image %s loaded\n", fileName.c_str());
+    }
+
+    return NULL;
+}
+
+} // namespace
+
 /** \brief Constructor.
- *  Loads the image content of the specified directory.
+ *  Loads the image content of the specified directory. Binary images are
+ *  memory mapped and text images are parsed, both in parallel.
  *  \param[in] dirname Directory path to the image pool.
+ *  \param[in] storage Storage backend of the loaded images.
+ *  \param[in] shard Index of the subset of images to load.
+ *  \param[in] shardNum Number of subsets the directory is divided in.
+ *  \param[in] capacity Maximum number of images in memory, 0 to load
+ *  every image.
  */
-rdf::ImagePool::ImagePool(const std::string dirname) {
-    int id = 0;
+rdf::ImagePool::ImagePool(
+    const std::string dirname, 
+    imageStorage storage,
+    int shard,
+    int shardNum,
+    int capacity
+)
+    : imgStorage(storage)
+    , slotNum(std::max(capacity, 0))
+    , acquired(0, -1)
+    , clock(0)
+    , stop(false) {
+
+    unsigned i;
+    unsigned threadNum;
     DIR *pdir = NULL;
     struct dirent *pent = NULL;
-    TrainImage img;
-    vector <TrainImage> temp;
+    std::vector<pthread_t> threads;
+    std::vector<ImageLoaderArgs> args;
 
     std::string fileName;
    
@@ -28,20 +103,83 @@ rdf::ImagePool::ImagePool(const std::string dirname) {
         fileName = dirname + string (pent -> d_name);
         
         // Checking extension
-        if (fileName.substr(fileName.size() - 5, 5) == ".simg") {
-            printf("Image %s loaded\n", fileName.c_str());
-
-            // Initialize train image structure
-            img = TrainImage(fileName.c_str());
-            img.id = id;
-            // insert into pool
-            images.push_back(img);
-            id++;
+        if (hasExtension(fileName, TEXT_IMAGE_EXT) || 
+            hasExtension(fileName, BINARY_IMAGE_EXT)) {
+            fileNames.push_back(fileName);
         }
         else {
             printf("File %s not loaded: Bad extension\n", fileName.c_str());
         }
     }
+    closedir(pdir);
+
+    // Every process of a cluster must agree on the images of each shard,
+    // whatever the directory order of its file system.
+    if (shardNum > 1) {
+        std::sort(fileNames.begin(), fileNames.end());
+
+        for (i = 0; shard + i * shardNum < fileNames.size(); i++) {
+            fileNames[i] = fileNames[shard + i * shardNum];
+        }
+        fileNames.resize(i);
+    }
+
+    order.resize(fileNames.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&work, NULL);
+    pthread_cond_init(&loaded, NULL);
+
+    // The images of an out of core pool are loaded when they are used
+    if (slotNum > 0) {
+        slots.assign(slotNum, Slot{-1, EMPTY_SLOT, 0, 0});
+        slotOf.assign(fileNames.size(), -1);
+        images.resize(slotNum);
+
+        pinned.reset(new std::atomic<TrainImage*>[fileNames.size()]);
+        for (i = 0; i < fileNames.size(); i++) {
+            pinned[i].store(nullptr);
+        }
+
+        loaders.resize(IMAGE_LOADER_THREADS);
+        for (i = 0; i < loaders.size(); i++) {
+            if (pthread_create(&loaders[i], NULL, loaderThread, this)) {
+                printf("Could not create image loader thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        printf("%u images in a cache of %d images\n", 
+               unsigned(fileNames.size()), slotNum);
+        return;
+    }
+
+    // The ids follow the directory order, whatever thread loads them.
+    images.resize(fileNames.size());
+
+    threadNum = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    threadNum = std::max(1u, std::min<unsigned>(threadNum, fileNames.size()));
+
+    threads.resize(threadNum);
+    args.resize(threadNum);
+
+    for (i = 0; i < threadNum; i++) {
+        args[i].fileNames = &fileNames;
+        args[i].images = &images;
+        args[i].storage = storage;
+        args[i].first = i;
+        args[i].step = threadNum;
+
+        if (pthread_create(&threads[i], NULL, loadImagesThread, &args[i])) {
+            printf("Could not create image loader thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < threadNum; i++) {
+        pthread_join(threads[i], NULL);
+    }
 }
 
 
@@ -49,11 +187,11 @@ rdf::ImagePool::ImagePool(const std::string dirname) {
  *  \param[in] index_vector The vector with the indices
  */
 void rdf::ImagePool::poolReorder(std::vector<int>& index_vector) {
-    std::vector<TrainImage> temp;
+    std::vector<int> temp;
     for (const auto index : index_vector) {
-        temp.push_back(images[index]);
+        temp.push_back(order[index]);
     }
-    images = temp;
+    order = temp;
 }
 
 
@@ -64,7 +202,7 @@ void rdf::ImagePool::poolReorder(std::vector<int>& index_vector) {
  *  \return return The pixel label.
  */
 Label rdf::ImagePool::getLabel(const PixelInfo& pi) {
-    return images[pi.id].getLabel(pi.x, pi.y);
+    return getImgPtr(pi.id)->getLabel(pi.x, pi.y);
 }
 
 
@@ -75,11 +213,267 @@ Label rdf::ImagePool::getLabel(const PixelInfo& pi) {
  *  @return The pixel depth.
  */
 unsigned rdf::ImagePool::getDepth(const PixelInfo& pi) {
-    return images[pi.id].getDepth(pi.x, pi.y);
+    return getImgPtr(pi.id)->getDepth(pi.x, pi.y);
+}
+
+
+/** \brief Gets the dense depth plane of every image of the pool.
+ *
+ *  \param[out] planes Plane of each image, in pool order.
+ *  \return false if some image is in sparse storage.
+ */
+bool rdf::ImagePool::densePlanes(std::vector<DepthPlane>& planes) {
+    int i;
+
+    planes.clear();
+
+    if (slotNum == 0) {
+        for (i = 0; i < size(); i++) {
+            const TrainImage& img = images[order[i]];
+
+            if (img.storage() != DENSE_STORAGE) {
+                planes.clear();
+                return false;
+            }
+            planes.push_back(img.plane());
+        }
+
+        return true;
+    }
+
+    planes.assign(size(), DepthPlane{nullptr, 0, 0});
+
+    for (i = acquired.start; i <= acquired.end; i++) {
+        const TrainImage& img = *getImgPtr(i);
+
+        if (img.storage() != DENSE_STORAGE) {
+            planes.clear();
+            return false;
+        }
+        planes[i] = img.plane();
+    }
+
+    return true;
+}
+
+
+
+/** \brief Stops the loader threads. **/
+rdf::ImagePool::~ImagePool() {
+    unsigned i;
+
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&mutex);
+
+    for (i = 0; i < loaders.size(); i++) {
+        pthread_join(loaders[i], NULL);
+    }
+
+    pthread_cond_destroy(&loaded);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+/** \brief Pins the images [first, last] of the pool in memory and queues
+ *  the missing ones to the loader threads, in the order of the range.
+ *
+ *  \param[in] first Index of the first image.
+ *  \param[in] last Index of the last image.
+ */
+void rdf::ImagePool::acquire(int first, int last) {
+    int i;
+
+    if (slotNum == 0) {
+        return;
+    }
+
+    release();
+
+    if (last - first + 1 > slotNum) {
+        printf("The cache of %d images cannot hold the %d images of a range\n", 
+               slotNum, last - first + 1);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    // Pin the images in memory first, so they are not evicted for the
+    // missing ones.
+    for (i = first; i <= last; i++) {
+        const int s = slotOf[order[i]];
+
+        if (s >= 0) {
+            slots[s].pins++;
+            slots[s].lastUse = ++clock;
+
+            if (slots[s].state == READY_SLOT) {
+                pinned[order[i]].store(&images[s], std::memory_order_release);
+            }
+        }
+    }
+
+    for (i = first; i <= last; i++) {
+        if (slotOf[order[i]] < 0) {
+            const int s = reserve(order[i]);
+
+            slots[s].pins++;
+            queue.push_back(s);
+        }
+    }
+
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&mutex);
+
+    acquired = NumRange(first, last);
+}
+
+
+/** \brief Unpins the images of the range acquired. */
+void rdf::ImagePool::release() {
+    int i;
+
+    if ((slotNum == 0) || (acquired.end < acquired.start)) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    for (i = acquired.start; i <= acquired.end; i++) {
+        pinned[order[i]].store(nullptr, std::memory_order_relaxed);
+        slots[slotOf[order[i]]].pins--;
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    acquired = NumRange(0, -1);
 }
 
 
-//CHECK
-rdf::TrainImage* rdf::ImagePool::getImgPtr(unsigned i) {
-    return &(images[i]);
+/** \brief Returns an image of a file that is not pinned, loading it in the
+ *  calling thread or waiting for the loader threads.
+ *  \param[in] file Index of the file.
+ */
+rdf::TrainImage* rdf::ImagePool::load(int file) {
+    TrainImage* img;
+    int s;
+
+    pthread_mutex_lock(&mutex);
+
+    s = slotOf[file];
+
+    if (s < 0) {
+        s = reserve(file);
+
+        pthread_mutex_unlock(&mutex);
+        loadImage(images[s], fileNames[file], imgStorage, file);
+        pthread_mutex_lock(&mutex);
+
+        ready(s);
+    }
+
+    while (slots[s].state != READY_SLOT) {
+        pthread_cond_wait(&loaded, &mutex);
+    }
+
+    slots[s].lastUse = ++clock;
+    img = &images[s];
+
+    pthread_mutex_unlock(&mutex);
+
+    return img;
+}
+
+
+/** \brief Takes the empty or least recently used slot that is not pinned
+ *  for a file. Called with the mutex locked.
+ *  \param[in] file Index of the file.
+ *  \return Index of the slot, in the loading state.
+ */
+int rdf::ImagePool::reserve(int file) {
+    int i;
+    int s = -1;
+
+    for (i = 0; i < slotNum; i++) {
+        if (slots[i].state == EMPTY_SLOT) {
+            s = i;
+            break;
+        }
+
+        if ((slots[i].state == READY_SLOT) && (slots[i].pins == 0) &&
+            ((s < 0) || (slots[i].lastUse < slots[s].lastUse))) {
+            s = i;
+        }
+    }
+
+    if (s < 0) {
+        printf("Every image of the cache of %d images is in use\n", slotNum);
+        exit(EXIT_FAILURE);
+    }
+
+    // Free the evicted image
+    if (slots[s].file >= 0) {
+        slotOf[slots[s].file] = -1;
+        images[s] = TrainImage();
+    }
+
+    slots[s].file = file;
+    slots[s].state = LOADING_SLOT;
+    slots[s].lastUse = ++clock;
+    slotOf[file] = s;
+
+    return s;
+}
+
+
+/** \brief Marks a slot as loaded and publishes its image if it is pinned.
+ *  Called with the mutex locked.
+ *  \param[in] s Index of the slot.
+ */
+void rdf::ImagePool::ready(int s) {
+    slots[s].state = READY_SLOT;
+
+    if (slots[s].pins > 0) {
+        pinned[slots[s].file].store(&images[s], std::memory_order_release);
+    }
+
+    pthread_cond_broadcast(&loaded);
+}
+
+
+/** \brief Main loop of the loader threads, which load the queued slots in
+ *  order.
+ */
+void* rdf::ImagePool::loaderThread(void* args) {
+    ImagePool& pool = *((ImagePool*) args);
+    int s;
+
+    pthread_mutex_lock(&pool.mutex);
+
+    while (true) {
+        while (!pool.stop && pool.queue.empty()) {
+            pthread_cond_wait(&pool.work, &pool.mutex);
+        }
+
+        if (pool.stop) {
+            break;
+        }
+
+        s = pool.queue.front();
+        pool.queue.pop_front();
+
+        const int file = pool.slots[s].file;
+
+        pthread_mutex_unlock(&pool.mutex);
+        loadImage(pool.images[s], pool.fileNames[file], pool.imgStorage, file);
+        pthread_mutex_lock(&pool.mutex);
+
+        pool.ready(s);
+    }
+
+    pthread_mutex_unlock(&pool.mutex);
+
+    return NULL;
 }
@@ -0,0 +1,297 @@
+/** \file LabelFilter.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file LabelFilter.h
+ */
+#include <algorithm>
+
+#include <rdf/Image.h>
+#include <rdf/LabelFilter.h>
+
+
+/** \brief Constructor.
+ *  \param[in] labelNum Number of labels of the planes.
+ *  \param[in] p Thread pool of the parallel loops.
+ */
+rdf::LabelFilter::LabelFilter(int labelNum, ThreadPool::Ptr p)
+    : labelNum(labelNum)
+    , pool(p)
+    , pixelCapacity(0)
+    , voteCapacity(0) {}
+
+
+/** \brief Smooths a label plane in place.
+ *
+ *  \param[in,out] labels Row-major plane of width * height labels.
+ *  \param[in] width Width of the plane.
+ *  \param[in] height Height of the plane.
+ *  \param[in] minSize Components of at most this many pixels are
+ *  repainted.
+ *  \param[in] iter Number of passes.
+ *  \return Number of pixels whose label changed.
+ */
+int rdf::LabelFilter::smooth(
+    Label* labels,
+    int width,
+    int height,
+    int minSize,
+    int iter
+) {
+    const size_t n = static_cast<size_t>(width) * height;
+    int changed = 0;
+    int i;
+
+    if (n == 0 || minSize <= 0) {
+        return 0;
+    }
+
+    if (n > pixelCapacity) {
+        parent.resize(n);
+        comp.resize(n);
+        slot.resize(n);
+        compSize.reset(new std::atomic<int>[n]);
+        pixelCapacity = n;
+    }
+
+    for (i = 0; i < iter; i++) {
+        const int c = pass(labels, width, height, minSize);
+
+        if (c == 0) {
+            break;
+        }
+        changed += c;
+    }
+
+    return changed;
+}
+
+
+/** \brief One pass of smooth().
+ *  \return Number of pixels whose label changed.
+ */
+int rdf::LabelFilter::pass(Label* labels, int width, int height, int minSize) {
+    const int bandNum = (height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+
+    std::vector<int> smallNum(bandNum + 1, 0);
+    std::vector<int> changed(bandNum, 0);
+    int b;
+    int y;
+
+    // Pixels [start, end) of a band of FRAME_TILE_SIZE rows
+    auto forBand = [&](int band, int& start, int& end) {
+        start = band * FRAME_TILE_SIZE * width;
+        end = std::min((band + 1) * FRAME_TILE_SIZE, height) * width;
+    };
+
+    // The components of the labels above labelNum are never repainted
+    auto isSmall = [&](int p) {
+        return (labels[p] != DEFAULT_LABEL) && (labels[p] <= labelNum) &&
+            (compSize[comp[p]].load(std::memory_order_relaxed) <= minSize);
+    };
+
+    // Components of each band. The paths of a band stay inside it, so
+    // the bands do not share any element of the forest.
+    pool->parallelFor(bandNum, [&](int band, int) {
+        const int startX = band * FRAME_TILE_SIZE;
+        const int endX = std::min(startX + FRAME_TILE_SIZE, height);
+
+        for (int x = startX; x < endX; x++) {
+            for (int y = 0; y < width; y++) {
+                const int p = x * width + y;
+
+                parent[p] = p;
+                compSize[p].store(0, std::memory_order_relaxed);
+
+                if (labels[p] == DEFAULT_LABEL) {
+                    continue;
+                }
+                if (y > 0 && labels[p - 1] == labels[p]) {
+                    join(p, p - 1);
+                }
+                if (x > startX && labels[p - width] == labels[p]) {
+                    join(p, p - width);
+                }
+            }
+        }
+    });
+
+    // Merge the components across the borders of the bands
+    for (b = 1; b < bandNum; b++) {
+        const int row = b * FRAME_TILE_SIZE * width;
+
+        for (y = 0; y < width; y++) {
+            const int p = row + y;
+
+            if (labels[p] != DEFAULT_LABEL && labels[p - width] == labels[p]) {
+                join(p, p - width);
+            }
+        }
+    }
+
+    // Root and size of the component of every pixel
+    pool->parallelFor(bandNum, [&](int band, int) {
+        int start;
+        int end;
+
+        forBand(band, start, end);
+        for (int p = start; p < end; p++) {
+            int r = p;
+
+            while (parent[r] != r) {
+                r = parent[r];
+            }
+            comp[p] = r;
+            compSize[r].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    // Number the small components in band order
+    pool->parallelFor(bandNum, [&](int band, int) {
+        int start;
+        int end;
+        int count = 0;
+
+        forBand(band, start, end);
+        for (int p = start; p < end; p++) {
+            count += (comp[p] == p) && isSmall(p);
+        }
+        smallNum[band + 1] = count;
+    });
+
+    for (b = 0; b < bandNum; b++) {
+        smallNum[b + 1] += smallNum[b];
+    }
+
+    const size_t voteNum = static_cast<size_t>(smallNum[bandNum]) * labelNum;
+
+    if (voteNum == 0) {
+        return 0;
+    }
+    if (voteNum > voteCapacity) {
+        votes.reset(new std::atomic<int>[voteNum]);
+        voteCapacity = voteNum;
+    }
+
+    pool->parallelFor(bandNum, [&](int band, int) {
+        int start;
+        int end;
+        int k = smallNum[band];
+
+        forBand(band, start, end);
+        for (int p = start; p < end; p++) {
+            if ((comp[p] == p) && isSmall(p)) {
+                slot[p] = k;
+                for (int l = 0; l < labelNum; l++) {
+                    votes[k * labelNum + l].store(0, std::memory_order_relaxed);
+                }
+                k++;
+            }
+        }
+    });
+
+    // Votes of the neighbors of each small component
+    pool->parallelFor(bandNum, [&](int band, int) {
+        static const int dx[] = {-1, 0, 1, 0};
+        static const int dy[] = {0, 1, 0, -1};
+        int start;
+        int end;
+
+        forBand(band, start, end);
+        for (int p = start; p < end; p++) {
+            if (!isSmall(p)) {
+                continue;
+            }
+
+            const int x = p / width;
+            const int y = p % width;
+            std::atomic<int>* v = &votes[slot[comp[p]] * labelNum];
+
+            for (int d = 0; d < 4; d++) {
+                const int nx = x + dx[d];
+                const int ny = y + dy[d];
+
+                if (nx < 0 || nx >= height || ny < 0 || ny >= width) {
+                    continue;
+                }
+
+                const Label l = labels[nx * width + ny];
+
+                if (l != DEFAULT_LABEL && l != labels[p] && l <= labelNum) {
+                    v[l - 1].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+    });
+
+    // Repaint the small components with their most voted label
+    pool->parallelFor(bandNum, [&](int band, int) {
+        int start;
+        int end;
+
+        forBand(band, start, end);
+        for (int p = start; p < end; p++) {
+            if (!isSmall(p)) {
+                continue;
+            }
+
+            const std::atomic<int>* v = &votes[slot[comp[p]] * labelNum];
+            int best = 0;
+            int bestLabel = 0;
+
+            for (int l = 0; l < labelNum; l++) {
+                const int c = v[l].load(std::memory_order_relaxed);
+
+                if (c > best) {
+                    best = c;
+                    bestLabel = l + 1;
+                }
+            }
+
+            if (bestLabel != 0) {
+                labels[p] = bestLabel;
+                changed[band]++;
+            }
+        }
+    });
+
+    int total = 0;
+
+    for (b = 0; b < bandNum; b++) {
+        total += changed[b];
+    }
+
+    return total;
+}
+
+
+/** \brief Returns the root of a pixel, compressing the path.
+ *  \param[in] p Pixel index.
+ */
+int rdf::LabelFilter::find(int p) {
+    int r = p;
+
+    while (parent[r] != r) {
+        r = parent[r];
+    }
+    while (parent[p] != r) {
+        const int next = parent[p];
+        parent[p] = r;
+        p = next;
+    }
+
+    return r;
+}
+
+
+/** \brief Joins the components of two pixels under the lowest root. */
+void rdf::LabelFilter::join(int p, int q) {
+    const int rp = find(p);
+    const int rq = find(q);
+
+    if (rp < rq) {
+        parent[rq] = rp;
+    }
+    else if (rq < rp) {
+        parent[rp] = rq;
+    }
+}
@@ -0,0 +1,23 @@
+/** \file LabelHistogram.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file LabelHistogram.h
+ */
+#include <rdf/LabelHistogram.h>
+
+
+/** \brief Computes the values of n * log2(n) of the table.
+ *
+ *  \return The table of NLOG2N_TABLE_SIZE values.
+ */
+static std::vector<float> buildNLog2nTable() {
+    std::vector<float> table(NLOG2N_TABLE_SIZE, 0.0f);
+
+    for (uint32_t n = 1; n < NLOG2N_TABLE_SIZE; n++) {
+        table[n] = static_cast<float>(n * log2(static_cast<double>(n)));
+    }
+
+    return table;
+}
+
+const std::vector<float> rdf::nLog2nTable = buildNLog2nTable();
@@ -0,0 +1,134 @@
+/** \file MPIUtils.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file MPIUtils.h
+ */
+#include <rdf/MPIUtils.h>
+
+
+namespace {
+
+/** \brief Builds a struct datatype from the addresses of the members of a
+ *  sample object, resized to the size of the object.
+ */
+MPI_Datatype structType(
+    const void* object,
+    size_t extent,
+    int count,
+    const void* const* members,
+    const MPI_Datatype* types
+) {
+    int i;
+    MPI_Aint base;
+    MPI_Aint displacements[8];
+    int lengths[8];
+    MPI_Datatype type;
+    MPI_Datatype resized;
+
+    MPI_Get_address(object, &base);
+
+    for (i = 0; i < count; i++) {
+        MPI_Get_address(members[i], &displacements[i]);
+        displacements[i] -= base;
+        lengths[i] = 1;
+    }
+
+    MPI_Type_create_struct(count, lengths, displacements, types, &type);
+    MPI_Type_create_resized(type, 0, extent, &resized);
+    MPI_Type_commit(&resized);
+    MPI_Type_free(&type);
+
+    return resized;
+}
+
+/** \brief Element wise maximum gain of two arrays of split candidates.
+ *
+ *  The buffers given by MPI hold only the transferred members, so they
+ *  are copied one by one and not through the assignment of the class.
+ */
+void maxGain(void* in, void* inout, int* len, MPI_Datatype*) {
+    int i;
+    const rdf::SplitCandidate* a = (const rdf::SplitCandidate*) in;
+    rdf::SplitCandidate* b = (rdf::SplitCandidate*) inout;
+
+    // The operation is applied in rank order, "in" comes from the lower
+    // ranks and keeps the candidate on equal gains.
+    for (i = 0; i < *len; i++) {
+        if (!(b[i].g > a[i].g)) {
+            b[i].u.x = a[i].u.x;
+            b[i].u.y = a[i].u.y;
+            b[i].v.x = a[i].v.x;
+            b[i].v.y = a[i].v.y;
+            b[i].t = a[i].t;
+            b[i].g = a[i].g;
+        }
+    }
+}
+
+} // namespace
+
+
+MPI_Datatype rdf::splitCandidateType() {
+    static const MPI_Datatype type = [] {
+        SplitCandidate sc;
+        const void* members[] = {&sc.u.x, &sc.u.y, &sc.v.x, &sc.v.y, 
+                                 &sc.t, &sc.g};
+        const MPI_Datatype types[] = {MPI_INT, MPI_INT, MPI_INT, MPI_INT, 
+                                      MPI_FLOAT, MPI_FLOAT};
+
+        return structType(&sc, sizeof(sc), 6, members, types);
+    }();
+
+    return type;
+}
+
+MPI_Datatype rdf::pixelInfoType() {
+    static const MPI_Datatype type = [] {
+        PixelInfo pi;
+        const void* members[] = {&pi.id, &pi.x, &pi.y};
+        const MPI_Datatype types[] = {MPI_UINT32_T, MPI_UINT32_T, 
+                                      MPI_UINT32_T};
+
+        return structType(&pi, sizeof(pi), 3, members, types);
+    }();
+
+    return type;
+}
+
+MPI_Datatype rdf::numRangeType() {
+    static const MPI_Datatype type = [] {
+        NumRange r;
+        const void* members[] = {&r.start, &r.end};
+        const MPI_Datatype types[] = {MPI_INT, MPI_INT};
+
+        return structType(&r, sizeof(r), 2, members, types);
+    }();
+
+    return type;
+}
+
+MPI_Op rdf::maxGainOp() {
+    static const MPI_Op op = [] {
+        MPI_Op o;
+        MPI_Op_create(maxGain, 0, &o);
+        return o;
+    }();
+
+    return op;
+}
+
+void rdf::broadcastTrainData(TrainData& td, int root, MPI_Comm comm) {
+    int rank;
+    int size;
+
+    MPI_Comm_rank(comm, &rank);
+
+    size = td.size();
+    MPI_Bcast(&size, 1, MPI_INT, root, comm);
+
+    if (rank != root) {
+        td.resize(size);
+    }
+
+    MPI_Bcast(td.data(), size, pixelInfoType(), root, comm);
+}
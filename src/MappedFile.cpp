@@ -0,0 +1,59 @@
+/** \file MappedFile.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file MappedFile.h
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <rdf/MappedFile.h>
+
+
+/** \brief Maps the whole file in memory.
+ *  \param[in] fileName Path to the file.
+ */
+rdf::MappedFile::MappedFile(const std::string& fileName)
+    : data_(nullptr)
+    , size_(0) {
+    int fd;
+    struct stat st;
+    void* addr;
+
+    if ((fd = open(fileName.c_str(), O_RDONLY)) < 0) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    if (fstat(fd, &st) < 0) {
+        printf("Cannot stat file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+
+    if (size_ > 0) {
+        addr = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (addr == MAP_FAILED) {
+            printf("Cannot map file %s.\n", fileName.c_str());
+            exit(1);
+        }
+        data_ = static_cast<const char*>(addr);
+    }
+
+    // The mapping stays valid after closing the descriptor.
+    close(fd);
+}
+
+
+/** \brief Unmaps the file. **/
+rdf::MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
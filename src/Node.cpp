@@ -1 +1,45 @@
 #include <rdf/Node.h>
+
+
+/** \brief Creates a leaf node with a zero distribution.
+ *
+ *  \param[in] labelNum Number of labels of the distribution.
+ *  \return The new leaf node.
+ */
+rdf::LeafNode* rdf::NodeArena::leaf(size_t labelNum) {
+    // The distributions of a block must not reallocate it either
+    if (slab.empty() || 
+        (slab.back().size() + labelNum > slab.back().capacity())) {
+        slab.emplace_back();
+        slab.back().reserve(std::max<size_t>(NODE_ARENA_BLOCK * labelNum, 
+                                             labelNum));
+    }
+
+    std::vector<float>& block = slab.back();
+    block.resize(block.size() + labelNum, 0.0f);
+
+    return create(leaves, LeafDistribution(block.data() + block.size() - 
+                                           labelNum, labelNum));
+}
+
+
+/** \brief Creates a leaf node with a copy of a distribution.
+ *
+ *  \param[in] prob The distribution of the leaf.
+ *  \return The new leaf node.
+ */
+rdf::LeafNode* rdf::NodeArena::leaf(const std::vector<float>& prob) {
+    LeafNode* node = leaf(prob.size());
+    node->pDist.assign(prob);
+
+    return node;
+}
+
+
+/** \brief Destroys every node of the arena. **/
+void rdf::NodeArena::clear() {
+    splits.clear();
+    leaves.clear();
+    slab.clear();
+    nodeNum = 0;
+}
@@ -1,4 +1,5 @@
 #include <rdf/Offset.h>
+#include <rdf/common.h>
 
 /** \brief Divides both offsets by the given float.
  *  \param[in] f The float to divide both offsets.
@@ -33,6 +34,6 @@ rdf::Offset rdf::Offset::operator/(const unsigned& u) const {
  *  \param[in] max Maximum integer of the range.
  */
 void rdf::Offset::setRandomlyInRange(const int min, const int max) {
-    x = min + (rand() % (max - min + 1));
-    y = min + (rand() % (max - min + 1));
+    x = min + static_cast<int>(threadRng().below(max - min + 1));
+    y = min + static_cast<int>(threadRng().below(max - min + 1));
 }
@@ -0,0 +1,290 @@
+/** \file QuantizedForest.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file QuantizedForest.h
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <numeric>
+
+#include <rdf/QuantizedForest.h>
+
+namespace {
+
+/** \brief Rounds a threshold up to the integer compared with the
+ *  differences of depths.
+ *
+ *  A difference d compares as float(d) < t, and float(d) is exact for the
+ *  differences below 2^24. For them float(d) < t is d < ceil(t). The
+ *  thresholds above 65535 do not fit in the split, build() rejects them.
+ *
+ *  \param[in] t Threshold of the split, at most 65535.
+ *  \return The integer threshold.
+ */
+uint16_t quantizeThreshold(const float t) {
+    if (!(t > 0.0f)) {
+        return 0;
+    }
+
+    return static_cast<uint16_t>(std::ceil(t));
+}
+
+/** \brief Rounds a probability to the fixed point scale. */
+uint8_t quantizeProb(const float p) {
+    const long q = std::lround(p * QUANT_PROB_ONE);
+
+    return static_cast<uint8_t>(std::min<long>(std::max<long>(q, 0), QUANT_PROB_ONE));
+}
+
+/** \brief Divides an offset by 2^shift rounding to the nearest. */
+int16_t quantizeOffset(const int32_t off, const int shift) {
+    const long q = std::lround(std::ldexp(double(off), -shift));
+
+    return static_cast<int16_t>(std::min<long>(std::max<long>(q, -32767), 32767));
+}
+
+} // namespace
+
+
+/** \brief Quantizes a flattened forest.
+ *
+ *  The records keep the order and the child indices of the flattened
+ *  forest. The shift is the smallest one that brings the largest offset
+ *  component into 16 bits.
+ *
+ *  \param[in] flat Flattened forest.
+ *  \param[in] k Number of labels kept per leaf, 0 or at least the number
+ *  of labels to keep every label.
+ */
+void rdf::QuantizedForest::build(const FlatForest& flat, const int k) {
+    const int width = flat.labels();
+    uint32_t i;
+    int j;
+
+    if (width > QUANT_FOREST_MAX_LABELS) {
+        printf("A quantized forest has at most %d labels, the forest has %d.\n",
+               QUANT_FOREST_MAX_LABELS, width);
+        exit(1);
+    }
+
+    labelNum = width;
+    topK = (k > 0 && k < labelNum) ? k : 0;
+    splits.clear();
+    leafProbs.clear();
+    mapping.reset();
+
+    shift = 0;
+    while ((flat.maxOffset() >> shift) > 32767) {
+        shift++;
+    }
+
+    roots.assign(flat.rootData(), flat.rootData() + flat.treeNum());
+
+    splits.resize(flat.splitCount());
+    for (i = 0; i < flat.splitCount(); i++) {
+        const FlatSplit& s = flat.splitData()[i];
+        QuantSplit& q = splits[i];
+
+        if (s.t > std::numeric_limits<uint16_t>::max()) {
+            printf("A quantized forest has thresholds up to %d, split %u has %f.\n",
+                   int(std::numeric_limits<uint16_t>::max()), i, s.t);
+            exit(1);
+        }
+
+        q.ux = quantizeOffset(s.ux, shift);
+        q.uy = quantizeOffset(s.uy, shift);
+        q.vx = quantizeOffset(s.vx, shift);
+        q.vy = quantizeOffset(s.vy, shift);
+        q.t = quantizeThreshold(s.t);
+        q.pad = 0;
+        q.left = s.left;
+        q.right = s.right;
+    }
+
+    leafProbs.resize(size_t(flat.leafCount()) * leafBytes(), 0);
+
+    std::vector<int> order(labelNum);
+
+    for (i = 0; i < flat.leafCount(); i++) {
+        const float* pDist = flat.leafData() + size_t(i) * labelNum;
+        uint8_t* row = &leafProbs[size_t(i) * leafBytes()];
+
+        if (topK == 0) {
+            for (j = 0; j < labelNum; j++) {
+                row[j] = quantizeProb(pDist[j]);
+            }
+            continue;
+        }
+
+        // Most probable labels first, the lowest label on ties
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+            [&](int a, int b) { return pDist[a] > pDist[b]; });
+
+        for (j = 0; j < topK; j++) {
+            row[2 * j] = static_cast<uint8_t>(order[j]);
+            row[2 * j + 1] = quantizeProb(pDist[order[j]]);
+        }
+    }
+
+    bindViews();
+
+    printf("Quantized forest: %d trees, %u splits, %u leaves, %zu bytes "
+           "(%zu flattened), offset shift %d\n", treeNum(), splitNum, leafNum,
+           bytes(), flat.treeNum() * sizeof(int32_t) +
+           flat.splitCount() * sizeof(FlatSplit) +
+           size_t(flat.leafCount()) * labelNum * sizeof(float), shift);
+}
+
+
+/** \brief Writes the forest in the binary format.
+ *
+ *  \param[in] fileName Path to the output file.
+ */
+void rdf::QuantizedForest::write(const std::string& fileName) const {
+    FILE* fp;
+    QuantForestHeader header;
+
+    if ((fp = fopen(fileName.c_str(), "wb")) == NULL) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header.magic = QUANT_FOREST_MAGIC;
+    header.version = QUANT_FOREST_VERSION;
+    header.labelNum = labelNum;
+    header.treeNum = rootNum;
+    header.splitNum = splitNum;
+    header.leafNum = leafNum;
+    header.topK = topK;
+    header.offsetShift = shift;
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(rootView, sizeof(int32_t), rootNum, fp);
+    fwrite(splitView, sizeof(QuantSplit), splitNum, fp);
+    fwrite(leafView, 1, size_t(leafNum) * leafBytes(), fp);
+
+    if (fclose(fp) != 0) {
+        printf("Cannot write file %s.\n", fileName.c_str());
+        exit(1);
+    }
+}
+
+
+/** \brief Maps a forest in the binary format.
+ *
+ *  The labels of the top-k entries are checked, since classify adds the
+ *  probabilities at those labels.
+ *
+ *  \param[in] fileName Path to the binary quantized forest.
+ */
+void rdf::QuantizedForest::map(const std::string& fileName) {
+    const QuantForestHeader* header;
+    size_t expected;
+    size_t i;
+
+    MappedFile::Ptr file(new MappedFile(fileName));
+
+    if (file->size() < sizeof(QuantForestHeader)) {
+        printf("File %s is not a quantized forest.\n", fileName.c_str());
+        exit(1);
+    }
+
+    header = reinterpret_cast<const QuantForestHeader*>(file->data());
+
+    if ((header->magic != QUANT_FOREST_MAGIC) ||
+        (header->version != QUANT_FOREST_VERSION) ||
+        (header->labelNum == 0) ||
+        (header->labelNum > QUANT_FOREST_MAX_LABELS) ||
+        (header->topK >= header->labelNum) ||
+        (header->offsetShift > 16)) {
+        printf("File %s is not a quantized forest.\n", fileName.c_str());
+        exit(1);
+    }
+
+    const size_t width = (header->topK > 0) ? 2 * header->topK
+                                            : header->labelNum;
+
+    expected = sizeof(QuantForestHeader) +
+               size_t(header->treeNum) * sizeof(int32_t) +
+               size_t(header->splitNum) * sizeof(QuantSplit) +
+               size_t(header->leafNum) * width;
+
+    if (file->size() < expected) {
+        printf("Quantized forest %s is truncated.\n", fileName.c_str());
+        exit(1);
+    }
+
+    const uint8_t* leaves = reinterpret_cast<const uint8_t*>(
+        file->data() + expected - size_t(header->leafNum) * width);
+
+    for (i = 0; header->topK > 0 && i < size_t(header->leafNum) * width; i += 2) {
+        if (leaves[i] >= header->labelNum) {
+            printf("Quantized forest %s has an invalid leaf.\n", fileName.c_str());
+            exit(1);
+        }
+    }
+
+    splits.clear();
+    leafProbs.clear();
+    roots.clear();
+    mapping = file;
+    labelNum = header->labelNum;
+    topK = header->topK;
+    shift = header->offsetShift;
+
+    bindViews();
+}
+
+
+/** \brief Drops the forest. */
+void rdf::QuantizedForest::clear() {
+    splits.clear();
+    leafProbs.clear();
+    roots.clear();
+    mapping.reset();
+    labelNum = 0;
+    topK = 0;
+    shift = 0;
+
+    bindViews();
+}
+
+
+/** \brief Points the views to the vectors or to the mapping. */
+void rdf::QuantizedForest::bindViews() {
+    const QuantForestHeader* header;
+
+    if (mapping == nullptr) {
+        rootView = roots.data();
+        splitView = splits.data();
+        leafView = leafProbs.data();
+        rootNum = static_cast<uint32_t>(roots.size());
+        splitNum = static_cast<uint32_t>(splits.size());
+        leafNum = (leafBytes() > 0)
+            ? static_cast<uint32_t>(leafProbs.size() / leafBytes()) : 0;
+    }
+    else {
+        header = reinterpret_cast<const QuantForestHeader*>(mapping->data());
+        rootNum = header->treeNum;
+        splitNum = header->splitNum;
+        leafNum = header->leafNum;
+
+        rootView = reinterpret_cast<const int32_t*>(
+            mapping->data() + sizeof(QuantForestHeader));
+        splitView = reinterpret_cast<const QuantSplit*>(rootView + rootNum);
+        leafView = reinterpret_cast<const uint8_t*>(splitView + splitNum);
+    }
+
+    offsetBound = 0;
+    for (uint32_t i = 0; i < splitNum; i++) {
+        const QuantSplit& s = splitView[i];
+
+        offsetBound = std::max<int32_t>(offsetBound, std::max(
+            std::max(std::abs(s.ux), std::abs(s.uy)),
+            std::max(std::abs(s.vx), std::abs(s.vy))) * (1 << shift));
+    }
+}
@@ -1,12 +1,8 @@
-#include <rdf/RandomForest.h>
+#include <unistd.h>
+#include <unordered_map>
 
-/** \brief Thread function that test a number of split candidates and return the
- * best.
- */
-void* rdf::findSplitThread(void* args) {
-    RandomForest& f = *(((SCParams*) args) -> forest);
-    return new SplitCandidate(f.bestSplitCandidate(*((SCParams*)args)));
-}
+#include <rdf/MPIUtils.h>
+#include <rdf/RandomForest.h>
 
 
 /** \brief Calculates the feature function given the offsets and the
@@ -23,25 +19,18 @@ float rdf::RandomForest::calcFeature(
     const Offset& u,
     const Offset& v, 
     const PixelInfo& pi,
-    Image *img
+    const Image *img
 ) {
-    uint32_t dx = img->getDepth(pi.x, pi.y);
-
-    // Normalize offsets by the depth at pixel
-    PixelInfo xUoff = pi + (u / dx);
-    PixelInfo xVoff = pi + (v / dx);
-    
-    const uint32_t uDepth = img->getDepth(xUoff.x, xUoff.y);
-    const uint32_t vDepth = img->getDepth(xVoff.x, xVoff.y);
-
-    return uDepth - vDepth;
+    return featureResponse(u.x, u.y, v.x, v.y, pi, img);
 }
 
 /** 
  * sortData
  *
  * Sorts the training data array and returns the index
- * which splits the  array into left and right sets.
+ * which splits the  array into left and right sets. The sides are
+ * decided in one pass of the feature kernel and the pixels are moved
+ * through an index array, keeping their order in both sets.
  *
  * @param range of the train set.
  * @param f feature that corresponds to the best split of the
@@ -51,42 +40,130 @@ float rdf::RandomForest::calcFeature(
  * is placed in the first element of the right set.
  */
 int rdf::RandomForest::sortData(NumRange range, SplitCandidate f) {
-    int i;
-    unsigned pivot;
-    bool findRight;
-    pixelSet ps;
-    PixelInfo temp;
-    TrainImage* imgPtr;
-    
-    findRight = false;
+    std::vector<uint8_t> mask((range.end - range.start + 8) / 8 + 1, 0);
 
-    for (i = range.start; i <= range.end; i++){
- 
-        // Get the image pointer from imagePool with id of pixel.
-        imgPtr = image_pool->getImgPtr((*td)[i].id);
-        ps = classifyPixel(f, (*td)[i], (Image*)imgPtr);
-        
-        if ((findRight == false) && (ps == RIGHT)) {
-            findRight = true;
-            pivot = i;
-        } 
-        else if ((findRight == true) && (ps == LEFT)) {
-            temp = (*td)[pivot];
-            (*td)[pivot] = (*td)[i];
-            (*td)[i] = temp;
-            pivot++;
+    splitMask(range, f, 0, mask);
+
+    return td->partition(range, mask);
+}
+
+/** \brief Sets the bits of the pixels of a range sent to the left set.
+ *
+ *  \param[in] range The range of the training data.
+ *  \param[in] f The split candidate.
+ *  \param[in] maskStart Bit of the mask of the first pixel.
+ *  \param[in,out] mask Bitmask of the left set.
+ */
+void rdf::RandomForest::splitMask(
+    NumRange range,
+    const SplitCandidate& f,
+    int maskStart,
+    std::vector<uint8_t>& mask
+) {
+    FeatureBlock block;
+    std::vector<float> responses;
+
+    if (range.end < range.start) {
+        return;
+    }
+
+    pixelBlock(range, block);
+    featureResponses(f.u, f.v, range, block, responses);
+
+    for (size_t k = 0; k < responses.size(); k++) {
+        if (responses[k] < f.t) {
+            const int b = maskStart + k;
+            mask[b >> 3] |= uint8_t(1u << (b & 7));
+        }
+    }
+}
+
+/** \brief Sorts the train data of several nodes given their best split.
+ *  The wall time, including the exchange of the shared mask, is added to
+ *  the sort time of the training statistics.
+ *
+ *  \param[in] ranges Ranges of the train data of the nodes.
+ *  \param[in] splits Best split of each node.
+ *  \param[out] pivots First index of the right set of each node.
+ *  \param[in] shared Whether the processes hold the same train data.
+ */
+void rdf::RandomForest::partitionNodes(
+    const std::vector<NumRange>& ranges,
+    const std::vector<SplitCandidate>& splits,
+    std::vector<int>& pivots,
+    bool shared
+) {
+    const int count = ranges.size();
+    const int taskSize = PARTITION_TASK_SIZE;
+    const double startTime = takeInitialTime();
+
+    int rank = 0;
+    int mpiSize = 1;
+
+    // Position of the first pixel of each node in the mask
+    std::vector<int> first(count + 1, 0);
+    for (int n = 0; n < count; n++) {
+        first[n + 1] = first[n] + std::max(0, ranges[n].end - ranges[n].start + 1);
+    }
+
+    const int total = first[count];
+
+    if (shared && total >= SHARED_MASK_MIN_PIXELS) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &mpiSize);
+    }
+
+    // Bits of each process, in whole bytes so the slices do not overlap
+    const int slice = ((total + mpiSize - 1) / mpiSize + 7) / 8 * 8;
+    const int begin = std::min(total, rank * slice);
+    const int end = std::min(total, begin + slice);
+
+    std::vector<uint8_t> mask(slice / 8 * mpiSize + 1, 0);
+
+    // The tasks also start at whole bytes of the mask
+    pool->parallelFor((end - begin + taskSize - 1) / taskSize, [&](int t, int) {
+        const int taskBegin = begin + t * taskSize;
+        const int taskEnd = std::min(end, taskBegin + taskSize);
+
+        int n = std::upper_bound(first.begin(), first.end(), taskBegin) 
+            - first.begin() - 1;
+
+        for (int pos = taskBegin; pos < taskEnd; n++) {
+            const int segEnd = std::min(taskEnd, first[n + 1]);
+
+            if (segEnd > pos) {
+                splitMask(NumRange(ranges[n].start + pos - first[n],
+                                   ranges[n].start + segEnd - first[n] - 1),
+                          splits[n], pos, mask);
+                pos = segEnd;
+            }
         }
+    });
+
+    if (mpiSize > 1) {
+        MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, mask.data(), 
+                      slice / 8, MPI_BYTE, comm);
+    }
+
+    pivots.resize(count);
+
+    if (count == 1) {
+        pivots[0] = td->partition(ranges[0], mask, 0, pool.get());
+    } else {
+        pool->parallelFor(count, [&](int n, int) {
+            pivots[n] = td->partition(ranges[n], mask, first[n]);
+        });
     }
 
-    return pivot;
+    stats.addSort(takeInitialTime() - startTime);
 }
 
 /**
  *  bestSplitThreadFun
  *
- *  This function runs the bestSplitCandidate in diferent
- *  threads. It divides the work between them by the macro
- *  THREADS_PER_NODE.
+ *  This function runs the bestSplitCandidate in the thread pool. The
+ *  offset pairs are divided in tasks of OFFSETS_PER_TASK pairs, so the
+ *  workers that finish early steal the remaining tasks.
  *
  *  @param structure with the parameter to generate a split
  *  candidate.
@@ -94,38 +171,71 @@ int rdf::RandomForest::sortData(NumRange range, SplitCandidate f) {
  *  @return The best split candidate generated
  */
 rdf::SplitCandidate rdf::RandomForest::bestSplitThreadFun(NumRange range) {
+    return bestSplits(std::vector<NumRange>(1, range)).front();
+}
 
-    int i;
-    int errCode;
-    pthread_t threads[THREADS_PER_NODE];
-    SplitCandidate bestSplit;
-    SplitCandidate* sc;
-    SCParams params;
-
-    params.forest = this;
-    params.trainDataRange = range;
-
-    for (i = 0; i < THREADS_PER_NODE; i++) {
-
-        if ((errCode = pthread_create(&threads[i],
-                        NULL,                    
-                        findSplitThread,
-                        &params))) {
-            printf("We must pay for our arrogance\n");
+/**
+ *  bestSplits
+ *
+ *  The tasks of all the ranges are queued as one job of the thread
+ *  pool, so the nodes of a level with few pixels do not leave workers
+ *  idle while the larger ones are processed. The time of every task is
+ *  added to the search time of its node in the current round.
+ *
+ *  @param ranges of the train data, one per node.
+ *
+ *  @return The best split candidate of each range.
+ */
+std::vector<rdf::SplitCandidate> rdf::RandomForest::bestSplits(
+    const std::vector<NumRange>& ranges
+) {
+    unsigned i;
+    unsigned j;
+    int rank;
+    const unsigned offsetNum = tp -> offsetNum;
+    const unsigned taskNum = (offsetNum + OFFSETS_PER_TASK - 1) / OFFSETS_PER_TASK;
+    const uint64_t roundSeed = streamSeed(streamSeed(treeSeed, SPLIT_STREAM), 
+                                          splitRound++);
+    const double startTime = takeInitialTime();
+    std::vector<SplitCandidate> bestSplit(ranges.size());
+    std::vector<SplitCandidate> candidates(ranges.size() * taskNum);
+    std::vector<double> taskTime(candidates.size());
+    uint64_t pixels = 0;
+
+    MPI_Comm_rank(comm, &rank);
+
+    pool->parallelFor(candidates.size(), [&](int k, int) {
+        SCParams params;
+        const unsigned task = k % taskNum;
+        const double taskStart = takeInitialTime();
+
+        // The candidates of a task do not depend on the thread running it
+        seedThreadRng(streamSeed(streamSeed(streamSeed(roundSeed, k / taskNum), 
+                                            rank), task));
+
+        params.forest = this;
+        params.trainDataRange = ranges[k / taskNum];
+        params.offsetNum = std::min<unsigned>(OFFSETS_PER_TASK, 
+            offsetNum - task * OFFSETS_PER_TASK);
+
+        candidates[k] = bestSplitCandidate(params);
+        taskTime[k] = takeInitialTime() - taskStart;
+    });
+
+    // Keep the first best candidate, whatever worker generated it.
+    for (i = 0; i < ranges.size(); i++) {
+        for (j = 0; j < taskNum; j++) {
+            if (candidates[i * taskNum + j].g > bestSplit[i].g) {
+                bestSplit[i] = candidates[i * taskNum + j];
+            }
+            stats.nodeSearch(i, taskTime[i * taskNum + j]);
         }
+        pixels += std::max(0, ranges[i].end - ranges[i].start + 1);
     }
 
-    bestSplit = SplitCandidate();
-
-    for (i = 0; i < THREADS_PER_NODE; i++) {
-        if ((errCode = pthread_join(threads[i], (void **) &sc))) { 
-            printf("We must pay for our arrogance\n");
-        }
-
-        if (sc -> g > bestSplit.g) {
-            bestSplit = *sc;
-        }
-    }
+    stats.addSearch(takeInitialTime() - startTime, 
+                    uint64_t(ranges.size()) * offsetNum * tp->thresholdNum,
+                    pixels * offsetNum * tp->thresholdNum);
 
     return bestSplit;
 }
@@ -145,8 +255,8 @@ rdf::SplitCandidate rdf::RandomForest::bestSplitThreadFun(NumRange range) {
  */
 rdf::SplitCandidate rdf::RandomForest::bestSplitCandidate(SCParams& params) {
 
-    unsigned offsetNum = tp -> offsetNum / THREADS_PER_NODE;
-    unsigned thresholdNum = tp -> thresholdNum / THREADS_PER_NODE;
+    unsigned offsetNum = params.offsetNum;
+    unsigned thresholdNum = tp -> thresholdNum;
     NumRange trainDataRange = params.trainDataRange;
 
     unsigned i;
@@ -162,11 +272,15 @@ rdf::SplitCandidate rdf::RandomForest::bestSplitCandidate(SCParams& params) {
     SplitCandidate phi;
     SplitCandidate bestPhi;
 
+    if (tp->splitMode == HISTOGRAM_SPLIT) {
+        return bestSplitHistogram(params);
+    }
+
     // Initialize information gain
     bestGain = 0.0f;
 
     // Get the entropy of the entire set
-    setEntropy = H(labelDistribution(trainDataRange.start, trainDataRange.end));
+    setEntropy = H(labelCounts(trainDataRange.start, trainDataRange.end));
 
     // Start generating and testing the features.
     for (i = 0; i < offsetNum; i++) {
@@ -214,66 +328,283 @@ float rdf::RandomForest::G(
     const float set_entropy, 
     NumRange range
 ) {
-    float l_size = 0.0f;
-    float r_size = 0.0f;
-
-    // vectors with the distribution of labels of each set after split.
-    std::vector<float> l_set(tp->labelNum, 0.0f);
-    std::vector<float> r_set(tp->labelNum, 0.0f);
+    // Label counts of each set after split.
+    LabelHistogram<> l_set;
+    LabelHistogram<> r_set;
 
     // Classify each pixel with the split candiate
     for (int i = range.start; i <= range.end; i++) {
        
-        const auto& imgPtr = image_pool->getImgPtr((*td)[i].id);
-
         // Get pixel real label.
-        const auto& label = imgPtr->getLabel((*td)[i].x, (*td)[i].y);
+        const auto label = td->label(i);
         
-        switch (classifyPixel(phi, (*td)[i], (Image*)imgPtr)) {
+        switch (classifyTrainPixel(phi, i)) {
         
             // Put the classified pixel in the left subset.
             case LEFT:
-                l_set[label - 1] += 1.0f;
-                l_size += 1.0f;
+                l_set.add(label);
                 break;
 
             // Put the classified pixel in the right subset.
             case RIGHT:
-                r_set[label - 1] += 1.0f;
-                r_size += 1.0f;
+                r_set.add(label);
                 break;
         }
     }
 
-    // Normalize distribution vectors
-    for (int i = 0; i < tp->labelNum; i++) {
-        r_set[i] /= r_size;
-        l_set[i] /= l_size;
+    return splitGain(l_set, r_set, set_entropy);
+}
+
+
+/** \brief Computes the feature response of every pixel in the range for the
+ *  given pair of offsets.
+ *
+ *  \param[in] u First pixel offset.
+ *  \param[in] v Second pixel offset.
+ *  \param[in] range The range of the training data.
+ *  \param[in] block The pixels of the range, empty for the scalar path.
+ *  \param[out] responses Feature response of each pixel of the range.
+ */
+void rdf::RandomForest::featureResponses(
+    const Offset& u,
+    const Offset& v,
+    NumRange range,
+    const FeatureBlock& block,
+    std::vector<float>& responses
+) {
+    responses.resize(range.end - range.start + 1);
+
+    if (!block.x.empty()) {
+        rdf::featureResponses(u.x, u.y, v.x, v.y, block, planes.data(), 
+                              responses.data());
+        return;
+    }
+
+    for (int i = range.start; i <= range.end; i++) {
+        const auto& imgPtr = image_pool->getImgPtr((*td)[i].id);
+        responses[i - range.start] = featureResponse(
+            u.x, u.y, v.x, v.y, (*td)[i], td->depth(i), imgPtr);
     }
-    
-    return set_entropy - 
-        l_size / (l_size + r_size) * H(l_set) - 
-        r_size / (l_size + r_size) * H(r_set);
 }
 
 
-/** \brief Shannon Entropy function
+/** \brief Fills the structure of arrays of the pixels of a range, only
+ *  when the feature kernel can gather their depths from dense planes.
  *
- *  \param[in] probabilities is a vector that contains the percentage of
- *  each label occurrence in a set.
+ *  \param[in] range The range of the training data.
+ *  \param[out] block The pixels of the range.
+ */
+void rdf::RandomForest::pixelBlock(NumRange range, FeatureBlock& block) {
+    if (planes.empty()) {
+        block.resize(0);
+        return;
+    }
+
+    block.resize(range.end - range.start + 1);
+
+    for (int i = range.start; i <= range.end; i++) {
+        const PixelInfo& pi = (*td)[i];
+        const int k = i - range.start;
+
+        block.x[k] = pi.x;
+        block.y[k] = pi.y;
+        block.img[k] = pi.id;
+        block.depth[k] = td->depth(i);
+    }
+}
+
+/** \brief Counts the left label counts of every candidate in the local
+ *  shard of the training data. The responses of each offset pair are
+ *  binned by the sorted thresholds as in bestSplitHistogram, and the
+ *  offset pairs are divided among the workers of the thread pool.
  *
- *  \return the entroply associated with this percentages.
+ *  \param[in] range Range of the local training data of the node.
+ *  \param[in] pairs Offset pairs of the candidates.
+ *  \param[in] thresholds Thresholds of each offset pair.
+ *  \param[out] counts Left label counts of each candidate.
  */
-float rdf::RandomForest::H(const std::vector<float>& probabilities) {
-    float entropy = 0.0f;
+void rdf::RandomForest::shardHistograms(
+    NumRange range,
+    const std::vector<SplitCandidate>& pairs,
+    const std::vector<float>& thresholds,
+    std::vector<LabelHistogram<> >& counts
+) {
+    const int pixelNum = range.end - range.start + 1;
+    const unsigned thresholdNum = tp->thresholdNum;
+
+    const double startTime = takeInitialTime();
 
-    for (int i = 0; i < probabilities.size(); i++) {
-        if (probabilities[i] != 0.0f) {
-            entropy += probabilities[i] * log2(probabilities[i]);   
+    std::vector<Label> labels(pixelNum);
+    std::vector<double> pairTime(pairs.size());
+    FeatureBlock block;
+
+    counts.assign(pairs.size() * thresholdNum, LabelHistogram<>());
+    pixelBlock(range, block);
+
+    for (int k = 0; k < pixelNum; k++) {
+        labels[k] = td->label(range.start + k) - 1;
+    }
+
+    pool->parallelFor(pairs.size(), [&](int p, int) {
+        unsigned j;
+        int k;
+        const double pairStart = takeInitialTime();
+        const float* pairThresholds = &thresholds[p * thresholdNum];
+        LabelHistogram<>* pairCounts = &counts[p * thresholdNum];
+
+        std::vector<float> responses;
+        std::vector<unsigned> order(thresholdNum);
+        std::vector<float> sorted(thresholdNum);
+        std::vector<LabelHistogram<> > bins(thresholdNum + 1);
+        LabelHistogram<> prefix;
+
+        for (j = 0; j < thresholdNum; j++) {
+            order[j] = j;
+        }
+
+        std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+            return pairThresholds[a] < pairThresholds[b];
+        });
+
+        for (j = 0; j < thresholdNum; j++) {
+            sorted[j] = pairThresholds[order[j]];
+        }
+
+        featureResponses(pairs[p].u, pairs[p].v, range, block, responses);
+
+        for (k = 0; k < pixelNum; k++) {
+            const auto bin = 
+                std::upper_bound(sorted.begin(), sorted.end(), responses[k]) - 
+                sorted.begin();
+            bins[bin][labels[k]]++;
+        }
+
+        for (j = 0; j < thresholdNum; j++) {
+            prefix += bins[j];
+            pairCounts[order[j]] = prefix;
         }
+
+        pairTime[p] = takeInitialTime() - pairStart;
+    });
+
+    for (size_t p = 0; p < pairs.size(); p++) {
+        stats.nodeSearch(0, pairTime[p]);
+    }
+
+    stats.addSearch(takeInitialTime() - startTime, counts.size(), 
+                    uint64_t(counts.size()) * pixelNum);
+}
+
+
+/** \brief Histogram based version of bestSplitCandidate.
+ *
+ *  For every offset pair the feature response of each pixel is computed once
+ *  and binned by the sorted thresholds: a pixel with response r goes to the
+ *  left set of every threshold t > r, so the bin of the pixel is the number
+ *  of thresholds <= r. The left label counts of the k-th sorted threshold
+ *  are then the prefix sum of bins [0, k], and the right counts are the
+ *  rest. The candidates and the selection order are the same as the
+ *  exhaustive version.
+ *
+ *  \param[in] params The information to generate a split candidate.
+ *  \return The best split candidate generated.
+ */
+rdf::SplitCandidate rdf::RandomForest::bestSplitHistogram(SCParams& params) {
+
+    unsigned offsetNum = params.offsetNum;
+    unsigned thresholdNum = tp -> thresholdNum;
+    NumRange trainDataRange = params.trainDataRange;
+    const int pixelNum = trainDataRange.end - trainDataRange.start + 1;
+
+    unsigned i;
+    unsigned j;
+    int k;
+
+    Offset u;
+    Offset v;
+
+    float setEntropy;
+    float bestGain;
+    SplitCandidate bestPhi;
+
+    std::vector<Label> labels(pixelNum);
+    std::vector<float> responses;
+    FeatureBlock block;
+    std::vector<float> thresholds(thresholdNum);
+    std::vector<unsigned> order(thresholdNum);
+    std::vector<float> sorted(thresholdNum);
+    std::vector<float> gains(thresholdNum);
+
+    // Label counts per bin, bins are [-inf, t_0), [t_0, t_1) ... [t_n, inf)
+    std::vector<LabelHistogram<> > bins(thresholdNum + 1);
+    LabelHistogram<> total;
+    LabelHistogram<> prefix;
+
+    // Initialize information gain
+    bestGain = 0.0f;
+
+    // Get the entropy of the entire set
+    // The labels and the pixel depths do not depend on the split candidate
+    pixelBlock(trainDataRange, block);
+
+    for (k = 0; k < pixelNum; k++) {
+        labels[k] = td->label(trainDataRange.start + k) - 1;
+        total[labels[k]]++;
     }
 
-    return fabs(entropy);
+    setEntropy = H(total);
+
+    // Start generating and testing the features.
+    for (i = 0; i < offsetNum; i++) {
+
+        // Generate a pair of random offsets
+        u.setRandomlyInRange(tp->offsetRange.start, tp->offsetRange.end);
+        v.setRandomlyInRange(tp->offsetRange.start, tp->offsetRange.end);
+
+        // Generate the random thresholds and sort them
+        for (j = 0; j < thresholdNum; j++) {
+            thresholds[j] = randFloat(tp->thresholdRange);
+            order[j] = j;
+        }
+
+        std::sort(order.begin(), order.end(), 
+            [&thresholds](unsigned a, unsigned b) {
+                return thresholds[a] < thresholds[b];
+            });
+
+        for (j = 0; j < thresholdNum; j++) {
+            sorted[j] = thresholds[order[j]];
+        }
+
+        // Bin the responses of every pixel
+        featureResponses(u, v, trainDataRange, block, responses);
+
+        for (j = 0; j <= thresholdNum; j++) {
+            bins[j].clear();
+        }
+        for (k = 0; k < pixelNum; k++) {
+            const auto bin = 
+                std::upper_bound(sorted.begin(), sorted.end(), responses[k]) - 
+                sorted.begin();
+            bins[bin][labels[k]]++;
+        }
+
+        // Sweep the bins accumulating the left set of each threshold
+        prefix.clear();
+        for (j = 0; j < thresholdNum; j++) {
+            prefix += bins[j];
+            gains[order[j]] = splitGain(prefix, total - prefix, setEntropy);
+        }
+
+        // Keep the feature if it has a good information gain
+        for (j = 0; j < thresholdNum; j++) {
+            if (gains[j] > bestGain) {
+                bestPhi = SplitCandidate(u, v, thresholds[j], gains[j]);
+                bestGain = gains[j];
+            }
+        }
+    }
+    return bestPhi;
 }
 
 
@@ -315,10 +646,10 @@ bool rdf::RandomForest::testNode(
     labeledEqual = false;
 
     // If all labels are equal then return leaf node.
-    firstLabel = image_pool->getLabel((*td)[range.start]);
+    firstLabel = td->label(range.start);
     for (i = range.start + 1; i < range.end; i++ ) {
        
-        nextLabel = image_pool->getLabel((*td)[i]);
+        nextLabel = td->label(i);
 
         if (firstLabel != nextLabel) {
             labeledEqual = false;
@@ -331,59 +662,139 @@ bool rdf::RandomForest::testNode(
         labeledEqual = true;
     }
 
-    if (notEnoughSamples) {
-        printf ("samples\n");
-    }
-    
-    if (depthReached) {
-        printf("depth reached\n");
-    }
-
-    if (labeledEqual) {
-        printf("lab eq\n");
-    }
-
-
     if (notEnoughSamples || depthReached || labeledEqual) {
-        *n = (Node *) new LeafNode ();
+        *n = arena->leaf(tp->labelNum);
         return LEAF;
     }
     else {
-        *n = (Node *) new SplitNode ();
+        *n = arena->split();
         return SPLIT;
     }
 
 }
 
 
-/** \brief Returns a normalized vector with the dirstribution of each 
- * type of label in the TrainData vector.
+/** \brief Returns the counts of each type of label in a range of the
+ *  TrainData vector.
  *
  *  \param[in] begin First range index of the TrainData vector  
- *  \param[in] begin Second range index of the TrainData vector  
- *  \return A normalize vector with the distribution of each type of 
- *  label
+ *  \param[in] end Last range index of the TrainData vector  
+ *  \return The label counts of the range.
  */
-std::vector<float> 
-rdf::RandomForest::labelDistribution(const size_t begin, const size_t end) {
-    const float total = static_cast<float>(end - begin + 1);
-
-    std::vector<float> percentages(tp->labelNum, 0.0f);
+rdf::LabelHistogram<> 
+rdf::RandomForest::labelCounts(const int begin, const int end) {
+    LabelHistogram<> counts;
 
     // Count the number of each label type
-    for (size_t i = begin; i <= end; i++) {
-        Label label = image_pool->getLabel((*td)[i]);
-        percentages[label - 1] += 1.0f;
+    for (int i = begin; i <= end; i++) {
+        counts.add(td->label(i));
     }
     
-    // Normalize the percentage vector
-    for (auto& elem : percentages) {
-        elem /= total;
+    return counts;
+}
+
+
+/** \brief Creates a new node for the range of training data. Split
+ *  nodes are left without children and with an empty split candidate,
+ *  leaf nodes get the label distribution of the range.
+ *
+ *  \param[out] n The new node.
+ *  \param[in] parent Parent of the new node.
+ *  \param[in] range Range of the training data of the node.
+ *  \param[in,out] nodeCount Id of the next node of the tree.
+ *  \return SPLIT or LEAF.
+ */
+bool rdf::RandomForest::growNode(
+    Node** n,
+    Node* parent,
+    NumRange range,
+    unsigned& nodeCount
+) {
+    bool nType;
+
+    const int depth = (parent != nullptr) ? getDepth(parent) : 0;
+
+    // A split without gain leaves one of the children without pixels
+    if (range.end < range.start) {
+        *n = arena->leaf(tp->labelNum);
+        (*n)->id = nodeCount;
+        nodeCount++;
+
+        stats.node((*n)->id, depth, 0, true);
+        return LEAF;
     }
-    
-    return percentages;
+
+    nType = testNode (n, parent, range);
+
+    if (nType == SPLIT) {
+        ((SplitNode *) *n)->parent_ = parent;
+        ((SplitNode *) *n)->left_ = nullptr;
+        ((SplitNode *) *n)->right_ = nullptr;
+        ((SplitNode *) *n)->phi = SplitCandidate();
+    }
+    else {
+        labelCounts(range.start, range.end).distribution(
+            ((LeafNode *) *n)->pDist.data(), tp->labelNum);
+    }
+
+    // Labeling node
+    (*n)->id = nodeCount;
+    nodeCount++;
+
+    stats.node((*n)->id, depth, range.end - range.start + 1, nType == LEAF);
+    return nType;
 }
 
+/** \brief Creates a new node from the label counts of the node in the
+ *  whole cluster. The stopping criteria are the ones of testNode.
+ *
+ *  \param[out] n The new node.
+ *  \param[in] parent Parent of the new node.
+ *  \param[in] counts Number of pixels of each label in the node.
+ *  \param[in,out] nodeCount Id of the next node of the tree.
+ *  \return SPLIT or LEAF.
+ */
+bool rdf::RandomForest::growShardedNode(
+    Node** n,
+    Node* parent,
+    const LabelHistogram<>& counts,
+    unsigned& nodeCount
+) {
+    int depth;
+    int labelCount;
+    unsigned sampleCount;
+
+    depth = getDepth(parent) + 1;
+
+    sampleCount = counts.total();
+    labelCount = counts.nonZero();
+
+    if ((sampleCount <= unsigned(tp->minSampleCount)) || 
+        (depth >= tp->maxDepth) || 
+        (labelCount <= 1)) {
+
+        LeafNode* leaf = arena->leaf(tp->labelNum);
+        counts.distribution(leaf->pDist.data(), tp->labelNum);
+
+        *n = leaf;
+    }
+    else {
+        // The constructor leaves the node without parent, children and
+        // split candidate.
+        SplitNode* split = arena->split();
+        split->parent_ = parent;
+
+        *n = split;
+    }
+
+    // Labeling node
+    (*n)->id = nodeCount;
+    nodeCount++;
+
+    stats.node((*n)->id, (parent != nullptr) ? getDepth(parent) : 0,
+               sampleCount, (*n)->nodeType() == LEAF);
+    return (*n)->nodeType();
+}
 
 /** \brief Traverse the tree up to the root to figure out the nodes depth.
  *  \param[in] n Pointer to the node.
@@ -403,6 +814,29 @@ int rdf::RandomForest::getDepth(Node *n) {
     return depth + 1;
 }
 
+/**
+ *  classifyTrainPixel
+ *
+ *  Same as classifyPixel for the pixel i of the train data, with the
+ *  depth cached in the train data.
+ *
+ *  @param phi is te feacture to classify pixel.
+ *  @param i is the index of the pixel in the train data.
+ *
+ *  @return LEFT or RIGHT.
+ */
+rdf::pixelSet rdf::RandomForest::classifyTrainPixel(
+    const SplitCandidate& phi, 
+    int i
+) {
+    const PixelInfo& x = (*td)[i];
+    const float featureValue = featureResponse(
+        phi.u.x, phi.u.y, phi.v.x, phi.v.y, x, td->depth(i), 
+        image_pool->getImgPtr(x.id));
+
+    return (featureValue < phi.t) ? LEFT : RIGHT;
+}
+
 /**
  *  classifyPixel
  *
@@ -419,7 +853,7 @@ int rdf::RandomForest::getDepth(Node *n) {
 rdf::pixelSet rdf::RandomForest::classifyPixel(
     SplitCandidate phi, 
     PixelInfo x, 
-    Image *img
+    const Image *img
 ) {
     float featureValue;
     
@@ -446,31 +880,23 @@ void rdf::RandomForest::train(int treeID) {
     unsigned nodeCount;
 
     int idx;
-    int i;
-    int done;
-    int mpiSize;
-
-    MPI_Status status;
 
     SplitCandidate bestSplit;
-    SplitCandidate bestMPI;
 
     Node **root;
     Node *currentNode;
     Node *right;
     Node *left;
 
-    bool nType;
-
     NumRange range;
     NumRange tmpRange;
 
+    std::vector<NumRange> nodeRange;
+    std::vector<int> pivots;
+
     std::stack<Node*> nStack;
     std::stack<NumRange> trainIdx;
 
-    // Get the number of processes in the MPI cluster
-    MPI_Comm_size (MPI_COMM_WORLD, &mpiSize);
-
     nodeCount = 1;
 
     // Start with the root node.
@@ -481,28 +907,10 @@ void rdf::RandomForest::train(int treeID) {
     range.end = td -> size() - 1;
 
     // Verifying type of node
-    nType = testNode (root,
-                      *root,
-                      range);
-
-    if (nType == SPLIT) {
-        // Building split node
-        ((SplitNode*)*root)->parent_ = nullptr;
+    if (growNode (root, nullptr, range, nodeCount) == SPLIT) {
         nStack.push (*root);
         trainIdx.push (range);
-
-        ((SplitNode *) *root) -> id = nodeCount;
-        nodeCount++;
     } 
-    else if (nType == LEAF) {
-        
-        // Calculate leaf probability distribution
-        ((LeafNode*)*root)->pDist = labelDistribution(range.start, range.end);
-        
-        ((LeafNode *) *root) -> id = nodeCount;
-        nodeCount++;
-
-    }
     
     while (!nStack.empty()) {
         // Obtain current node
@@ -513,433 +921,1917 @@ void rdf::RandomForest::train(int treeID) {
         trainIdx.pop();
 
 
-        tmpRange = range;
+        tmpRange = range;
+
+        // Calculate best split in current node with the whole cluster
+        nodeRange.assign(1, range);
+        bestSplit = clusterSplits(nodeRange).front();
+
+        // Sort train data given best split
+        partitionNodes(nodeRange, std::vector<SplitCandidate>(1, bestSplit),
+                       pivots);
+        idx = pivots.front();
+
+        // Temp range for the left node
+        tmpRange.start = range.start;
+        tmpRange.end = idx - 1;
+
+        if (growNode (&left, currentNode, tmpRange, nodeCount) == SPLIT) {
+            nStack.push (left);
+            trainIdx.push (tmpRange);
+        } 
+
+        ((SplitNode *) currentNode)->left_ = left;
+
+        tmpRange.start = idx;
+        tmpRange.end = range.end;
+
+        if (growNode (&right, currentNode, tmpRange, nodeCount) == SPLIT) {
+            nStack.push (right);
+            trainIdx.push (tmpRange);
+        } 
+
+        ((SplitNode *) currentNode)->right_ = right;
+
+        ((SplitNode *) currentNode) -> phi = bestSplit;
+
+        stats.endRound(std::vector<unsigned>(1, currentNode->id),
+                       std::vector<float>(1, bestSplit.g), roundCandidates());
+    }
+}
+
+/**
+ *  This function trains a single tree one level at a time. The open
+ *  nodes of the current depth form the frontier: the split search of
+ *  all of them is a single job of the thread pool and a single message
+ *  to every worker, and their partitions, which are disjoint ranges of
+ *  the train data, are sorted in parallel.
+ *
+ *  @param treeID of the tree to train.
+ */
+void rdf::RandomForest::trainLevelWise(int treeID) {
+    unsigned nodeCount;
+    unsigned k;
+
+    Node *left;
+    Node *right;
+
+    NumRange range;
+    NumRange tmpRange;
+
+    std::vector<Node*> frontier;
+    std::vector<NumRange> ranges;
+    std::vector<Node*> nextFrontier;
+    std::vector<NumRange> nextRanges;
+
+    std::vector<int> pivots;
+    std::vector<SplitCandidate> bestSplit;
+
+    std::vector<unsigned> ids;
+    std::vector<float> gains;
+
+    nodeCount = 1;
+
+    // Set initial range of training data.
+    range.start = 0;
+    range.end = td -> size() - 1;
+
+    if (growNode (&trees[treeID], nullptr, range, nodeCount) == SPLIT) {
+        frontier.push_back (trees[treeID]);
+        ranges.push_back (range);
+    }
+
+    while (!frontier.empty()) {
+        // Calculate the best split of every node of the level
+        bestSplit = clusterSplits(ranges);
+
+        // Sort the train data of every node given its best split
+        partitionNodes(ranges, bestSplit, pivots);
+
+        // Build the next level. The children are labeled left to right.
+        nextFrontier.clear();
+        nextRanges.clear();
+        ids.clear();
+        gains.clear();
+
+        for (k = 0; k < frontier.size(); k++) {
+            ((SplitNode *) frontier[k]) -> phi = bestSplit[k];
+
+            tmpRange.start = ranges[k].start;
+            tmpRange.end = pivots[k] - 1;
+
+            if (growNode (&left, frontier[k], tmpRange, nodeCount) == SPLIT) {
+                nextFrontier.push_back (left);
+                nextRanges.push_back (tmpRange);
+            }
+
+            ((SplitNode *) frontier[k]) -> left_ = left;
+
+            tmpRange.start = pivots[k];
+            tmpRange.end = ranges[k].end;
+
+            if (growNode (&right, frontier[k], tmpRange, nodeCount) == SPLIT) {
+                nextFrontier.push_back (right);
+                nextRanges.push_back (tmpRange);
+            }
+
+            ((SplitNode *) frontier[k]) -> right_ = right;
+
+            ids.push_back (frontier[k]->id);
+            gains.push_back (bestSplit[k].g);
+        }
+
+        stats.endRound(ids, gains, roundCandidates());
+
+        frontier.swap(nextFrontier);
+        ranges.swap(nextRanges);
+    }
+}
+
+/**
+ *  This function trains a single tree with the train data sharded among
+ *  the processes. Each node costs one broadcast of the candidates and one
+ *  sum reduction of their label counts; the counts of the winning
+ *  candidate are the counts of the children, so no other message is
+ *  needed to decide whether they are leaves.
+ *
+ *  @param treeID of the tree to train.
+ */
+void rdf::RandomForest::trainSharded(int treeID) {
+    unsigned nodeCount;
+    unsigned i;
+    unsigned j;
+    int rank;
+    int idx;
+    int best;
+
+    const unsigned offsetNum = tp->offsetNum;
+    const unsigned thresholdNum = tp->thresholdNum;
+
+    float setEntropy;
+    float gain;
+    float bestGain;
+
+    Offset u;
+    Offset v;
+
+    Node *currentNode;
+    Node *left;
+    Node *right;
+
+    NumRange range;
+    NumRange tmpRange;
+
+    SplitCandidate bestSplit;
+
+    std::vector<int> pivots;
+    std::vector<LabelHistogram<> > counts;
+    LabelHistogram<> rootCounts;
+    LabelHistogram<> leftCounts;
+    LabelHistogram<> rightCounts;
+    std::vector<SplitCandidate> pairs(offsetNum);
+    std::vector<float> thresholds(offsetNum * thresholdNum);
+
+    std::stack<Node*> nStack;
+    std::stack<NumRange> trainIdx;
+    std::stack<LabelHistogram<> > nodeCounts;
+
+    MPI_Comm_rank(comm, &rank);
+
+    nodeCount = 1;
+
+    // Set initial range of the local training data.
+    range.start = 0;
+    range.end = td -> size() - 1;
+
+    // Label counts of the whole training data of the tree. A histogram
+    // is a plain array of NUMBER_OF_LABELS counts.
+    rootCounts = labelCounts(range.start, range.end);
+
+    double waitStart = takeInitialTime();
+    MPI_Allreduce(MPI_IN_PLACE, &rootCounts[0], NUMBER_OF_LABELS, 
+                  MPI_UINT32_T, MPI_SUM, comm);
+    stats.addWait(takeInitialTime() - waitStart);
+
+    if (growShardedNode (&trees[treeID], nullptr, rootCounts, nodeCount) == SPLIT) {
+        nStack.push (trees[treeID]);
+        trainIdx.push (range);
+        nodeCounts.push (rootCounts);
+    }
+
+    while (!nStack.empty()) {
+        currentNode = nStack.top();
+        nStack.pop();
+
+        range = trainIdx.top();
+        trainIdx.pop();
+
+        const LabelHistogram<> total = nodeCounts.top();
+        nodeCounts.pop();
+
+        stats.beginRound(1);
+
+        // The master generates the candidates of the node in the same
+        // order as bestSplitHistogram.
+        if (rank == 0) {
+            seedThreadRng(streamSeed(streamSeed(treeSeed, SPLIT_STREAM), 
+                                     splitRound++));
+
+            for (i = 0; i < offsetNum; i++) {
+                u.setRandomlyInRange(tp->offsetRange.start, tp->offsetRange.end);
+                v.setRandomlyInRange(tp->offsetRange.start, tp->offsetRange.end);
+                pairs[i] = SplitCandidate(u, v);
+
+                for (j = 0; j < thresholdNum; j++) {
+                    thresholds[i * thresholdNum + j] = 
+                        randFloat(tp->thresholdRange);
+                }
+            }
+        }
+
+        waitStart = takeInitialTime();
+        MPI_Bcast(pairs.data(), offsetNum, splitCandidateType(), 0, 
+                  comm);
+        MPI_Bcast(thresholds.data(), thresholds.size(), MPI_FLOAT, 0, 
+                  comm);
+        stats.addWait(takeInitialTime() - waitStart);
+
+        // Count the local pixels of each side and add up the cluster
+        shardHistograms(range, pairs, thresholds, counts);
+
+        waitStart = takeInitialTime();
+        MPI_Allreduce(MPI_IN_PLACE, &counts[0][0], 
+                      counts.size() * NUMBER_OF_LABELS, MPI_UINT32_T, 
+                      MPI_SUM, comm);
+        stats.addWait(takeInitialTime() - waitStart);
+
+        // Every process chooses the same candidate from the same counts
+        setEntropy = H(total);
+
+        best = -1;
+        bestGain = 0.0f;
+        for (i = 0; i < offsetNum * thresholdNum; i++) {
+            gain = splitGain(counts[i], total - counts[i], setEntropy);
+
+            if (gain > bestGain) {
+                best = i;
+                bestGain = gain;
+            }
+        }
+
+        if (best >= 0) {
+            bestSplit = SplitCandidate(pairs[best / thresholdNum].u,
+                                       pairs[best / thresholdNum].v,
+                                       thresholds[best], 
+                                       bestGain);
+            leftCounts = counts[best];
+        }
+        else {
+            // The default candidate sends every pixel to the right
+            bestSplit = SplitCandidate();
+            leftCounts.clear();
+        }
+
+        rightCounts = total - leftCounts;
+
+        // Sort the local train data given best split
+        partitionNodes(std::vector<NumRange>(1, range), 
+                       std::vector<SplitCandidate>(1, bestSplit),
+                       pivots, false);
+        idx = pivots.front();
+
+        tmpRange.start = range.start;
+        tmpRange.end = idx - 1;
+
+        if (growShardedNode (&left, currentNode, leftCounts, nodeCount) == SPLIT) {
+            nStack.push (left);
+            trainIdx.push (tmpRange);
+            nodeCounts.push (leftCounts);
+        }
+
+        ((SplitNode *) currentNode)->left_ = left;
+
+        tmpRange.start = idx;
+        tmpRange.end = range.end;
+
+        if (growShardedNode (&right, currentNode, rightCounts, nodeCount) == SPLIT) {
+            nStack.push (right);
+            trainIdx.push (tmpRange);
+            nodeCounts.push (rightCounts);
+        }
+
+        ((SplitNode *) currentNode)->right_ = right;
+
+        ((SplitNode *) currentNode) -> phi = bestSplit;
+
+        stats.endRound(std::vector<unsigned>(1, currentNode->id),
+                       std::vector<float>(1, bestSplit.g), roundCandidates());
+    }
+}
+
+/**
+ *  This function runs the worker side of the training of a tree. It
+ *  waits for the ranges broadcast by the master process, generates split
+ *  candidates for them, and sorts the train data with the best
+ *  candidates found in the cluster, until the master signals the end
+ *  of the tree.
+ */
+void rdf::RandomForest::trainWorker() {
+    std::vector<NumRange> ranges;
+    std::vector<SplitCandidate> splits;
+    std::vector<int> pivots;
+
+    double waitStart = takeInitialTime();
+
+    while (shareRanges(ranges) > 0) {
+        stats.beginRound(ranges.size());
+        stats.addWait(takeInitialTime() - waitStart);
+
+        splits = bestSplits(ranges);
+
+        waitStart = takeInitialTime();
+        reduceSplits(splits);
+        stats.addWait(takeInitialTime() - waitStart);
+
+        // Sort the data of every node with its best split candidate
+        partitionNodes(ranges, splits, pivots);
+
+        waitStart = takeInitialTime();
+    }
+
+    stats.addWait(takeInitialTime() - waitStart);
+}
+
+/**
+ *  shareRanges
+ *
+ *  The number of ranges and the ranges go in two broadcasts from the
+ *  master process, whatever the number of nodes being split.
+ *
+ *  @param ranges of the train data.
+ *
+ *  @return number of ranges, 0 at the end of the tree.
+ */
+int rdf::RandomForest::shareRanges(std::vector<NumRange>& ranges) {
+    int count;
+
+    count = ranges.size();
+    MPI_Bcast(&count, 1, MPI_INT, 0, comm);
+
+    ranges.resize(count);
+    if (count > 0) {
+        MPI_Bcast(ranges.data(), count, numRangeType(), 0, comm);
+    }
+
+    return count;
+}
+
+/**
+ *  reduceSplits
+ *
+ *  A single reduction keeps the candidate with the largest gain of each
+ *  node, the lowest rank wins on equal gains.
+ *
+ *  @param best split candidates of this process, replaced by the best
+ *  of the cluster.
+ */
+void rdf::RandomForest::reduceSplits(std::vector<SplitCandidate>& splits) {
+    MPI_Allreduce(MPI_IN_PLACE, splits.data(), splits.size(), 
+                  splitCandidateType(), maxGainOp(), comm);
+}
+
+/**
+ *  clusterSplits
+ *
+ *  Master side of the split search of a set of nodes.
+ *
+ *  @param ranges of the train data.
+ *
+ *  @return The best split candidate of each range in the cluster.
+ */
+std::vector<rdf::SplitCandidate> rdf::RandomForest::clusterSplits(
+    std::vector<NumRange>& ranges
+) {
+    std::vector<SplitCandidate> splits;
+
+    stats.beginRound(ranges.size());
+
+    double waitStart = takeInitialTime();
+    shareRanges(ranges);
+    stats.addWait(takeInitialTime() - waitStart);
+
+    splits = bestSplits(ranges);
+
+    waitStart = takeInitialTime();
+    reduceSplits(splits);
+    stats.addWait(takeInitialTime() - waitStart);
+
+    return splits;
+}
+
+/**
+ *  roundCandidates
+ *
+ *  The processes of the group divide the candidates in the candidate
+ *  parallel mode, and all of them evaluate the same candidates on their
+ *  shard in the data parallel mode.
+ *
+ *  @return number of candidates evaluated in the cluster per node.
+ */
+uint64_t rdf::RandomForest::roundCandidates() {
+    int mpiSize = 1;
+
+    if (tp -> distribution != DATA_PARALLEL) {
+        MPI_Comm_size(comm, &mpiSize);
+    }
+
+    return uint64_t(tp -> offsetNum) * tp -> thresholdNum * mpiSize;
+}
+
+
+/**
+ *  This fuction visit all the nodes in a tree specified and
+ *  print its content.
+ *
+ *  @param id of the tree.
+ */
+ //CHECK
+void rdf::RandomForest::traversal(int treeID) {   
+    printf ("TRAVERSAL TREE %d\n", treeID);
+    unsigned int i;
+    Node *root;
+    Node *currentNode;
+    Node *right;
+    Node *left;
+    
+    std::stack<Node*> nStack;
+
+    root = trees[treeID];
+    nStack.push(root);
+
+    while (!nStack.empty()) {
+        currentNode = nStack.top();
+        nStack.pop();
+
+        
+        // Push left element second
+        left = ((SplitNode*)currentNode)->left_;
+
+        if (left -> nodeType() != LEAF) {
+            nStack.push(left);      
+        }
+        else {
+
+            /*Imprimo lo de la hoja */
+
+            printf ("probabilidades\n");
+            for (i = 0; i < ((LeafNode *)left) -> pDist.size(); i++) {
+                printf("%f ", ((LeafNode *)left) -> pDist[i]);
+            }
+            printf("\n");
+        }
+        
+        // Push right element first
+        right = ((SplitNode*)currentNode)->right_;
+
+        if ( right -> nodeType() != LEAF) {
+            nStack.push(right);
+        }
+        else {
+            
+            /* Imprimo lo de la hoja */
+            printf ("probabilidades\n");
+            for (i = 0; i < ((LeafNode *)right) -> pDist.size(); i++) {
+                printf("%f ", ((LeafNode *)right) -> pDist[i]);
+            }
+            printf("\n");
+
+        }
+    }
+}
+
+
+
+/** \brief Destructor.
+ *
+ *  The nodes of each tree are freed in bulk by its arena.
+ */
+rdf::RandomForest::~RandomForest() {
+    trees.clear();
+    arenas.clear();
+    arena.reset();
+}
+
+
+/** \brief Builds the flattened inference layout of the trees.
+ *
+ *  Called after loading or training the forest. Once built, predict walks
+ *  the flattened trees instead of the node graph.
+ */
+void rdf::RandomForest::compile() {
+    scratch.assign(pool->size(), std::vector<float>(tp -> labelNum));
+
+    // Forest mapped from a binary file
+    if (trees.empty()) {
+        return;
+    }
+
+    for (const auto root : trees) {
+        // Only the master process holds the trained trees.
+        if (root == nullptr) {
+            return;
+        }
+    }
+
+    flat.build(trees, tp -> labelNum);
+
+    if (!quant.empty()) {
+        quant.build(flat, quant.topEntries());
+    }
+}
+
+
+/** \brief Builds the quantized trees from the flattened ones.
+ *
+ *  \param[in] topK Number of labels kept per leaf, 0 to keep every label.
+ */
+void rdf::RandomForest::quantize(const int topK) {
+    if (flat.empty()) {
+        printf("The forest must be compiled before it is quantized.\n");
+        exit(1);
+    }
+
+    quant.build(flat, topK);
+}
+
+
+/**
+ *  This function classify a pixel of a given image by the
+ *  random forest.
+ *
+ *  @param pointer to the image.
+ *  @param pixel to classofy
+ *  @param probability of the classification.
+ *  @return label of the classification
+ */
+ //CHECK
+Label rdf::RandomForest::predict(Image* img, PixelInfo pixel, float& prob) {
+    if (!quant.empty()) {
+        return quant.classify(*img, pixel, prob);
+    }
+
+    if (tp -> labelNum <= LabelPosterior<>::size()) {
+        LabelPosterior<> postProb;
+        return posteriorLabel(img, pixel, postProb.data(), prob);
+    }
+
+    // Forests loaded with more labels than NUMBER_OF_LABELS
+    vector <float> postProb;
+    postProb.resize (tp -> labelNum, 0.0f);
+
+    return posteriorLabel(img, pixel, postProb.data(), prob);
+}
+
+
+/** \brief Drops a pixel down every tree and returns the label with the
+ *  highest posterior probability.
+ *
+ *  \param[in] img Image of the pixel.
+ *  \param[in] pixel Pixel to classify.
+ *  \param[out] postProb Buffer of labelNum floats for the posterior.
+ *  \param[out] prob Posterior probability of the returned label.
+ *  \return Label of the classification.
+ */
+Label rdf::RandomForest::posteriorLabel(
+    const Image* img, 
+    const PixelInfo& pixel, 
+    float* postProb,
+    float& prob
+) {
+    return pixelPosterior(*img, pixel, postProb, prob, 0.0f);
+}
+
+
+/** \brief Drops a pixel down one tree.
+ *
+ *  \param[in] tree Index of the tree.
+ *  \param[in] img Image of the pixel.
+ *  \param[in] pixel Pixel to classify.
+ *  \return The probability distribution of the leaf reached.
+ */
+const float* rdf::RandomForest::treeLeaf(
+    const int tree,
+    const Image& img,
+    const PixelInfo& pixel
+) {
+    if (!flat.empty()) {
+        return flat.leafDistribution(tree, &img, pixel);
+    }
+
+    Node* currentNode = trees[tree];
+    SplitNode* sNode;
+
+    // Drop pixel down the tree
+    while ( (currentNode -> nodeType()) != LEAF) {
+
+        sNode = (SplitNode *) currentNode;
+
+        switch (classifyPixel (sNode -> phi, pixel, &img)) {
+            case RIGHT:
+                currentNode = sNode->right_;
+                break;
+
+            case LEFT:
+                currentNode = sNode->left_;
+                break;
+            default:
+                printf("Error could not classify pixel\n");
+                break;
+        }
+    }
+
+    return ((LeafNode *) currentNode) -> pDist.data();
+}
+
+
+/** \brief Drops a pixel of a padded frame down one tree, with the
+ *  non-virtual lookups of the frame when the trees are flattened.
+ */
+const float* rdf::RandomForest::treeLeaf(
+    const int tree,
+    const PaddedDepthImage& img,
+    const PixelInfo& pixel
+) {
+    if (!flat.empty()) {
+        return flat.leafDistribution(tree, img, pixel);
+    }
+
+    return treeLeaf(tree, static_cast<const Image&>(img), pixel);
+}
+
+
+/** \brief Adds the leaf distributions of the trees for a pixel and
+ *  returns the label with the highest posterior probability.
+ *
+ *  With earlyExit > 0 the trees stop as soon as the leading label cannot
+ *  be overtaken by the trees left, each adding at most 1 to a label, or
+ *  as soon as its mean probability over the trees evaluated reaches
+ *  earlyExit. The returned probability is then the mean over the trees
+ *  evaluated.
+ *
+ *  \param[in] img Image of the pixel.
+ *  \param[in] pixel Pixel to classify.
+ *  \param[out] postProb Buffer of labelNum floats for the posterior.
+ *  \param[out] prob Posterior probability of the returned label.
+ *  \param[in] earlyExit Probability that stops the trees, 0 to use all
+ *  of them.
+ *  \return Label of the classification.
+ */
+template<typename Img>
+Label rdf::RandomForest::pixelPosterior(
+    const Img& img,
+    const PixelInfo& pixel,
+    float* postProb,
+    float& prob,
+    const float earlyExit
+) {
+    const int treeNum = tp -> treeNum;
+    const int labelNum = tp -> labelNum;
+    int i;
+    int j;
+
+    std::fill(postProb, postProb + labelNum, 0.0f);
+
+    for (i = 0; i < treeNum; i++) {
+        const float* pDist = treeLeaf(i, img, pixel);
+
+        for (j = 0; j < labelNum; j++) {
+            postProb[j] += pDist[j];
+        }
+
+        if (earlyExit > 0.0f && i + 1 < treeNum) {
+            int lead = 0;
+            float second = 0.0f;
+
+            for (j = 1; j < labelNum; j++) {
+                if (postProb[j] > postProb[lead]) {
+                    second = postProb[lead];
+                    lead = j;
+                }
+                else if (postProb[j] > second) {
+                    second = postProb[j];
+                }
+            }
+
+            const float mean = postProb[lead] / (i + 1);
+
+            if (postProb[lead] > 0.0f && 
+                (postProb[lead] - second > treeNum - i - 1 || mean >= earlyExit)) {
+                prob = mean;
+                return lead + 1;
+            }
+        }
+    }
+
+    return maxPosterior(postProb, prob);
+}
+
+
+/** \brief Returns the label with the highest posterior probability.
+ *
+ *  \param[in] postProb Sum of the leaf distributions of the trees.
+ *  \param[out] prob Posterior probability of the returned label.
+ *  \return Label of the classification.
+ */
+Label rdf::RandomForest::maxPosterior(const float* postProb, float& prob) const {
+    int j;
+    Label maxLabel;
+    float maxProb;
+    float tmpProb;
+
+    maxProb = 0.0;
+    tmpProb = 0.0;
+    maxLabel = 0;
+    
+    // Takes the label of the maximun probability
+    for (j = 0; j < tp -> labelNum; j++) {
+        tmpProb = postProb[j] / tp -> treeNum;
+
+        if (tmpProb > maxProb) {
+            maxProb = tmpProb;
+            maxLabel = j;
+        }
+    }
+
+    prob = maxProb;
+    return maxLabel + 1;
+}
+
+
+/** \brief Classifies one pixel of a frame into the planes of
+ *  classifyFrame. Pixels without depth or outside the mask get
+ *  DEFAULT_LABEL and probability 0.
+ *
+ *  \param[in] img Frame of the pixel.
+ *  \param[in] x Row of the pixel.
+ *  \param[in] y Column of the pixel.
+ *  \param[in] worker Worker of the thread pool, owner of the posterior
+ *  buffer.
+ *  \param[out] labels Plane of width * height labels.
+ *  \param[out] probs Plane of width * height floats, or nullptr.
+ *  \param[in] cp Options of the inference.
+ */
+template<typename Img>
+void rdf::RandomForest::framePixel(
+    const Img& img,
+    const int x,
+    const int y,
+    const int worker,
+    Label* labels,
+    float* probs,
+    const classifyParams& cp
+) {
+    const int idx = x * img.width + y;
+    float prob;
+
+    if (img.getDepth(x, y) == DEFAULT_DEPTH ||
+        (cp.mask != nullptr && cp.mask[idx] == 0)) {
+        prob = 0.0f;
+        labels[idx] = DEFAULT_LABEL;
+    }
+    else if (!quant.empty()) {
+        labels[idx] = quant.classify(img, PixelInfo(x, y), prob);
+    }
+    else {
+        labels[idx] = pixelPosterior(img, PixelInfo(x, y), 
+                                     scratch[worker].data(), prob,
+                                     cp.earlyExit);
+    }
+
+    if (probs != nullptr) {
+        probs[idx] = prob;
+    }
+}
+
+
+/** \brief Classifies the pixels of a frame selected by the parameters.
+ *
+ *  The region of interest is split in tiles of FRAME_TILE_SIZE x
+ *  FRAME_TILE_SIZE pixels that are classified in parallel by the thread
+ *  pool, each worker reusing its own posterior buffer. With a stride above
+ *  1 only the first pixel of each stride x stride block is classified,
+ *  then the other pixels of the block take its result in a second
+ *  parallel pass. They are classified themselves when the first pixel has
+ *  no depth or is outside the mask.
+ *
+ *  \param[in] img Frame to classify.
+ *  \param[out] labels Caller owned plane of width * height labels.
+ *  \param[out] probs Caller owned plane of width * height floats, or
+ *  nullptr.
+ *  \param[in] cp Options of the inference.
+ */
+template<typename Img>
+void rdf::RandomForest::classifyRegion(
+    const Img& img,
+    Label* labels,
+    float* probs,
+    const classifyParams& cp
+) {
+    const int startX = std::max(cp.rows.start, 0);
+    const int endX = std::min<int>(cp.rows.end, img.height);
+    const int startY = std::max(cp.cols.start, 0);
+    const int endY = std::min<int>(cp.cols.end, img.width);
+    const int stride = std::max(cp.stride, 1);
+
+    // Everything outside the region of interest is background
+    if (startX > 0 || endX < img.height || startY > 0 || endY < img.width) {
+        std::fill(labels, labels + img.width * img.height, DEFAULT_LABEL);
+        if (probs != nullptr) {
+            std::fill(probs, probs + img.width * img.height, 0.0f);
+        }
+    }
+
+    if (startX >= endX || startY >= endY) {
+        return;
+    }
+
+    const int tilesX = (endX - startX + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+    const int tilesY = (endY - startY + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+
+    auto classify = [&](int x, int y, int worker) {
+        framePixel(img, x, y, worker, labels, probs, cp);
+    };
+
+    auto tileBounds = [&](int tile, int& tx, int& ty, int& ex, int& ey) {
+        tx = startX + (tile / tilesY) * FRAME_TILE_SIZE;
+        ty = startY + (tile % tilesY) * FRAME_TILE_SIZE;
+        ex = std::min(tx + FRAME_TILE_SIZE, endX);
+        ey = std::min(ty + FRAME_TILE_SIZE, endY);
+    };
+
+    // First block start at or after a coordinate
+    auto firstAnchor = [&](int c, int start) {
+        return c + (stride - (c - start) % stride) % stride;
+    };
+
+    pool->parallelFor(tilesX * tilesY, [&](int tile, int worker) {
+        int tx, ty, ex, ey;
+
+        tileBounds(tile, tx, ty, ex, ey);
+        for (int x = firstAnchor(tx, startX); x < ex; x += stride) {
+            for (int y = firstAnchor(ty, startY); y < ey; y += stride) {
+                classify(x, y, worker);
+            }
+        }
+    });
+
+    if (stride == 1) {
+        return;
+    }
+
+    // Upsample from the first pixel of each block
+    pool->parallelFor(tilesX * tilesY, [&](int tile, int worker) {
+        int tx, ty, ex, ey;
+
+        tileBounds(tile, tx, ty, ex, ey);
+        for (int x = tx; x < ex; x++) {
+            const int ax = x - (x - startX) % stride;
+
+            for (int y = ty; y < ey; y++) {
+                const int ay = y - (y - startY) % stride;
+
+                if (x == ax && y == ay) {
+                    continue;
+                }
+
+                const int aIdx = ax * img.width + ay;
+                const int idx = x * img.width + y;
+
+                if (labels[aIdx] == DEFAULT_LABEL) {
+                    classify(x, y, worker);
+                }
+                else if (img.getDepth(x, y) == DEFAULT_DEPTH ||
+                         (cp.mask != nullptr && cp.mask[idx] == 0)) {
+                    labels[idx] = DEFAULT_LABEL;
+                    if (probs != nullptr) {
+                        probs[idx] = 0.0f;
+                    }
+                }
+                else {
+                    labels[idx] = labels[aIdx];
+                    if (probs != nullptr) {
+                        probs[idx] = probs[aIdx];
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+/** \brief Classifies every pixel of a depth frame.
+ *
+ *  \param[in] img Frame to classify.
+ *  \param[out] labels Caller owned plane of width * height labels.
+ *  \param[out] probs Caller owned plane of width * height floats with the
+ *  probability of each label, or nullptr.
+ *  \param[in] cp Options of the sparse inference mode.
+ */
+void rdf::RandomForest::classifyFrame(
+    const Image& img, 
+    Label* labels, 
+    float* probs,
+    const classifyParams& cp
+) {
+    classifyRegion(img, labels, probs, cp);
+}
+
+
+/** \brief Classifies every pixel of a padded depth frame.
+ *
+ *  \param[in] img Frame to classify.
+ *  \param[out] labels Caller owned plane of width * height labels.
+ *  \param[out] probs Caller owned plane of width * height floats with the
+ *  probability of each label, or nullptr.
+ *  \param[in] cp Options of the sparse inference mode.
+ */
+void rdf::RandomForest::classifyFrame(
+    const PaddedDepthImage& img, 
+    Label* labels, 
+    float* probs,
+    const classifyParams& cp
+) {
+    classifyRegion(img, labels, probs, cp);
+}
+
+/** \brief Classifies every pixel of a batch of padded depth frames.
+ *
+ *  The tiles of the frames are numbered one frame after the other, and
+ *  each iteration of the parallel loop finds its frame by a binary search
+ *  over the first tile of each frame.
+ *
+ *  \param[in] imgs Frames to classify.
+ *  \param[out] labels Caller owned plane of width * height labels of each
+ *  frame.
+ *  \param[out] probs Caller owned plane of width * height floats of each
+ *  frame, or nullptr entries.
+ */
+void rdf::RandomForest::classifyFrames(
+    const std::vector<const PaddedDepthImage*>& imgs,
+    const std::vector<Label*>& labels,
+    const std::vector<float*>& probs
+) {
+    const classifyParams cp;
+    std::vector<int> firstTile(imgs.size() + 1, 0);
+    size_t k;
+
+    for (k = 0; k < imgs.size(); k++) {
+        const int tilesX = (imgs[k]->height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+        const int tilesY = (imgs[k]->width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+
+        firstTile[k + 1] = firstTile[k] + tilesX * tilesY;
+    }
+
+    pool->parallelFor(firstTile.back(), [&](int t, int worker) {
+        const size_t f = std::upper_bound(firstTile.begin(), firstTile.end(), t) - 
+                         firstTile.begin() - 1;
+        const PaddedDepthImage& img = *imgs[f];
+        const int tilesY = (img.width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+        const int tile = t - firstTile[f];
+
+        const int tx = (tile / tilesY) * FRAME_TILE_SIZE;
+        const int ty = (tile % tilesY) * FRAME_TILE_SIZE;
+        const int ex = std::min<int>(tx + FRAME_TILE_SIZE, img.height);
+        const int ey = std::min<int>(ty + FRAME_TILE_SIZE, img.width);
+
+        for (int x = tx; x < ex; x++) {
+            for (int y = ty; y < ey; y++) {
+                framePixel(img, x, y, worker, labels[f], probs[f], cp);
+            }
+        }
+    });
+}
+
+
+/** \brief Replaces the thread pool used by the parallel loops.
+ *  \param[in] p The new thread pool.
+ */
+void rdf::RandomForest::setThreadPool(ThreadPool::Ptr p) {
+    pool = p;
+
+    if (tp != nullptr) {
+        scratch.assign(pool->size(), std::vector<float>(tp -> labelNum));
+    }
+}
+
+
+
+/**
+ *  This function start the training of the forest.
+ *
+ *  @param maximum depth of the tree.
+ *  @param maximum number of examples to build a leaf node.
+ *  @param number of pixels of an image for the training set.
+ *  @param number of images per tree.
+ *  @param number of offsets to generate.
+ *  @param number of thresholds to generate.
+ *
+ */
+ //CHECK
+void rdf::RandomForest::trainForest(trainParams& tparams) {
+    int i;
+    int worldRank;
+    int trainImgNum;
+    uint64_t fingerprint = 0;
+
+    std::vector<int> treeIDs;
+    std::vector<NumRange> images;
+
+    tp = &tparams;
+
+    // Before the features are divided, the groups may have other sizes
+    if (!tp -> checkpointDir.empty()) {
+        fingerprint = paramsFingerprint();
+    }
+
+    beginTraining();
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+
+    // Trees from a previous training or loading are freed with their arenas
+    trees.assign(tp -> treeNum, NULL);
+    arenas.assign(tp -> treeNum, NodeArena::Ptr());
+
+    // The master loads the trees saved by a previous run, which are kept
+    // in the master and skipped by the groups.
+    std::vector<int> done(trees.size(), 0);
+
+    if (!tp -> checkpointDir.empty()) {
+        if (worldRank == 0) {
+            int resumed = 0;
+
+            for (i = 0; i < tp -> treeNum; i++) {
+                done[i] = readCheckpoint(i, fingerprint);
+                resumed += done[i];
+            }
+
+            printf("Resuming %d of %u trees from %s\n", resumed, 
+                   unsigned(trees.size()), tp -> checkpointDir.c_str());
+        }
+
+        MPI_Bcast(done.data(), done.size(), MPI_INT, 0, MPI_COMM_WORLD);
+    }
+
+    // Setting the range of images which every tree is going to
+    // work with
+
+    // TODO: es probable que el ultimo arbol entrene con mas 
+    // imagenes que los anteriores, seria bueno ver como arreglar
+    // eso
+    trainImgNum = tp -> imgNum / tp -> treeNum;
+
+    for (i = 0; i < tp -> treeNum; i++) {
+        if (done[i]) { continue; }
+
+        treeIDs.push_back(i);
+        images.push_back(NumRange(i * trainImgNum, 
+            (i != tp -> treeNum - 1) ? (i + 1) * trainImgNum - 1 
+                                     : image_pool->size() - 1));
+    }
+
+    trainTrees(treeIDs, images, fingerprint);
+}
+
+/**
+ *  updateForest
+ *
+ *  Trains the given trees on a new set of images and keeps the others.
+ *  The ids below the number of trees replace a tree and the rest are
+ *  added at the end of the forest, so together they must cover every id
+ *  up to the new number of trees. The images of tparams.imgDir are
+ *  divided among the trees to train, which use the seeds of their ids.
+ *
+ *  The forest to update is the one of the master process (e.g. from
+ *  loadForest). tparams.treeNum is set to the new number of trees and
+ *  the number of labels must be the one of the forest. The checkpoints
+ *  are not used.
+ *
+ *  @param tparams training parameters of the new trees.
+ *  @param treeIDs ids of the trees to train.
+ */
+void rdf::RandomForest::updateForest(
+    trainParams& tparams,
+    const std::vector<int>& treeIDs
+) {
+    int i;
+    int treeNum;
+    int labelNum;
+    int trainImgNum;
+    int binary;
+
+    std::vector<NumRange> images;
+    std::vector<int> sortedIDs(treeIDs);
+
+    if (treeIDs.empty()) {
+        printf("No trees to update.\n");
+        exit(1);
+    }
+
+    // The master holds the forest to update
+    treeNum = trees.size();
+    labelNum = (treeNum > 0) ? tp -> labelNum : tparams.labelNum;
+    binary = (treeNum == 0) && (!flat.empty() || !quant.empty());
+    MPI_Bcast(&treeNum, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&labelNum, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&binary, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (binary) {
+        printf("A forest loaded from a binary forest file cannot be updated.\n");
+        exit(1);
+    }
+
+    if (labelNum != tparams.labelNum) {
+        printf("The forest has %d labels, the update has %d.\n", 
+               labelNum, tparams.labelNum);
+        exit(1);
+    }
+
+    std::sort(sortedIDs.begin(), sortedIDs.end());
+
+    for (i = 0; i < int(sortedIDs.size()); i++) {
+        if ((sortedIDs[i] < 0) || (i > 0 && sortedIDs[i] == sortedIDs[i - 1])) {
+            printf("Invalid or repeated tree id %d.\n", sortedIDs[i]);
+            exit(1);
+        }
+
+        // The new trees must follow the last one without gaps
+        if (sortedIDs[i] >= treeNum) {
+            if (sortedIDs[i] != treeNum) {
+                printf("Tree id %d leaves trees without training.\n", 
+                       sortedIDs[i]);
+                exit(1);
+            }
+            treeNum++;
+        }
+    }
+
+    tparams.treeNum = treeNum;
+    tp = &tparams;
+
+    beginTraining();
+
+    if (tp -> imgNum < int(treeIDs.size())) {
+        printf("%d images cannot train %u trees.\n", tp -> imgNum, 
+               unsigned(treeIDs.size()));
+        exit(1);
+    }
+
+    trees.resize(treeNum, NULL);
+    arenas.resize(treeNum);
+
+    trainImgNum = tp -> imgNum / treeIDs.size();
+
+    for (i = 0; i < int(treeIDs.size()); i++) {
+        images.push_back(NumRange(i * trainImgNum, 
+            (i != int(treeIDs.size()) - 1) ? (i + 1) * trainImgNum - 1 
+                                           : image_pool->size() - 1));
+    }
+
+    trainTrees(treeIDs, images, 0);
+}
+
+/**
+ *  refitLeaves
+ *
+ *  Drops the labeled pixels of a set of images down the trees and sets
+ *  the distribution of each leaf to the one of the pixels that reach it.
+ *  The images are processed in batches: the threads drop the pixels of
+ *  an image each and then count the labels of a tree each, so the
+ *  counts do not need locks and only the images and the leaves of the
+ *  batch are kept.
+ *
+ *  @param imgDir directory of the labeled images.
+ */
+void rdf::RandomForest::refitLeaves(const std::string& imgDir) {
+    unsigned t;
+    int first;
+    unsigned refitted = 0;
+    unsigned leafNum = 0;
+
+    if (trees.empty() || 
+        std::find(trees.begin(), trees.end(), nullptr) != trees.end()) {
+        printf("Only the trees of a trained or loaded forest can be refitted.\n");
+        exit(1);
+    }
+
+    const unsigned treeNum = trees.size();
+    const int labelNum = tp -> labelNum;
+    const int batch = pool->size();
+
+    // Only the images of a batch are in memory
+    ImagePool images(imgDir, DENSE_STORAGE, 0, 1, batch);
+
+    // Leaves of each tree and their index in the tree
+    std::vector<std::vector<LeafNode*>> leaves(treeNum);
+    std::unordered_map<const Node*, int> leafIndex;
+
+    for (t = 0; t < treeNum; t++) {
+        std::stack<Node*> nStack;
+        nStack.push(trees[t]);
+
+        while (!nStack.empty()) {
+            Node* node = nStack.top();
+            nStack.pop();
+
+            if (node->nodeType() == LEAF) {
+                leafIndex[node] = leaves[t].size();
+                leaves[t].push_back((LeafNode*) node);
+            }
+            else {
+                nStack.push(((SplitNode*) node)->right_);
+                nStack.push(((SplitNode*) node)->left_);
+            }
+        }
+    }
+
+    std::vector<std::vector<LabelHistogram<>>> counts(treeNum);
+    for (t = 0; t < treeNum; t++) {
+        counts[t].resize(leaves[t].size());
+    }
+
+    // Leaf and label of the pixels of each image of the batch and tree
+    std::vector<std::vector<std::pair<int, Label>>> hits(batch * treeNum);
+
+    for (first = 0; first < images.size(); first += batch) {
+        const int n = std::min(batch, images.size() - first);
+
+        images.acquire(first, first + n - 1);
+
+        pool->parallelFor(n, [&](int b, int) {
+            const TrainImage& img = images[first + b];
+            int x;
+            int y;
+            unsigned i;
+
+            for (i = 0; i < treeNum; i++) {
+                hits[b * treeNum + i].clear();
+            }
+
+            for (x = 0; x < img.height; x++) {
+                for (y = 0; y < img.width; y++) {
+                    const Label label = img.getLabel(x, y);
+                    const PixelInfo pixel(x, y);
+
+                    if ((label < 1) || (label > labelNum)) { continue; }
+
+                    for (i = 0; i < treeNum; i++) {
+                        Node* node = trees[i];
+
+                        while (node->nodeType() != LEAF) {
+                            const SplitNode* split = (SplitNode*) node;
+                            node = (classifyPixel(split->phi, pixel, &img) == LEFT) 
+                                   ? split->left_ : split->right_;
+                        }
+
+                        hits[b * treeNum + i].push_back(
+                            std::make_pair(leafIndex.at(node), label));
+                    }
+                }
+            }
+        });
+
+        pool->parallelFor(treeNum, [&](int i, int) {
+            int b;
+
+            for (b = 0; b < n; b++) {
+                for (const auto& hit : hits[b * treeNum + i]) {
+                    counts[i][hit.first].add(hit.second);
+                }
+            }
+        });
+    }
+
+    for (t = 0; t < treeNum; t++) {
+        for (unsigned j = 0; j < leaves[t].size(); j++) {
+            if (counts[t][j].total() > 0) {
+                counts[t][j].distribution(leaves[t][j]->pDist.data(), labelNum);
+                refitted++;
+            }
+        }
+        leafNum += leaves[t].size();
+    }
+
+    printf("Refitted %u of %u leaves with %d images\n", refitted, leafNum, 
+           images.size());
+
+    compile();
+}
+
+/**
+ *  beginTraining
+ *
+ *  Divides the processes in groups and loads the images of the
+ *  training with the parameters in tp.
+ */
+void rdf::RandomForest::beginTraining() {
+    int rank;
+    int mpiSize;
+    int worldRank;
+    int worldSize;
+    int groupNum;
+    int divFactor;
+    const bool sharded = tp -> distribution == DATA_PARALLEL;
+
+    // The label histograms of the training have a fixed size
+    if ((tp -> labelNum < 1) || (tp -> labelNum > NUMBER_OF_LABELS)) {
+        printf("The number of labels must be between 1 and %d.\n", 
+               NUMBER_OF_LABELS);
+        exit(1);
+    }
+
+    // Divide the processes of the cluster in groups of consecutive ranks,
+    // each group trains a whole tree at a time.
+    MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+
+    groupNum = groupCount();
+    MPI_Comm_split(MPI_COMM_WORLD, worldRank * groupNum / worldSize, 
+                   worldRank, &comm);
+
+    // Obtain the rank and the number of processes in the group.
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &mpiSize);
+
+    stats.reset(worldRank, worldRank * groupNum / worldSize, tp -> progress);
+
+    // Load images from directory, only the shard of this process in the
+    // data parallel mode.
+    if (sharded) {
+        image_pool = ImagePool::Ptr(
+            new ImagePool (tp -> imgDir, tp -> storage, rank, mpiSize, 
+                           tp -> imageCache));
+    }
+    else {
+        image_pool = ImagePool::Ptr(new ImagePool (tp -> imgDir, tp -> storage, 
+                                                   0, 1, tp -> imageCache));
+
+        // Calculate the division factor for offsets and threshold numbers
+        //TODO: Acomodar la division de features
+        divFactor = sqrt(mpiSize);
+        tp -> offsetNum /= divFactor;
+        tp -> thresholdNum /= divFactor;
+    }
+
+    tp -> imgNum = image_pool->size();
+
+    std::vector<int> index_vector(tp->imgNum);
+    
+    // A shard only depends on the rank in the group, so the groups of
+    // the same size train the same trees.
+    if ((worldRank == 0) || sharded) {
+        seedThreadRng(streamSeed(streamSeed(tp->seed, PERMUTATION_STREAM), 
+                                 sharded ? rank : 0));
+        index_vector = permutation(tp->imgNum);
+    }
+
+    // Synchronize the permutation of the indices, every group must use
+    // the same images for each tree.
+    if (!sharded) {
+        MPI_Bcast(index_vector.data(), tp->imgNum, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    
+    image_pool->poolReorder(index_vector);
+
+    // The feature kernel needs every image in dense storage
+    if (!image_pool->densePlanes(planes)) {
+        printf("Sparse images in the pool, feature kernel disabled\n");
+    }
+}
+
+/**
+ *  groupCount
+ *
+ *  @return number of groups of processes of the training.
+ */
+int rdf::RandomForest::groupCount() {
+    int worldSize;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+
+    return std::max(1, std::min(tp -> groupNum, worldSize));
+}
+
+/**
+ *  trainTrees
+ *
+ *  Trains trees with the groups of processes of beginTraining, collects
+ *  them in the master and compiles the forest.
+ *
+ *  @param treeIDs ids of the trees to train.
+ *  @param images range of images of each tree.
+ *  @param fingerprint of the checkpoints of the trees, 0 to not save
+ *  them.
+ */
+void rdf::RandomForest::trainTrees(
+    const std::vector<int>& treeIDs,
+    const std::vector<NumRange>& images,
+    uint64_t fingerprint
+) {
+    unsigned i;
+    int rank;
+    int worldRank;
+    int worldSize;
+    int k = -1;
+    int* next;
+    const int one = 1;
+    const int groupNum = groupCount();
+
+    MPI_Win counter;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+
+    // The candidates of a tree depend on the size of the group training
+    // it, so with groups of different sizes the trees are not handed out
+    // as the groups become idle but fixed by their ids.
+    const bool fixedGroups = (worldSize % groupNum) != 0;
+    const int group = worldRank * groupNum / worldSize;
+
+    // The next tree to train is a counter in the master process. The
+    // leader of a group takes a tree each time its group is idle, so the
+    // groups that get the smaller trees train more of them.
+    // The memory of the window is allocated by MPI, some implementations
+    // cannot expose user memory of a single process.
+    MPI_Win_allocate((worldRank == 0) ? sizeof(int) : 0, sizeof(int), 
+                     MPI_INFO_NULL, MPI_COMM_WORLD, &next, &counter);
+
+    if (worldRank == 0) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, counter);
+        *next = 0;
+        MPI_Win_unlock(0, counter);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    std::vector<int> owner(treeIDs.size(), 0);
+
+    while (true) {
+        if (fixedGroups) {
+            do {
+                k++;
+            } while ((k < int(treeIDs.size())) && 
+                     (treeIDs[k] % groupNum != group));
+        }
+        else {
+            if (rank == 0) {
+                MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, counter);
+                MPI_Fetch_and_op(&one, &k, MPI_INT, 0, 0, MPI_SUM, counter);
+                MPI_Win_unlock(0, counter);
+            }
+
+            MPI_Bcast(&k, 1, MPI_INT, 0, comm);
+        }
+
+        if (k >= int(treeIDs.size())) { break; }
 
-        done = 0;
-        for (i = 1; i < mpiSize; i++) {
+        trainTree(treeIDs[k], images[k]);
 
-            MPI_Send(&done, 1, MPI_INT, i, 86, MPI_COMM_WORLD);
+        if (rank == 0) {
+            owner[k] = worldRank + 1;
 
-            // Send range to nodes
-            MPI_Send(&range.start, 1, MPI_INT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&range.end,   1, MPI_INT, i, 88, MPI_COMM_WORLD);
+            if (fingerprint != 0) {
+                writeCheckpoint(treeIDs[k], fingerprint);
+            }
         }
+    }
 
-        // Calculate best split in current node
-        bestSplit = bestSplitThreadFun(range);
+    MPI_Win_free(&counter);
 
+    if (!tp -> statsFile.empty()) {
+        stats.write(tp -> statsFile, MPI_COMM_WORLD);
+    }
 
-        // Receive and keep the best split candidate.
-        for (i = 1; i < mpiSize; i++) {
+    // Collect the trees trained by the other groups in the master.
+    MPI_Allreduce(MPI_IN_PLACE, owner.data(), owner.size(), MPI_INT, 
+                  MPI_MAX, MPI_COMM_WORLD);
 
-            MPI_Recv(&bestMPI.u.x, 1, MPI_INT, i, 88, MPI_COMM_WORLD, &status);
-            MPI_Recv(&bestMPI.u.y, 1, MPI_INT, i, 88, MPI_COMM_WORLD, &status);
-            MPI_Recv(&bestMPI.v.x, 1, MPI_INT, i, 88, MPI_COMM_WORLD, &status);
-            MPI_Recv(&bestMPI.v.y, 1, MPI_INT, i, 88, MPI_COMM_WORLD, &status);
-            MPI_Recv(&bestMPI.t, 1, MPI_FLOAT, i, 88, MPI_COMM_WORLD, &status);
-            MPI_Recv(&bestMPI.g, 1, MPI_FLOAT, i, 88, MPI_COMM_WORLD, &status);
+    for (i = 0; i < treeIDs.size(); i++) {
+        std::vector<char> buffer;
+        const int treeID = treeIDs[i];
 
-            if (bestMPI.g > bestSplit.g) {
-                bestSplit = bestMPI;
-            }
+        if ((owner[i] - 1 == worldRank) && (worldRank != 0)) {
+            packTree(trees[treeID], buffer);
+            MPI_Send(buffer.data(), buffer.size(), MPI_CHAR, 0, TREE_TAG, 
+                     MPI_COMM_WORLD);
         }
+        else if ((owner[i] - 1 != 0) && (worldRank == 0)) {
+            MPI_Status status;
+            int size;
 
-        // Send the best split candidate to all nodes
-        for (i = 1; i < mpiSize; i++) {
+            MPI_Probe(owner[i] - 1, TREE_TAG, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, MPI_CHAR, &size);
 
-            MPI_Send(&bestSplit.u.x, 1, MPI_INT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&bestSplit.u.y, 1, MPI_INT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&bestSplit.v.x, 1, MPI_INT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&bestSplit.v.y, 1, MPI_INT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&bestSplit.t, 1, MPI_FLOAT, i, 88, MPI_COMM_WORLD);
-            MPI_Send(&bestSplit.g, 1, MPI_FLOAT, i, 88, MPI_COMM_WORLD);
+            buffer.resize(size);
+            MPI_Recv(buffer.data(), size, MPI_CHAR, owner[i] - 1, TREE_TAG, 
+                     MPI_COMM_WORLD, &status);
 
+            arenas[treeID] = NodeArena::Ptr(new NodeArena());
+            trees[treeID] = unpackTree(buffer, *arenas[treeID]);
         }
+    }
 
-        // Sort train data given best split
-        idx = sortData (range, bestSplit);
+    MPI_Comm_free(&comm);
+    comm = MPI_COMM_WORLD;
 
-        // Temp range for the left node
-        tmpRange.start = range.start;
-        tmpRange.end = idx - 1;
+    compile();
+}
+
+/**
+ *  This function trains a tree with the processes of the group.
+ *
+ *  @param treeID of the tree, it defines the seeds of the tree.
+ *  @param images range of images of the tree.
+ */
+void rdf::RandomForest::trainTree(int treeID, NumRange images) {
+    int rank;
+    int startIdx;
+    int endIdx;
+    double startTime;
 
-        printf("rangos izq %d %d\n", tmpRange.start, tmpRange.end);
+    MPI_Comm_rank(comm, &rank);
 
-        nType = testNode (&left,
-                          currentNode,
-                          tmpRange);
-    
-        if (nType == SPLIT) {
-            // Check left node
+    startIdx = images.start;
+    endIdx = images.end;
 
-            ((SplitNode *) currentNode)->left_ = left;
+    // With an image cache the images of the tree are loaded in the
+    // background while the train data is sampled or broadcast.
+    image_pool->acquire(startIdx, endIdx);
 
-            // Build new node
-            ((SplitNode *) left)->parent_ = currentNode;
-            ((SplitNode *) left)->left_ = NULL;
-            ((SplitNode *) left)->right_ = NULL;
-            ((SplitNode *) left)->phi = SplitCandidate();
+    std::cout << "Tree " << treeID << std::endl;
+    std::cout << "Index start " << startIdx << std::endl;
+    std::cout << "Index end   " << endIdx << std::endl;
 
+    arena = NodeArena::Ptr(new NodeArena());
+    arenas[treeID] = arena;
 
-            // Labeling node
-            ((SplitNode *) left) -> id = nodeCount;
-            nodeCount++;
+    treeSeed = streamSeed(streamSeed(tp->seed, TREE_STREAM), treeID);
+    splitRound = 0;
 
-            nStack.push (left);
-            trainIdx.push (tmpRange);
-        } 
-        else if (nType == LEAF) {
-            
-            ((SplitNode*) currentNode)->left_ = left;
+    seedThreadRng(streamSeed(streamSeed(treeSeed, SAMPLE_STREAM), rank));
 
-            ((LeafNode*) left)->pDist = 
-                labelDistribution(tmpRange.start, tmpRange.end);
-                
-            // Labeling node
-            ((LeafNode*) left)->id = nodeCount;
-            nodeCount++;
+    stats.beginTree(treeID, rank == 0);
 
+    // In the data parallel mode every process samples its own shard.
+    if (tp -> distribution == DATA_PARALLEL) {
+        startTime = takeInitialTime();
+        td = TrainData::Ptr(new TrainData(tp->samplePixelNum, *image_pool, 
+                                          startIdx, endIdx, tp->sampleByLabel, 
+                                          pool.get()));
+        stats.addSample(takeInitialTime() - startTime);
+
+        if (image_pool->capacity() > 0) {
+            image_pool->densePlanes(planes);
         }
 
-        tmpRange.start = idx;
-        tmpRange.end = range.end;
+        trainSharded(treeID);
+        image_pool->release();
+        stats.endTree();
+        return;
+    }
 
-        nType = testNode (&right, 
-                          currentNode,
-                          tmpRange);
-    
-        if (nType == SPLIT) {
+    // Only the master process initialize the train data.
+    startTime = takeInitialTime();
+    if (rank == 0) {
+        td = TrainData::Ptr(new TrainData(tp->samplePixelNum, *image_pool, 
+                                          startIdx, endIdx, tp->sampleByLabel, 
+                                          pool.get()));
+    }
+    else {
+        td = TrainData::Ptr(new TrainData(endIdx - startIdx + 1, tp->samplePixelNum));
+    }
+    stats.addSample(takeInitialTime() - startTime);
 
-            ((SplitNode*)currentNode)->right_ = right;
+    // Synchronize the training data.
+    startTime = takeInitialTime();
+    broadcastTrainData(*td, 0, comm);
+    stats.addWait(takeInitialTime() - startTime);
 
-            // Build new node
-            ((SplitNode *) right)->parent_ = currentNode;
-            ((SplitNode *) right)->left_ = nullptr;
-            ((SplitNode *) right)->right_ = nullptr;
-            ((SplitNode *) right)->phi = SplitCandidate();
-            
-            // Labeling node
-            ((SplitNode *) right) -> id = nodeCount;
-            nodeCount++;
+    if (rank != 0) {
+        startTime = takeInitialTime();
+        td->cache(*image_pool, pool.get());
+        stats.addSample(takeInitialTime() - startTime);
+    }
 
-            nStack.push (right);
-            trainIdx.push (tmpRange);
-        } 
-        else if (nType == LEAF) {
-            
-            ((SplitNode*)currentNode)->right_ = right;
-            
-            ((LeafNode*) right)->pDist = labelDistribution(tmpRange.start, tmpRange.end);
-            
-            // Labeling node
-            ((LeafNode*) right)-> id = nodeCount;
-            nodeCount++;
+    if (image_pool->capacity() > 0) {
+        image_pool->densePlanes(planes);
+    }
 
+    if (rank == 0) {
 
+        if (tp -> growth == LEVEL_WISE_GROWTH) {
+            trainLevelWise(treeID);
+        }
+        else {
+            train(treeID);
         }
 
-        ((SplitNode *) currentNode) -> phi = bestSplit;
-        
+        // An empty set of ranges ends the tree in the workers.
+        std::vector<NumRange> done;
+        shareRanges(done);
+    }
+    else {
+        trainWorker();
     }
-}
 
+    image_pool->release();
+    stats.endTree();
+}
 
 /**
- *  This fuction visit all the nodes in a tree specified and
- *  print its content.
+ *  packTree
  *
- *  @param id of the tree.
+ *  Serializes a tree in preorder. Each node is its type, its id and either
+ *  the split candidate or the label distribution.
+ *
+ *  @param root of the tree.
+ *  @param buffer with the serialized tree.
  */
- //CHECK
-void rdf::RandomForest::traversal(int treeID) {   
-    printf ("TRAVERSAL TREE %d\n", treeID);
-    unsigned int i;
-    Node *root;
-    Node *currentNode;
-    Node *right;
-    Node *left;
-    
+void rdf::RandomForest::packTree(Node* root, std::vector<char>& buffer) {
     std::stack<Node*> nStack;
+    Node* currentNode;
 
-    root = trees[treeID];
+    auto put = [&buffer](const void* value, size_t size) {
+        buffer.insert(buffer.end(), (const char*) value, 
+                      (const char*) value + size);
+    };
+
+    buffer.clear();
     nStack.push(root);
 
     while (!nStack.empty()) {
         currentNode = nStack.top();
         nStack.pop();
 
-        
-        // Push left element second
-        left = ((SplitNode*)currentNode)->left_;
-
-        if (left -> nodeType() != LEAF) {
-            nStack.push(left);      
-        }
-        else {
+        const char type = currentNode->nodeType() == LEAF ? 'L' : 'S';
+        put(&type, sizeof(type));
+        put(&currentNode->id, sizeof(currentNode->id));
 
-            /*Imprimo lo de la hoja */
+        if (type == 'S') {
+            const SplitNode* split = (SplitNode*) currentNode;
+            const int offsets[] = {split->phi.u.x, split->phi.u.y, 
+                                   split->phi.v.x, split->phi.v.y};
 
-            printf ("probabilidades\n");
-            for (i = 0; i < ((LeafNode *)left) -> pDist.size(); i++) {
-                printf("%f ", ((LeafNode *)left) -> pDist[i]);
-            }
-            printf("\n");
-        }
-        
-        // Push right element first
-        right = ((SplitNode*)currentNode)->right_;
+            put(offsets, sizeof(offsets));
+            put(&split->phi.t, sizeof(split->phi.t));
+            put(&split->phi.g, sizeof(split->phi.g));
 
-        if ( right -> nodeType() != LEAF) {
-            nStack.push(right);
+            nStack.push(split->right_);
+            nStack.push(split->left_);
         }
         else {
-            
-            /* Imprimo lo de la hoja */
-            printf ("probabilidades\n");
-            for (i = 0; i < ((LeafNode *)right) -> pDist.size(); i++) {
-                printf("%f ", ((LeafNode *)right) -> pDist[i]);
-            }
-            printf("\n");
+            const LeafDistribution& pDist = ((LeafNode*) currentNode)->pDist;
+            const int size = pDist.size();
 
+            put(&size, sizeof(size));
+            put(pDist.data(), size * sizeof(float));
         }
     }
 }
 
-
-
 /**
- *  This function classify a pixel of a given image by the
- *  random forest.
+ *  unpackTree
  *
- *  @param pointer to the image.
- *  @param pixel to classofy
- *  @param probability of the classification.
- *  @return label of the classification
+ *  Rebuilds a tree serialized by packTree.
+ *
+ *  @param buffer with the serialized tree.
+ *
+ *  @return root of the tree.
  */
- //CHECK
-Label rdf::RandomForest::predict(Image* img, PixelInfo pixel, float& prob) {
-    int i;
-    unsigned int j;
-    Label maxLabel;
-    float maxProb;
-    float tmpProb;
+rdf::Node* rdf::RandomForest::unpackTree(
+    const std::vector<char>& buffer,
+    NodeArena& arena
+) {
+    size_t pos = 0;
+    char type;
+    int offsets[4];
+    int size;
 
-    Node *currentNode;
-    pixelSet ps;
+    Node* root = NULL;
+    Node* node;
+    SplitNode* parent;
 
-    SplitNode *sNode;
-    LeafNode *lNode;
+    // Split nodes waiting for their children, with the number of
+    // children already read.
+    std::stack<std::pair<SplitNode*, int> > nStack;
 
-    vector <float> postProb;
-    postProb.resize (tp -> labelNum, 0.0f);
+    auto get = [&buffer, &pos](void* value, size_t size) {
+        std::copy(&buffer[pos], &buffer[pos] + size, (char*) value);
+        pos += size;
+    };
 
-    for (i = 0; i < tp -> treeNum; i++ ) {
-        currentNode = trees[i];
-        
-               
-        // Drop pixel down the tree
-        while ( (currentNode -> nodeType()) != LEAF) {
-        
-            sNode = (SplitNode *) currentNode;
-            ps = classifyPixel (sNode -> phi, pixel, img);
-        
-            switch (ps) {
-                case RIGHT:
-                    currentNode = sNode->right_;
-                    break;
-
-                case LEFT:
-                    currentNode = sNode->left_;
-                    break;
-                default:
-                    printf("Error could not classify pixel\n");
-                    break;
-            }
-        
+    while (pos < buffer.size()) {
+        get(&type, sizeof(type));
+
+        if (type == 'S') {
+            SplitNode* split = arena.split();
+
+            get(&split->id, sizeof(split->id));
+            get(offsets, sizeof(offsets));
+            get(&split->phi.t, sizeof(split->phi.t));
+            get(&split->phi.g, sizeof(split->phi.g));
+
+            split->phi.u = Offset(offsets[0], offsets[1]);
+            split->phi.v = Offset(offsets[2], offsets[3]);
+
+            node = split;
         }
-    
-        lNode = (LeafNode *) currentNode;
-        
-        // Adds all the probabilities vector
-        for (j = 0; j < lNode -> pDist.size(); j++) {
-            postProb[j] += lNode -> pDist[j];
+        else {
+            int id;
+
+            get(&id, sizeof(id));
+            get(&size, sizeof(size));
+
+            LeafNode* leaf = arena.leaf(size);
+            leaf->id = id;
+            get(leaf->pDist.data(), size * sizeof(float));
+
+            node = leaf;
         }
-    }
-    
-    maxProb = 0.0;
-    tmpProb = 0.0;
-    
-    // Takes the label of the maximun probability
-    for (j = 0; j < postProb.size(); j++) {
-        tmpProb = postProb[j] / tp -> treeNum;
 
-        if (tmpProb > maxProb) {
-            maxProb = tmpProb;
-            maxLabel = j;
+        // Attach the node to the deepest split node with a free child
+        if (root == NULL) {
+            root = node;
         }
-    }
+        else {
+            parent = nStack.top().first;
 
-    prob = maxProb;
-    return maxLabel + 1;
-}
+            if (nStack.top().second++ == 0) {
+                parent->left_ = node;
+            }
+            else {
+                parent->right_ = node;
+                nStack.pop();
+            }
+
+            if (type == 'S') {
+                ((SplitNode*) node)->parent_ = parent;
+            }
+        }
 
+        if (type == 'S') {
+            nStack.push(std::make_pair((SplitNode*) node, 0));
+        }
+    }
 
+    return root;
+}
 
 /**
- *  This function start the training of the forest.
+ *  paramsFingerprint
  *
- *  @param maximum depth of the tree.
- *  @param maximum number of examples to build a leaf node.
- *  @param number of pixels of an image for the training set.
- *  @param number of images per tree.
- *  @param number of offsets to generate.
- *  @param number of thresholds to generate.
+ *  Hashes the training parameters that define the trees. It must be taken
+ *  before the numbers of offsets and thresholds are divided among the
+ *  processes of the group. The features drawn by each process depend on
+ *  the size of its group, so the number of processes and the size of
+ *  every group are hashed too.
  *
+ *  @return hash of the parameters.
  */
- //CHECK
-void rdf::RandomForest::trainForest(trainParams& tparams) {
-    unsigned i;
-    int j;
-    int rank;
-    int mpiSize;
-    int done;
-    int divFactor;
-    int trainImgNum;
-    int startIdx;
-    int endIdx;
-    MPI_Status status;
-
-    tp = &tparams;
-
-    // Load images from directory
-    image_pool = ImagePool::Ptr(new ImagePool (tp -> imgDir));
-    
-    // Obtain the rank and the number of processes in the MPI cluster.
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &mpiSize);
-
-    // Calculate the division factor for offsets and threshold numbers
-    //TODO: Acomodar la division de features
-    divFactor = sqrt(mpiSize);
-    tp -> offsetNum /= divFactor;
-    tp -> thresholdNum /= divFactor;
-    tp -> imgNum = image_pool->size();
-
-    std::vector<int> index_vector(tp->imgNum);
-    
-    if (rank == 0) {
-        index_vector = permutation(tp->imgNum);
+uint64_t rdf::RandomForest::paramsFingerprint() {
+    uint64_t h = streamSeed(CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+    int worldSize;
+    int groupNum;
+    int group;
+    size_t i;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+    groupNum = groupCount();
+
+    h = streamSeed(h, worldSize);
+    h = streamSeed(h, tp -> groupNum);
+
+    // Groups of consecutive ranks, like the split of beginTraining
+    std::vector<int64_t> groupSizes(groupNum, 0);
+    for (i = 0; i < (size_t) worldSize; i++) {
+        group = i * groupNum / worldSize;
+        groupSizes[group]++;
     }
-
-    // Synchronize the permutation of the indices.
-    for (auto& index : index_vector) {
-        MPI_Bcast(&index, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    for (i = 0; i < groupSizes.size(); i++) {
+        h = streamSeed(h, groupSizes[i]);
     }
-    
-    image_pool->poolReorder(index_vector);
-
-    trees.resize(tp -> treeNum, NULL);
-    trainImgNum = tp -> imgNum / tp -> treeNum;
-
-    startIdx = 0;
-    endIdx = 0;
-    //trainImgNum = tp -> trainImgNum;
 
-    //trainImgNum = 12;
+    const int64_t values[] = {
+        tp->treeNum, tp->labelNum, tp->maxDepth, tp->minSampleCount,
+        tp->samplePixelNum, tp->offsetNum, tp->thresholdNum,
+        tp->offsetRange.start, tp->offsetRange.end,
+        tp->thresholdRange.start, tp->thresholdRange.end,
+        tp->splitMode, tp->growth, tp->distribution, tp->sampleByLabel
+    };
 
-    for (i = 0; i < trees.size(); i++) {
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        h = streamSeed(h, values[i]);
+    }
 
-        // Setting the range of images which every tree is going to
-        // work with
+    for (i = 0; i < tp->imgDir.size(); i++) {
+        h = streamSeed(h, (unsigned char) tp->imgDir[i]);
+    }
 
-        // TODO: es probable que el ultimo arbol entrene con mas 
-        // imagenes que los anteriores, seria bueno ver como arreglar
-        // eso
+    return streamSeed(h, tp->seed);
+}
 
-        if (i != unsigned(tp -> treeNum - 1)) {
-            startIdx = i * trainImgNum;
-            endIdx = startIdx + trainImgNum - 1;
-        }
-        else{
-            startIdx = i * trainImgNum;
-            endIdx = image_pool->size() - 1;
-        }
-        
-        std::cout << "Tree " << i << std::endl;
-        std::cout << "Index start " << startIdx << std::endl;
-        std::cout << "Index end   " << endIdx << std::endl;
+/**
+ *  writeCheckpoint
+ *
+ *  Saves a finished tree as <checkpointDir>/<treeID>.ckpt.
+ *
+ *  @param treeID of the tree.
+ *  @param fingerprint of the training parameters.
+ */
+void rdf::RandomForest::writeCheckpoint(int treeID, uint64_t fingerprint) {
+    std::vector<char> buffer;
+    CheckpointHeader header;
+    FILE* fp;
 
+    std::stringstream fileName;
 
-        //startIdx = 0;
-        //endIdx = images -> poolSize() -1;
-        // Only the master process initialize the train data.
-        //TODO: recordar la forma de samplear los pixel (true para que
-        //sea por label.
-        if (rank == 0) {
-            td = TrainData::Ptr(new TrainData(tp->samplePixelNum, *image_pool, startIdx, endIdx, false));
-        }
-        else {
-            td = TrainData::Ptr(new TrainData(endIdx - startIdx + 1, tp->samplePixelNum));
-        }
+    fileName << tp->checkpointDir << "/" << treeID << CHECKPOINT_EXT;
+    const string name = fileName.str();
+    const string tmpName = name + ".tmp";
 
-        // Synchronize each pixel in the training data.
-        for (auto& pixel : *td) {
-            MPI_Bcast(&(pixel.id), 1, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
-            MPI_Bcast(&(pixel.x), 1, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
-            MPI_Bcast(&(pixel.y), 1, MPI_UNSIGNED_SHORT, 0, MPI_COMM_WORLD);
-        } 
+    packTree(trees[treeID], buffer);
 
-        if (rank == 0) {
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.fingerprint = fingerprint;
+    header.treeID = treeID;
+    header.size = buffer.size();
 
-            train(i);
+    if ((fp = fopen(tmpName.c_str(), "wb")) == NULL) {
+        printf("Cannot open file %s.\n", tmpName.c_str());
+        exit(1);
+    }
 
-            done = 42;
+    if ((fwrite(&header, sizeof(header), 1, fp) != 1) ||
+        (fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size()) ||
+        (fclose(fp) != 0)) {
+        printf("Cannot write file %s.\n", tmpName.c_str());
+        exit(1);
+    }
 
-            for (j = 1; j < mpiSize; j++) {
-                MPI_Send(&done, 1, MPI_INT, j, 86, MPI_COMM_WORLD);
-            }
-        }
-        else {
+    if (rename(tmpName.c_str(), name.c_str()) != 0) {
+        printf("Cannot rename file %s.\n", tmpName.c_str());
+        exit(1);
+    }
+}
 
-            NumRange range;
-            SplitCandidate bestSplit;
+/**
+ *  readCheckpoint
+ *
+ *  Loads a tree saved by writeCheckpoint. A missing checkpoint or one of
+ *  other parameters is not an error, the tree is trained again.
+ *
+ *  @param treeID of the tree.
+ *  @param fingerprint of the training parameters.
+ *
+ *  @return true if the tree was loaded.
+ */
+bool rdf::RandomForest::readCheckpoint(int treeID, uint64_t fingerprint) {
+    std::vector<char> buffer;
+    CheckpointHeader header;
+    FILE* fp;
+    bool valid;
 
-            done = 0;
-            while (!done) {
+    std::stringstream fileName;
 
-                // check to continue
-                MPI_Recv(&done, 1, MPI_INT, 0, 86, MPI_COMM_WORLD, &status);
+    fileName << tp->checkpointDir << "/" << treeID << CHECKPOINT_EXT;
+    const string name = fileName.str();
 
-                if (done) { break; }
+    if ((fp = fopen(name.c_str(), "rb")) == NULL) {
+        return false;
+    }
 
-                // Recive the range in where to look for a split candidate.
-                MPI_Recv(&range.start, 1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&range.end,   1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
+    valid = (fread(&header, sizeof(header), 1, fp) == 1) &&
+            (header.magic == CHECKPOINT_MAGIC) &&
+            (header.version == CHECKPOINT_VERSION) &&
+            (header.fingerprint == fingerprint) &&
+            (header.treeID == treeID) && (header.size > 0);
 
-                bestSplit = bestSplitThreadFun(range);
+    if (valid) {
+        buffer.resize(header.size);
+        valid = fread(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+    }
 
-                // Send the best split generated.
-                MPI_Send(&bestSplit.u.x, 1, MPI_INT, 0, 88, MPI_COMM_WORLD);
-                MPI_Send(&bestSplit.u.y, 1, MPI_INT, 0, 88, MPI_COMM_WORLD);
-                MPI_Send(&bestSplit.v.x, 1, MPI_INT, 0, 88, MPI_COMM_WORLD);
-                MPI_Send(&bestSplit.v.y, 1, MPI_INT, 0, 88, MPI_COMM_WORLD);
-                MPI_Send(&bestSplit.t, 1, MPI_FLOAT, 0, 88, MPI_COMM_WORLD);
-                MPI_Send(&bestSplit.g, 1, MPI_FLOAT, 0, 88, MPI_COMM_WORLD);
+    fclose(fp);
 
-                // Recive the best of the total.
-                MPI_Recv(&bestSplit.u.x, 1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&bestSplit.u.y, 1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&bestSplit.v.x, 1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&bestSplit.v.y, 1, MPI_INT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&bestSplit.t, 1, MPI_FLOAT, 0, 88, MPI_COMM_WORLD, &status);
-                MPI_Recv(&bestSplit.g, 1, MPI_FLOAT, 0, 88, MPI_COMM_WORLD, &status);
+    if (!valid) {
+        printf("Ignoring invalid checkpoint %s.\n", name.c_str());
+        return false;
+    }
 
-                // Sort the data with the best split candidate
-                sortData (range, bestSplit);
+    arenas[treeID] = NodeArena::Ptr(new NodeArena());
+    trees[treeID] = unpackTree(buffer, *arenas[treeID]);
 
-            }
-        }
-    }
+    return true;
 }
 
 /**
@@ -1122,7 +3014,7 @@ void rdf::RandomForest::loadNodeFromFile(
         fscanf (fp, "%d %d %d %d %f\n", &phi.u.x, 
                 &phi.u.y, &phi.v.x, &phi.v.y, &phi.t);
 
-        *sideNode = new SplitNode (phi);
+        *sideNode = arena->split(phi);
 
         ((SplitNode*) *sideNode) -> id = nodeID;
         if (currentNode != NULL) {
@@ -1145,7 +3037,7 @@ void rdf::RandomForest::loadNodeFromFile(
         fscanf (fp, "\n");   
 
         // Building node
-        *sideNode = new LeafNode (probs);
+        *sideNode = arena->leaf(probs);
         ((LeafNode *) *sideNode) -> id = nodeID;
     }
 
@@ -1189,6 +3081,8 @@ void rdf::RandomForest::loadTreeFromFile(const std::string& filename) {
 
     probs.resize(tp -> labelNum, 0.0);
 
+    arena = NodeArena::Ptr(new NodeArena());
+
     if ((fp = fopen(filename.c_str(), "r")) == NULL) {
         printf("Cannot open file %s.\n", filename.c_str());
         exit(1);
@@ -1218,6 +3112,7 @@ void rdf::RandomForest::loadTreeFromFile(const std::string& filename) {
     }
 
     trees.push_back(root);
+    arenas.push_back(arena);
     fclose(fp);
 }
 
@@ -1225,7 +3120,7 @@ void rdf::RandomForest::loadTreeFromFile(const std::string& filename) {
 
 /**
  *  Load the trees contained in a directory with the name
- *  "i.tree".
+ *  "i.tree", or "i-tree.txt" as in samples/trained_trees.
  *
  *  @param path to the directory
  */
@@ -1238,17 +3133,96 @@ void rdf::RandomForest::loadForest(
     int i;
     std::stringstream fileName;
 
-    tp = new trainParams();
+    ownParams.reset(new trainParams());
+    tp = ownParams.get();
     tp -> treeNum = numTrees;
     tp -> labelNum = numLabels;
 
+    trees.clear();
+    arenas.clear();
+
 
     for (i = 0; i < numTrees; i++) {
         fileName << dirname << "/" << i << ".tree";
+
+        if (access(fileName.str().c_str(), R_OK) != 0) {
+            fileName.str("");
+            fileName << dirname << "/" << i << "-tree.txt";
+        }
+
         loadTreeFromFile(fileName.str());
         fileName.flush();
         fileName.str("");
     }
+
+    compile();
+}
+
+/** \brief Writes the compiled forest to a binary forest file.
+ *
+ *  \param[in] fileName Path to the output file.
+ */
+void rdf::RandomForest::writeFlatForest(const std::string& fileName) {
+    if (flat.empty()) {
+        printf("No compiled forest to write into file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    printf("Saving forest into file %s\n", fileName.c_str());
+    flat.write(fileName);
+}
+
+/** \brief Maps a binary forest file.
+ *
+ *  \param[in] fileName Path to the binary forest.
+ */
+void rdf::RandomForest::loadFlatForest(const std::string& fileName) {
+    printf("Loading forest from file %s\n", fileName.c_str());
+    flat.map(fileName);
+
+    ownParams.reset(new trainParams());
+    tp = ownParams.get();
+    tp -> treeNum = flat.treeNum();
+    tp -> labelNum = flat.labels();
+
+    trees.clear();
+    arenas.clear();
+    quant.clear();
+    compile();
+}
+
+/** \brief Writes the quantized forest to a binary file.
+ *
+ *  \param[in] fileName Path to the output file.
+ */
+void rdf::RandomForest::writeQuantizedForest(const std::string& fileName) {
+    if (quant.empty()) {
+        printf("No quantized forest to write into file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    printf("Saving quantized forest into file %s\n", fileName.c_str());
+    quant.write(fileName);
+}
+
+/** \brief Maps a binary quantized forest file.
+ *
+ *  \param[in] fileName Path to the binary quantized forest.
+ */
+void rdf::RandomForest::loadQuantizedForest(const std::string& fileName) {
+    printf("Loading quantized forest from file %s\n", fileName.c_str());
+    quant.map(fileName);
+
+    ownParams.reset(new trainParams());
+    tp = ownParams.get();
+    tp -> treeNum = quant.treeNum();
+    tp -> labelNum = quant.labels();
+
+    // Drops the flattened trees of a previous forest
+    trees.clear();
+    arenas.clear();
+    flat.build(trees, tp -> labelNum);
+    compile();
 }
 
 /**
@@ -0,0 +1,258 @@
+/** \file ThreadPool.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file ThreadPool.h
+ */
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+#include <rdf/ThreadPool.h>
+
+namespace {
+
+/** \brief Arguments of the background threads. */
+struct WorkerArgs {
+    rdf::ThreadPool* pool;
+    int worker;
+};
+
+} // namespace
+
+
+/** \brief Constructor.
+ *  \param[in] threadNum Number of workers, 0 to use one per core.
+ */
+rdf::ThreadPool::ThreadPool(int threadNum)
+    : body(nullptr)
+    , generation(0)
+    , busy(0)
+    , stop(false) {
+    int i;
+
+    if (threadNum <= 0) {
+        threadNum = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    pthread_mutex_init(&jobMutex, NULL);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&jobReady, NULL);
+    pthread_cond_init(&jobDone, NULL);
+
+    threads.resize(threadNum - 1);
+    ranges.resize(threadNum);
+
+    for (auto& range : ranges) {
+        pthread_mutex_init(&range.mutex, NULL);
+        range.begin = 0;
+        range.end = 0;
+    }
+
+    for (i = 0; i < threadNum - 1; i++) {
+        WorkerArgs* args = new WorkerArgs;
+        args->pool = this;
+        args->worker = i + 1;
+
+        if (pthread_create(&threads[i], NULL, workerThread, args)) {
+            printf("Could not create worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/** \brief Stops and joins the worker threads. **/
+rdf::ThreadPool::~ThreadPool() {
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&mutex);
+
+    for (auto& thread : threads) {
+        pthread_join(thread, NULL);
+    }
+
+    for (auto& range : ranges) {
+        pthread_mutex_destroy(&range.mutex);
+    }
+
+    pthread_cond_destroy(&jobDone);
+    pthread_cond_destroy(&jobReady);
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&jobMutex);
+}
+
+
+/** \brief Runs body(i, worker) for every i in [0, n) across the workers and
+ *  returns when all the iterations are done.
+ *
+ *  \param[in] n Number of iterations.
+ *  \param[in] body Body of the loop.
+ */
+void rdf::ThreadPool::parallelFor(int n, const LoopBody& loopBody) {
+    int i;
+
+    if (n <= 0) {
+        return;
+    }
+
+    // Small loops or single worker pools run in the caller.
+    if ((n == 1) || threads.empty()) {
+        for (i = 0; i < n; i++) {
+            loopBody(i, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&jobMutex);
+
+    // Deal one contiguous range of iterations to each worker.
+    for (i = 0; i < size(); i++) {
+        ranges[i].begin = static_cast<int>((long) n * i / size());
+        ranges[i].end = static_cast<int>((long) n * (i + 1) / size());
+    }
+
+    pthread_mutex_lock(&mutex);
+    body = &loopBody;
+    busy = static_cast<int>(threads.size());
+    generation++;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&mutex);
+
+    work(0);
+
+    // Wait for the background threads to leave the job.
+    pthread_mutex_lock(&mutex);
+    while (busy > 0) {
+        pthread_cond_wait(&jobDone, &mutex);
+    }
+    body = nullptr;
+    pthread_mutex_unlock(&mutex);
+
+    pthread_mutex_unlock(&jobMutex);
+}
+
+
+/** \brief Runs iterations of the current job until none is left.
+ *  \param[in] worker Index of the worker.
+ */
+void rdf::ThreadPool::work(int worker) {
+    int i;
+
+    do {
+        while (pop(worker, i)) {
+            (*body)(i, worker);
+        }
+    } while (steal(worker));
+}
+
+
+/** \brief Takes the next iteration of the range of a worker.
+ *  \return false if the range is empty.
+ */
+bool rdf::ThreadPool::pop(int worker, int& i) {
+    bool found = false;
+    WorkRange& range = ranges[worker];
+
+    pthread_mutex_lock(&range.mutex);
+    if (range.begin < range.end) {
+        i = range.begin++;
+        found = true;
+    }
+    pthread_mutex_unlock(&range.mutex);
+
+    return found;
+}
+
+
+/** \brief Moves the back half of the largest range to the range of a
+ *  worker.
+ *  \return false if there was nothing left to steal.
+ */
+bool rdf::ThreadPool::steal(int worker) {
+    int i;
+    int victim;
+    int left;
+    int begin;
+    int end;
+
+    while (true) {
+        // Look for the victim with the most iterations left.
+        victim = -1;
+        left = 0;
+        for (i = 0; i < size(); i++) {
+            if (i == worker) {
+                continue;
+            }
+
+            pthread_mutex_lock(&ranges[i].mutex);
+            if (ranges[i].end - ranges[i].begin > left) {
+                victim = i;
+                left = ranges[i].end - ranges[i].begin;
+            }
+            pthread_mutex_unlock(&ranges[i].mutex);
+        }
+
+        if (victim < 0) {
+            return false;
+        }
+
+        // The victim may have advanced since, take half of what is left.
+        WorkRange& from = ranges[victim];
+
+        pthread_mutex_lock(&from.mutex);
+        left = from.end - from.begin;
+        begin = from.end - (left + 1) / 2;
+        end = from.end;
+        if (left > 0) {
+            from.end = begin;
+        }
+        pthread_mutex_unlock(&from.mutex);
+
+        if (left > 0) {
+            // Nobody steals from an empty range, so the own range can be
+            // set once the victim is released.
+            pthread_mutex_lock(&ranges[worker].mutex);
+            ranges[worker].begin = begin;
+            ranges[worker].end = end;
+            pthread_mutex_unlock(&ranges[worker].mutex);
+            return true;
+        }
+    }
+}
+
+
+/** \brief Main loop of the background threads. */
+void* rdf::ThreadPool::workerThread(void* args) {
+    ThreadPool& pool = *(((WorkerArgs*) args)->pool);
+    const int worker = ((WorkerArgs*) args)->worker;
+    unsigned seen = 0;
+
+    delete (WorkerArgs*) args;
+
+    while (true) {
+        pthread_mutex_lock(&pool.mutex);
+        while (!pool.stop && (pool.generation == seen)) {
+            pthread_cond_wait(&pool.jobReady, &pool.mutex);
+        }
+        if (pool.stop) {
+            pthread_mutex_unlock(&pool.mutex);
+            break;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.mutex);
+
+        pool.work(worker);
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.jobDone);
+        }
+        pthread_mutex_unlock(&pool.mutex);
+    }
+
+    return NULL;
+}
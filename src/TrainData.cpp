@@ -1,43 +1,211 @@
 #include <rdf/TrainData.h>
+#include <algorithm>
 
 
 /** \brief Constructor.
  *
  *  Sample random points from the range specified of images in the pool.
  *
- *  \param[in] numPixels Number of pixels to sample.
- *  \param[in] startIdx Index from the Impage Pool.
- *  \param[in] endIdx 
- *  \param[in] byLabel  
+ *  \param[in] numPixels Number of pixels per image.
+ *  \param[in] imgPool Image pool to sample.
+ *  \param[in] startIdx Index of the first image.
+ *  \param[in] endIdx Index of the last image.
+ *  \param[in] byLabel Whether to stratify the pixels by label.
+ *  \param[in] pool Thread pool to use, nullptr to run in the calling
+ *  thread.
  */
 rdf::TrainData::TrainData(
     int numPixels,
     ImagePool& imgPool,
     int startIdx,
     int endIdx,
-    bool byLabel) {
+    bool byLabel,
+    ThreadPool* pool) {
 
-    int j;
-    int imgIdx;
-    uint32_t row;
-    uint32_t col;
-    vector <PixelInfo> pix;
-    
-    // iterates through image pool and get numImg subset of
-    // them, then takes numPixels from the current image
-    for (imgIdx = startIdx; imgIdx <= endIdx; imgIdx++) {
+    int k;
+    const int imgNum = std::max(endIdx - startIdx + 1, 0);
+    const uint64_t seed = threadRng()();
+
+    std::vector<int> counts(imgNum, 0);
+    std::vector<std::vector<unsigned>> scratch(pool ? pool->size() : 1);
+
+    pixels.resize(size_t(imgNum) * numPixels);
+    labels.resize(pixels.size());
+    depths.resize(pixels.size());
+
+    // Each image fills its own slice with its own generator
+    auto sample = [&](int k, int worker) {
+        const TrainImage& img = imgPool[startIdx + k];
+        const size_t first = size_t(k) * numPixels;
+        Rng rng(streamSeed(seed, k));
+        size_t i;
+
+        counts[k] = img.samplePixels(numPixels, byLabel, startIdx + k, rng, 
+                                     &pixels[first], scratch[worker]);
+
+        for (i = first; i < first + counts[k]; i++) {
+            labels[i] = img.getLabel(pixels[i].x, pixels[i].y);
+            depths[i] = img.getDepth(pixels[i].x, pixels[i].y);
+        }
+    };
+
+    if (pool != nullptr) {
+        pool->parallelFor(imgNum, sample);
+    }
+    else {
+        for (k = 0; k < imgNum; k++) {
+            sample(k, 0);
+        }
+    }
+
+    // Close the gaps of the images without pixels
+    if (std::find(counts.begin(), counts.end(), 0) != counts.end()) {
+        size_t n = 0;
+
+        for (k = 0; k < imgNum; k++) {
+            const size_t first = size_t(k) * numPixels;
 
-        if (byLabel == true) {
-            imgPool[imgIdx].getRandCoordByLabel(numPixels, pix, imgIdx);
-            pixels.insert(pixels.end(), pix.begin(), pix.end());
+            std::copy(pixels.begin() + first, pixels.begin() + first + counts[k], 
+                      pixels.begin() + n);
+            std::copy(labels.begin() + first, labels.begin() + first + counts[k], 
+                      labels.begin() + n);
+            std::copy(depths.begin() + first, depths.begin() + first + counts[k], 
+                      depths.begin() + n);
+            n += counts[k];
+        }
+
+        pixels.resize(n);
+        labels.resize(n);
+        depths.resize(n);
+    }
+}
 
+
+/** \brief Caches the label and the depth of every pixel.
+ *
+ *  \param[in] imgPool Image pool the pixels belong to.
+ *  \param[in] pool Thread pool to use, nullptr to run in the calling
+ *  thread.
+ */
+void rdf::TrainData::cache(ImagePool& imgPool, ThreadPool* pool) {
+    const int n = pixels.size();
+    const int taskSize = PARTITION_TASK_SIZE;
+    const int taskNum = (n + taskSize - 1) / taskSize;
+    int t;
+
+    labels.resize(pixels.size());
+    depths.resize(pixels.size());
+
+    auto fill = [&](int t, int) {
+        const int end = std::min(n, (t + 1) * taskSize);
+
+        for (int i = t * taskSize; i < end; i++) {
+            labels[i] = imgPool.getLabel(pixels[i]);
+            depths[i] = imgPool.getDepth(pixels[i]);
+        }
+    };
+
+    if ((pool != nullptr) && (taskNum > 1)) {
+        pool->parallelFor(taskNum, fill);
+    }
+    else {
+        for (t = 0; t < taskNum; t++) {
+            fill(t, 0);
+        }
+    }
+}
+
+
+/** \brief Partitions a range of pixels with a bitmask of their sides.
+ *
+ *  \param[in] range Range of the pixels to partition.
+ *  \param[in] mask Bitmask with a set bit for the pixels of the left side.
+ *  \param[in] maskStart Bit of the mask of the first pixel.
+ *  \param[in] pool Thread pool to use, nullptr to run in the calling thread.
+ *  \return Index of the first pixel of the right side.
+ */
+int rdf::TrainData::partition(
+    NumRange range,
+    const std::vector<uint8_t>& mask,
+    int maskStart,
+    ThreadPool* pool) {
+
+    const int n = range.end - range.start + 1;
+
+    if (n <= 0) {
+        return range.start;
+    }
+
+    const int taskSize = PARTITION_TASK_SIZE;
+    const int taskNum = (pool != nullptr && n >= 2 * taskSize) 
+        ? (n + taskSize - 1) / taskSize : 1;
+    const int chunk = (n + taskNum - 1) / taskNum;
+
+    std::vector<int> lefts(taskNum + 1, 0);
+    std::vector<int> rights(taskNum + 1, 0);
+    std::vector<int> index(n);
+    std::vector<PixelInfo> pix(n);
+    std::vector<Label> lab(n);
+    std::vector<unsigned> dep(n);
+
+    auto isLeft = [&](int k) {
+        const int b = maskStart + k;
+        return (mask[b >> 3] >> (b & 7)) & 1;
+    };
+    
+    auto run = [&](const ThreadPool::LoopBody& body) {
+        if (taskNum > 1) {
+            pool->parallelFor(taskNum, body);
         } else {
-            for (j = 0; j < numPixels; j++) {
+            body(0, 0);
+        }
+    };
 
-                imgPool[imgIdx].getRandomCoord(row, col);
-                pixels.push_back(PixelInfo(row, col, imgIdx));
+    // Count the pixels of each side in every task
+    run([&](int t, int) {
+        const int end = std::min(n, (t + 1) * chunk);
+        int count = 0;
 
-            }
+        for (int k = t * chunk; k < end; k++) {
+            count += isLeft(k);
         }
+        lefts[t + 1] = count;
+        rights[t + 1] = end - t * chunk - count;
+    });
+
+    // The left side goes first, then the right side, in task order
+    for (int t = 0; t < taskNum; t++) {
+        lefts[t + 1] += lefts[t];
+        rights[t + 1] += rights[t];
     }
+
+    const int leftNum = lefts[taskNum];
+
+    run([&](int t, int) {
+        const int end = std::min(n, (t + 1) * chunk);
+        int l = lefts[t];
+        int r = leftNum + rights[t];
+
+        for (int k = t * chunk; k < end; k++) {
+            index[isLeft(k) ? l++ : r++] = k;
+        }
+    });
+
+    // Gather the pixels and their cached values once through the index
+    run([&](int t, int) {
+        const int end = std::min(n, (t + 1) * chunk);
+
+        for (int k = t * chunk; k < end; k++) {
+            const int i = range.start + index[k];
+            pix[k] = pixels[i];
+            lab[k] = labels[i];
+            dep[k] = depths[i];
+        }
+    });
+
+    std::copy(pix.begin(), pix.end(), pixels.begin() + range.start);
+    std::copy(lab.begin(), lab.end(), labels.begin() + range.start);
+    std::copy(dep.begin(), dep.end(), depths.begin() + range.start);
+
+    return range.start + leftNum;
 }
@@ -0,0 +1,344 @@
+/** \file TrainStats.cpp
+ *
+ *  \brief This file contain the definition of the functions from the
+ *  file TrainStats.h
+ */
+#include <algorithm>
+#include <stdio.h>
+
+#include <rdf/TrainStats.h>
+
+namespace {
+
+/** \brief Gathers the records of every process in the rank 0.
+ *  \param[in] local Records of the process.
+ *  \param[out] all Records of every process in rank order, only in the
+ *  rank 0.
+ *  \param[in] comm Communicator.
+ */
+template <typename T>
+void gatherRecords(const std::vector<T>& local, std::vector<T>& all, MPI_Comm comm) {
+    int rank;
+    int size;
+    int i;
+    const int bytes = local.size() * sizeof(T);
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    std::vector<int> counts(size);
+    std::vector<int> displs(size + 1, 0);
+
+    MPI_Gather(&bytes, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+
+    for (i = 0; i < size; i++) {
+        displs[i + 1] = displs[i] + counts[i];
+    }
+
+    all.resize((rank == 0) ? displs[size] / sizeof(T) : 0);
+
+    MPI_Gatherv(local.data(), bytes, MPI_BYTE, all.data(), counts.data(),
+                displs.data(), MPI_BYTE, 0, comm);
+}
+
+} // namespace
+
+
+rdf::TrainStats::TrainStats() {
+    reset(0, 0, false);
+}
+
+
+/** \brief Starts the statistics of a training.
+ *  \param[in] rank Rank of the process in MPI_COMM_WORLD.
+ *  \param[in] group Group of processes of the process.
+ *  \param[in] progress Whether the leaders print the progress.
+ */
+void rdf::TrainStats::reset(int rank, int group, bool progress) {
+    rs = RankStats();
+    rs.rank = rank;
+    rs.group = group;
+
+    treeLog.clear();
+    nodeLog.clear();
+
+    this->progress = progress;
+    leader = false;
+    start = takeInitialTime();
+
+    treeID = -1;
+    firstNode = 0;
+    roundSort = 0.0;
+    roundWait = 0.0;
+}
+
+
+/** \brief Starts the statistics of a tree.
+ *  \param[in] treeID Id of the tree.
+ *  \param[in] leader Whether the process records the nodes.
+ */
+void rdf::TrainStats::beginTree(int treeID, bool leader) {
+    this->treeID = treeID;
+    this->leader = leader;
+
+    firstNode = nodeLog.size();
+    treeStart = takeInitialTime();
+    lastPrint = treeStart;
+
+    // The times of the tree are the increments of the process summary
+    current = TreeStats();
+    current.tree = treeID;
+    current.rank = rs.rank;
+    current.group = rs.group;
+    current.sample = rs.sample;
+    current.search = rs.search;
+    current.sort = rs.sort;
+    current.wait = rs.wait;
+}
+
+
+/** \brief Ends the current tree and adds its summary. */
+void rdf::TrainStats::endTree() {
+    const double now = takeInitialTime();
+    size_t i;
+
+    rs.trees++;
+    rs.time = now - start;
+
+    if (!leader) {
+        return;
+    }
+
+    current.time = now - treeStart;
+    current.sample = rs.sample - current.sample;
+    current.search = rs.search - current.search;
+    current.sort = rs.sort - current.sort;
+    current.wait = rs.wait - current.wait;
+
+    for (i = firstNode; i < nodeLog.size(); i++) {
+        current.nodes++;
+        current.leaves += nodeLog[i].leaf;
+        current.depth = std::max(current.depth, nodeLog[i].depth);
+    }
+
+    if (firstNode < nodeLog.size()) {
+        current.pixels = nodeLog[firstNode].pixels;
+    }
+
+    treeLog.push_back(current);
+
+    if (progress) {
+        printProgress("done");
+    }
+}
+
+
+/** \brief Records a new node of the current tree.
+ *  \param[in] id Id of the node in the tree, from 1.
+ *  \param[in] depth Depth of the node, 0 for the root.
+ *  \param[in] pixels Pixels of the node in the cluster.
+ *  \param[in] leaf Whether the node is a leaf.
+ */
+void rdf::TrainStats::node(unsigned id, int depth, uint64_t pixels, bool leaf) {
+    if (!leader) {
+        return;
+    }
+
+    NodeStats n = NodeStats();
+    n.tree = treeID;
+    n.id = id;
+    n.depth = depth;
+    n.leaf = leaf;
+    n.pixels = pixels;
+
+    nodeLog.push_back(n);
+}
+
+
+/** \brief Starts a round of split search.
+ *  \param[in] nodes Number of nodes split in the round.
+ */
+void rdf::TrainStats::beginRound(unsigned nodes) {
+    roundSearch.assign(nodes, 0.0);
+    roundSort = 0.0;
+    roundWait = 0.0;
+}
+
+
+/** \brief Ends a round of split search of the leader.
+ *  \param[in] ids Ids of the nodes split in the round.
+ *  \param[in] gains Gain of the best candidate of each node.
+ *  \param[in] candidates Candidates evaluated per node in the cluster.
+ */
+void rdf::TrainStats::endRound(
+    const std::vector<unsigned>& ids,
+    const std::vector<float>& gains,
+    uint64_t candidates
+) {
+    uint64_t pixels = 0;
+    size_t k;
+
+    if (!leader) {
+        return;
+    }
+
+    for (k = 0; k < ids.size(); k++) {
+        pixels += nodeLog[firstNode + ids[k] - 1].pixels;
+    }
+
+    for (k = 0; k < ids.size(); k++) {
+        NodeStats& n = nodeLog[firstNode + ids[k] - 1];
+        const double share = (pixels > 0) ? double(n.pixels) / pixels
+                                          : 1.0 / ids.size();
+
+        n.candidates = candidates;
+        n.gain = gains[k];
+        n.search = roundSearch[k];
+        n.sort = roundSort * share;
+        n.wait = roundWait * share;
+    }
+
+    if (progress && (takeInitialTime() - lastPrint >= TRAIN_PROGRESS_PERIOD)) {
+        printProgress("training");
+    }
+}
+
+
+/** \brief Adds the wall time of a split search.
+ *  \param[in] seconds Wall time.
+ *  \param[in] candidates Candidates scored by the process.
+ *  \param[in] evaluations Pairs of candidate and pixel scored.
+ */
+void rdf::TrainStats::addSearch(
+    double seconds,
+    uint64_t candidates,
+    uint64_t evaluations
+) {
+    rs.search += seconds;
+    rs.candidates += candidates;
+    rs.evaluations += evaluations;
+}
+
+
+/** \brief Adds the wall time of a partition of the train data. */
+void rdf::TrainStats::addSort(double seconds) {
+    rs.sort += seconds;
+    roundSort += seconds;
+}
+
+
+/** \brief Adds the wall time blocked in collective calls. */
+void rdf::TrainStats::addWait(double seconds) {
+    rs.wait += seconds;
+    roundWait += seconds;
+}
+
+
+/** \brief Adds the wall time of the sampling of the train data. */
+void rdf::TrainStats::addSample(double seconds) {
+    rs.sample += seconds;
+}
+
+
+/** \brief Prints the size and the time of the current tree. */
+void rdf::TrainStats::printProgress(const char* state) {
+    const double now = takeInitialTime();
+    size_t i;
+    unsigned leaves = 0;
+    int depth = 0;
+
+    for (i = firstNode; i < nodeLog.size(); i++) {
+        leaves += nodeLog[i].leaf;
+        depth = std::max(depth, nodeLog[i].depth);
+    }
+
+    printf("[rank %d] tree %d %s: %u nodes, %u leaves, depth %d, %.2f s, "
+           "%.3g evaluations/s\n", rs.rank, treeID, state,
+           unsigned(nodeLog.size() - firstNode), leaves, depth,
+           now - treeStart, (rs.search > 0.0) ? rs.evaluations / rs.search : 0.0);
+    fflush(stdout);
+
+    lastPrint = now;
+}
+
+
+/** \brief Writes the statistics of every process to a JSON file.
+ *  \param[in] fileName Path of the file.
+ *  \param[in] world Communicator of all the processes.
+ */
+void rdf::TrainStats::write(const std::string& fileName, MPI_Comm world) {
+    int rank;
+    size_t i;
+    FILE* fp;
+
+    std::vector<RankStats> ranks;
+    std::vector<TreeStats> trees;
+    std::vector<NodeStats> nodes;
+
+    MPI_Comm_rank(world, &rank);
+
+    rs.time = takeInitialTime() - start;
+
+    gatherRecords(std::vector<RankStats>(1, rs), ranks, world);
+    gatherRecords(treeLog, trees, world);
+    gatherRecords(nodeLog, nodes, world);
+
+    if (rank != 0) {
+        return;
+    }
+
+    // The trees of the groups come in rank order
+    std::stable_sort(trees.begin(), trees.end(),
+        [](const TreeStats& a, const TreeStats& b) { return a.tree < b.tree; });
+    std::stable_sort(nodes.begin(), nodes.end(),
+        [](const NodeStats& a, const NodeStats& b) { return a.tree < b.tree; });
+
+    if ((fp = fopen(fileName.c_str(), "w")) == NULL) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    fprintf(fp, "{\n\"ranks\": [\n");
+    for (i = 0; i < ranks.size(); i++) {
+        const RankStats& r = ranks[i];
+
+        fprintf(fp, "  {\"rank\": %d, \"group\": %d, \"trees\": %u, "
+                "\"candidates\": %llu, \"evaluations\": %llu, \"time\": %.6f, "
+                "\"sample\": %.6f, \"search\": %.6f, \"sort\": %.6f, "
+                "\"wait\": %.6f}%s\n", r.rank, r.group, r.trees,
+                (unsigned long long) r.candidates,
+                (unsigned long long) r.evaluations, r.time, r.sample,
+                r.search, r.sort, r.wait, (i + 1 < ranks.size()) ? "," : "");
+    }
+
+    fprintf(fp, "],\n\"trees\": [\n");
+    for (i = 0; i < trees.size(); i++) {
+        const TreeStats& t = trees[i];
+
+        fprintf(fp, "  {\"tree\": %d, \"rank\": %d, \"group\": %d, "
+                "\"nodes\": %u, \"leaves\": %u, \"depth\": %d, "
+                "\"pixels\": %llu, \"time\": %.6f, \"sample\": %.6f, "
+                "\"search\": %.6f, \"sort\": %.6f, \"wait\": %.6f}%s\n",
+                t.tree, t.rank, t.group, t.nodes, t.leaves, t.depth,
+                (unsigned long long) t.pixels, t.time, t.sample, t.search,
+                t.sort, t.wait, (i + 1 < trees.size()) ? "," : "");
+    }
+
+    fprintf(fp, "],\n\"nodes\": [\n");
+    for (i = 0; i < nodes.size(); i++) {
+        const NodeStats& n = nodes[i];
+
+        fprintf(fp, "  {\"tree\": %d, \"id\": %u, \"depth\": %d, "
+                "\"leaf\": %s, \"pixels\": %llu, \"candidates\": %llu, "
+                "\"gain\": %.6g, \"search\": %.6f, \"sort\": %.6f, "
+                "\"wait\": %.6f}%s\n", n.tree, n.id, n.depth,
+                n.leaf ? "true" : "false", (unsigned long long) n.pixels,
+                (unsigned long long) n.candidates, n.gain, n.search, n.sort,
+                n.wait, (i + 1 < nodes.size()) ? "," : "");
+    }
+
+    fprintf(fp, "]\n}\n");
+    fclose(fp);
+
+    printf("Training statistics saved in %s\n", fileName.c_str());
+}
@@ -1,5 +1,62 @@
 #include <rdf/common.h>
 
+/** \brief Next output of a splitmix64 generator.
+ *
+ *  \param[in,out] x State of the generator.
+ *  \return The random number generated.
+ */
+static uint64_t splitmix64(uint64_t& x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/** \brief Restarts the generator from a seed.
+ *
+ *  \param[in] s Seed of the generator.
+ */
+void Rng::seed(uint64_t s)
+{
+    for (int i = 0; i < 4; i++) {
+        state[i] = splitmix64(s);
+    }
+}
+
+/** \brief Derives the seed of an independent stream.
+ *
+ *  \param[in] parent Seed of the parent stream.
+ *  \param[in] id Identifier of the stream among its siblings.
+ *  \return The seed of the stream.
+ */
+uint64_t streamSeed(uint64_t parent, uint64_t id)
+{
+    uint64_t x = parent ^ splitmix64(id);
+    return splitmix64(x);
+}
+
+/** \brief Returns the generator of the calling thread.
+ *
+ *  \return The generator.
+ */
+Rng& threadRng()
+{
+    static std::atomic<uint64_t> threadCount(0);
+    thread_local Rng rng(streamSeed(1, threadCount++));
+
+    return rng;
+}
+
+/** \brief Restarts the generator of the calling thread.
+ *
+ *  \param[in] seed Seed of the generator.
+ */
+void seedThreadRng(uint64_t seed)
+{
+    threadRng().seed(seed);
+}
+
 /**
  *  randFloat
  *
@@ -12,7 +69,7 @@
  */
 float randFloat(NumRange r)
 {
-    double scaled = (double) rand() / (double)((unsigned)RAND_MAX + 1);
+    double scaled = threadRng().uniform();
     return r.start + r.size() * scaled;
 }
 
@@ -54,6 +111,9 @@ void takeFinalTime(double t_initial)
 
 
 /** \brief Return an unsorted vector of indices
+ *
+ *  The Fisher-Yates shuffle is written out, so the order only depends on
+ *  the seed of the generator and not on the standard library.
  *
  *  \param[in] size Size of the resulting vector of indices.
  *  \return An unordered vector of indices of the specified size.
@@ -65,12 +125,26 @@ std::vector<int> permutation(const int size) {
     std::iota(std::begin(indices), std::end(indices), 0);
 
     // Shuffle the indices randomly
-    std::random_shuffle(std::begin(indices), std::end(indices));
+    for (int i = size - 1; i > 0; i--) {
+        std::swap(indices[i], indices[threadRng().below(i + 1)]);
+    }
 
     return indices;
 }
 
 
+/** \brief Checks the extension of a file name.
+ *
+ *  \param[in] fileName The file name.
+ *  \param[in] ext The extension, including the dot.
+ *  \return true if the file name ends with the extension.
+ */
+bool hasExtension(const std::string& fileName, const std::string& ext) {
+    return (fileName.size() >= ext.size()) && 
+        (fileName.compare(fileName.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+
 /**
  * Convert to real world coordinates.
  */
@@ -2,26 +2,122 @@
 #include "libfreenect-registration.h"
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 
 # include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include <rdf/common.h>
+#include <rdf/FrameClassifier.h>
+#include <rdf/FrameRing.h>
+#include <rdf/Image.h>
+#include <rdf/LabelFilter.h>
+#include <rdf/RandomForest.h>
+
 
 #define MAX_NUM_DEV 3
 
+/**
+ *  Number of frames classified between two prints of the statistics.
+ */
+#define STATS_PERIOD 300
+
+/**
+ *  Connected components of at most this many pixels are repainted with
+ *  the label around them, 0 to disable the filter.
+ */
+#define MIN_COMPONENT_SIZE 64
+
 using namespace std;
 using namespace cv;
 
-int outputs[MAX_NUM_DEV];
+/**
+ *  Depth frame copied from the libfreenect buffer, with the time of each
+ *  stage it went through.
+ */
+struct DepthFrame {
+    rdf::PaddedDepthImage img;
+    uint32_t timestamp;
+    double captured;
+    double queued;
+};
+
+/**
+ *  Running statistics of the latency of a pipeline stage, in seconds.
+ */
+struct StageStats {
+    double sum;
+    double max;
+    uint64_t n;
+
+    StageStats() : sum(0.0), max(0.0), n(0) {}
+
+    void add(double t) {
+        sum += t;
+        max = (t > max) ? t : max;
+        n++;
+    }
+
+    double mean() const { return (n > 0) ? sum / n : 0.0; }
+};
+
+/**
+ *  Latency of the stages of a device: copy of the frame in the callback,
+ *  wait in the ring, classification, label smoothing and the whole
+ *  pipeline.
+ */
+struct DeviceStats {
+    StageStats copy;
+    StageStats wait;
+    StageStats classify;
+    StageStats filter;
+    StageStats total;
+};
 
 pthread_t freenect_thread[MAX_NUM_DEV];
+pthread_t classifier_thread;
 
 freenect_context* f_ctx;
 freenect_device* f_dev[MAX_NUM_DEV];
 
+/**
+ *  Ring between the callback and the classifier of each device.
+ */
+rdf::FrameRing<DepthFrame>* rings[MAX_NUM_DEV];
+
+/**
+ *  Last label map classified of each device.
+ */
+vector<Label> labelMaps[MAX_NUM_DEV];
+
+/**
+ *  Latency statistics of each device, only touched by the classifier.
+ */
+DeviceStats stats[MAX_NUM_DEV];
+
+/**
+ *  Posted once per published frame to wake up the classifier.
+ */
+sem_t framesReady;
+
+/**
+ *  Backend that evaluates the forest on the frames.
+ */
+rdf::FrameClassifier::Ptr classifier;
+
+/**
+ *  Post-processing of the label maps, sharing the workers of the forest.
+ */
+rdf::LabelFilter::Ptr filter;
+
+int minComponentSize = MIN_COMPONENT_SIZE;
+
 /**
  *  Number of devices detected.
  */
@@ -32,37 +128,133 @@ int nr_devices;
  */
 volatile int term = 0;
 
+/**
+ *  Copies the frame in the ring of its device. The frame is dropped if the
+ *  classifier is behind and the ring is full.
+ */
 void depth_cb(freenect_device* dev, void* v_depth, uint32_t timestamp) {
+    const double captured = takeInitialTime();
     int i;
-    int j;
-    uint16_t *depth = (uint16_t*)v_depth;
-
-    IplImage *img = cvCreateImage(cvSize(640, 480),IPL_DEPTH_8U,3);
-    cvZero(img);
 
     for (i = 0; i < nr_devices; i++) {
         if (f_dev[i] == dev) {
-            outputs[i] = depth[155840];
+            break;
         }
-        //printf("Kinect %d: %d  ", i, outputs[i]);
     }
-    for (i = 0; i < 480; i++) {
-        for (j = 0; j < 640; j++) {
-            cvSet2D(img,i,j,CV_RGB(0,0,0));
+    if (i == nr_devices) {
+        return;
+    }
+
+    DepthFrame* frame = rings[i] -> claim();
+    if (frame == NULL) {
+        return;
+    }
+
+    frame -> img.assign((const unsigned short*)v_depth);
+    frame -> timestamp = timestamp;
+    frame -> captured = captured;
+    frame -> queued = takeInitialTime();
+
+    rings[i] -> publish();
+    sem_post(&framesReady);
+}
+
+/**
+ *  Prints the latency of each stage of a device in milliseconds.
+ */
+void printStats(int i) {
+    const DeviceStats& s = stats[i];
+
+    printf("Kinect %d: %llu frames, %llu dropped | "
+           "copy %.2f/%.2f wait %.2f/%.2f classify %.2f/%.2f "
+           "filter %.2f/%.2f total %.2f/%.2f ms (mean/max)\n",
+           i,
+           (unsigned long long)s.total.n,
+           (unsigned long long)rings[i] -> dropped(),
+           s.copy.mean() * 1e3, s.copy.max * 1e3,
+           s.wait.mean() * 1e3, s.wait.max * 1e3,
+           s.classify.mean() * 1e3, s.classify.max * 1e3,
+           s.filter.mean() * 1e3, s.filter.max * 1e3,
+           s.total.mean() * 1e3, s.total.max * 1e3);
+}
+
+/**
+ *  Classifies the frames of every device as they are published. Each
+ *  wakeup takes the oldest frame of every device that has one and
+ *  classifies them as one batch, so several cameras share the parallel
+ *  loops of the classifier.
+ */
+void *classifier_threadfunc(void*) {
+    size_t k;
+
+    vector<int> batch;
+    vector<const rdf::PaddedDepthImage*> imgs;
+    vector<Label*> labels;
+    vector<float*> probs;
+
+    while (true) {
+        sem_wait(&framesReady);
+
+        if (term) {
+            break;
+        }
+
+        batch.clear();
+        imgs.clear();
+        labels.clear();
+
+        for (int i = 0; i < nr_devices; i++) {
+            DepthFrame* frame = rings[i] -> front();
+
+            if (frame != NULL) {
+                batch.push_back(i);
+                imgs.push_back(&frame -> img);
+                labels.push_back(labelMaps[i].data());
+            }
+        }
+
+        // The posts of the other frames of a batch wake up to empty rings
+        if (batch.empty()) {
+            continue;
+        }
+
+        probs.assign(batch.size(), nullptr);
+
+        const double start = takeInitialTime();
+        classifier -> classifyBatch(imgs, labels, probs);
+        const double classified = takeInitialTime();
+
+        for (k = 0; k < batch.size(); k++) {
+            const int i = batch[k];
+            DepthFrame* frame = rings[i] -> front();
+
+            const double filterStart = takeInitialTime();
+            filter -> smooth(labelMaps[i].data(), WIDTH, HEIGHT, minComponentSize);
+            const double end = takeInitialTime();
+
+            stats[i].copy.add(frame -> queued - frame -> captured);
+            stats[i].wait.add(start - frame -> queued);
+            stats[i].classify.add(classified - start);
+            stats[i].filter.add(end - filterStart);
+            stats[i].total.add(end - frame -> captured);
+
+            rings[i] -> pop();
+
+            if (stats[i].total.n % STATS_PERIOD == 0) {
+                printStats(i);
+            }
         }
     }
-    //printf("\n");
-    cvSaveImage("prueba.jpg", img);
-    //cvNamedWindow("main",CV_WINDOW_AUTOSIZE);
-    //cvShowImage("main",img);
+
+    return NULL;
 }
 
 void *freenect_threadfunc(void* id) {
 
     int i;
-    int accelCount;
+    int accelCount = 0;
 
-    i = (int) id;
+    i = (int)(intptr_t) id;
 
     printf("Iniciando dispositivo %d\n", i);
 
@@ -89,6 +281,43 @@ int main (int argc, char** argv) {
 
     int i;
     int res;
+    int sig;
+    sigset_t signals;
+
+    /**
+     *  Blocked before the thread pools start their workers, every thread
+     *  inherits the mask, so SIGINT and SIGTERM are only received by
+     *  sigwait in the main thread.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (argc < 2) {
+        printf("Usage: %s forest%s [ring size] [min component size] "
+               "[cpu|gpu]\n", argv[0], FLAT_FOREST_EXT);
+        return 1;
+    }
+
+    rdf::ThreadPool::Ptr pool(new rdf::ThreadPool());
+    rdf::RandomForest forest;
+
+    forest.setThreadPool(pool);
+    forest.loadFlatForest(argv[1]);
+    filter.reset(new rdf::LabelFilter(forest.labels(), pool));
+
+    const unsigned ringSize = (argc > 2) ? atoi(argv[2]) : FRAME_RING_SIZE;
+
+    if (argc > 3) {
+        minComponentSize = atoi(argv[3]);
+    }
+
+    const bool gpu = (argc > 4) && (strcmp(argv[4], "gpu") == 0);
+
+    classifier = rdf::FrameClassifier::create(
+        gpu ? rdf::GPU_CLASSIFIER : rdf::CPU_CLASSIFIER, forest);
+    printf("Classifying on the %s\n", classifier -> name());
 
     if (freenect_init(&f_ctx, NULL) < 0) {
         printf("freenect_init explode!\n");
@@ -99,33 +328,78 @@ int main (int argc, char** argv) {
 
     printf("Number of devices found: %d\n", nr_devices);
 
+    if (nr_devices > MAX_NUM_DEV) {
+        printf("Only the first %d devices are used\n", MAX_NUM_DEV);
+        nr_devices = MAX_NUM_DEV;
+    }
+
     /**
-     *  Open Kinect devices detected.
+     *  Open Kinect devices detected and allocate their frames.
      */
     for (i = 0; i < nr_devices; i++) {
         if (freenect_open_device(f_ctx, &f_dev[i], i) < 0) {
             printf("Could not open device\n");
             return 1;
         }
+
+        rings[i] = new rdf::FrameRing<DepthFrame>(ringSize);
+        for (auto& frame : rings[i] -> data()) {
+            frame.img = rdf::PaddedDepthImage(forest.guardBand());
+        }
+        labelMaps[i].resize(WIDTH * HEIGHT);
+    }
+
+    sem_init(&framesReady, 0, 0);
+
+    res = pthread_create(&classifier_thread, NULL, classifier_threadfunc, NULL);
+    if (res != 0) {
+        printf("pthread_create failed\n");
+        return 1;
     }
 
     /**
      *  Create the device threads.
      */
     for (i = 0; i < nr_devices; i++) {
-        res = pthread_create(&freenect_thread[i], NULL, freenect_threadfunc, (void*)i);
+        res = pthread_create(&freenect_thread[i], NULL, freenect_threadfunc, (void*)(intptr_t)i);
         if (res != 0) {
             printf("pthread_create failed\n");
             return 1;
         }
     }
 
-    while (true);
+    sigwait(&signals, &sig);
 
+    term = 1;
+    for (i = 0; i < nr_devices; i++) {
+        pthread_join(freenect_thread[i], NULL);
+    }
+    sem_post(&framesReady);
+    pthread_join(classifier_thread, NULL);
+
+    /**
+     *  Print the statistics and save the last label map of each device.
+     */
     for (i = 0; i < nr_devices; i++) {
         freenect_stop_depth(f_dev[i]);
         freenect_close_device(f_dev[i]);
+
+        printStats(i);
+
+        char fileName[64];
+        sprintf(fileName, "labels_%d.png", i);
+        Mat labels(HEIGHT, WIDTH, CV_8UC1, labelMaps[i].data());
+        imwrite(fileName, labels * (255 / NUMBER_OF_LABELS));
+
+        delete rings[i];
     }
 
+    sem_destroy(&framesReady);
+    freenect_shutdown(f_ctx);
+
+    // The classifier and the filter use the forest and its pool
+    classifier.reset();
+    filter.reset();
+
     return 0;
 }
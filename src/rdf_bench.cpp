@@ -0,0 +1,674 @@
+/** \file rdf_bench.cpp
+ *
+ *  \brief Benchmarks of the rdf library: depth lookups, feature
+ *  responses, split search and partition of the training, per pixel
+ *  prediction and whole frame classification, also with the quantized
+ *  trees. The forests are one trained by the benchmark and the trees of
+ *  samples/trained_trees.
+ *
+ *  Without an image directory the benchmark writes synthetic train images
+ *  to a temporary directory. With several processes on different nodes
+ *  the images must be in a shared directory.
+ *
+ *  Usage: mpirun -n <processes> ./rdf_bench [image_directory|-]
+ *         [trees_directory] [threads] [frames]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include <vector>
+
+#include <rdf/common.h>
+#include <rdf/Feature.h>
+#include <rdf/FeatureKernel.h>
+#include <rdf/Image.h>
+#include <rdf/ImagePool.h>
+#include <rdf/RandomForest.h>
+
+#ifndef RDF_SAMPLE_TREES
+#define RDF_SAMPLE_TREES "samples/trained_trees"
+#endif
+
+/**
+ *  Size and number of the synthetic train images.
+ */
+#define BENCH_IMAGE_NUM 16
+#define BENCH_IMAGE_WIDTH 160
+#define BENCH_IMAGE_HEIGHT 120
+
+/**
+ *  Seed of the synthetic images and of the samples of the benchmarks.
+ */
+#define BENCH_SEED 1234
+
+/**
+ *  Number of random depth lookups, and number of pixels and offset pairs
+ *  of the feature benchmark.
+ */
+#define BENCH_LOOKUPS (1 << 22)
+#define BENCH_PIXELS (1 << 14)
+#define BENCH_PAIRS 64
+
+/**
+ *  Largest offset component, in millimeters times pixels like the
+ *  offsets of samples/trained_trees.
+ */
+#define BENCH_OFFSET 130000
+
+/**
+ *  Distinct synthetic frames classified in turn.
+ */
+#define BENCH_FRAMES 8
+
+/**
+ *  Labels kept per leaf by the second quantized forest.
+ */
+#define BENCH_TOP_K 2
+
+using namespace std;
+
+/**
+ *  Results of the benchmarks are added here so the loops are not
+ *  optimized away.
+ */
+static volatile double sink;
+
+/**
+ *  Prints the rate of a benchmark.
+ *
+ *  @param name of the benchmark.
+ *  @param count of items processed.
+ *  @param seconds spent.
+ *  @param unit of the items.
+ */
+static void report(const char* name, double count, double seconds, const char* unit) {
+    printf("  %-34s %10.2f M%s/s  (%.3f s)\n", name,
+           (seconds > 0.0) ? count / seconds / 1e6 : 0.0, unit, seconds);
+}
+
+/**
+ *  Prints the latency percentiles of a set of frames.
+ *
+ *  @param name of the benchmark.
+ *  @param latency of each frame in seconds, sorted by the call.
+ *  @param pixels of each frame.
+ */
+static void reportLatency(const char* name, vector<double>& latency, double pixels) {
+    double total = 0.0;
+    size_t i;
+
+    if (latency.empty()) {
+        return;
+    }
+
+    sort(latency.begin(), latency.end());
+    for (i = 0; i < latency.size(); i++) {
+        total += latency[i];
+    }
+
+    auto percentile = [&latency](double p) {
+        return latency[min(latency.size() - 1, size_t(p * latency.size()))] * 1e3;
+    };
+
+    printf("  %-34s mean %.3f ms  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f  "
+           "(%.2f Mpixels/s)\n", name, total / latency.size() * 1e3,
+           percentile(0.50), percentile(0.90), percentile(0.99),
+           latency.back() * 1e3, pixels * latency.size() / total / 1e6);
+}
+
+/**
+ *  Renders a synthetic body: an ellipse of six horizontal bands of
+ *  labels, from the head to the feet, with the depth growing towards the
+ *  border and some noise. The background has no depth.
+ *
+ *  @param rng generator of the scene.
+ *  @param width of the image.
+ *  @param height of the image.
+ *  @param depth row-major depths in millimeters, 0 in the background.
+ *  @param labels row-major labels, DEFAULT_LABEL in the background.
+ */
+static void renderScene(
+    Rng& rng,
+    int width,
+    int height,
+    vector<uint16_t>& depth,
+    vector<Label>& labels
+) {
+    const double a = height * (0.30 + 0.15 * rng.uniform());
+    const double b = width * (0.12 + 0.12 * rng.uniform());
+    const double cx = height / 2.0 + (rng.uniform() - 0.5) * (height - 2 * a);
+    const double cy = width / 2.0 + (rng.uniform() - 0.5) * (width - 2 * b);
+    const int base = 1500 + rng.below(2000);
+    int x;
+    int y;
+
+    depth.assign(width * height, 0);
+    labels.assign(width * height, DEFAULT_LABEL);
+
+    for (x = 0; x < height; x++) {
+        for (y = 0; y < width; y++) {
+            const double dx = (x - cx) / a;
+            const double dy = (y - cy) / b;
+            const double r2 = dx * dx + dy * dy;
+
+            if (r2 >= 1.0) {
+                continue;
+            }
+
+            const int band = int((x - (cx - a)) * 6 / (2 * a));
+
+            depth[x * width + y] = base + int(300 * r2) + rng.below(20);
+            labels[x * width + y] = 1 + max(0, min(5, band));
+        }
+    }
+}
+
+/**
+ *  Writes an image in the text format read by TrainImage.
+ *
+ *  @param fileName of the image.
+ *  @param width of the image.
+ *  @param height of the image.
+ *  @param depth row-major depths, 0 in the background.
+ *  @param labels row-major labels.
+ */
+static void writeTextImage(
+    const string& fileName,
+    int width,
+    int height,
+    const vector<uint16_t>& depth,
+    const vector<Label>& labels
+) {
+    vector<unsigned> I;
+    vector<int> J;
+    FILE* fp;
+    size_t i;
+    int x;
+    int y;
+
+    if ((fp = fopen(fileName.c_str(), "w")) == NULL) {
+        printf("Cannot open file %s.\n", fileName.c_str());
+        exit(1);
+    }
+
+    for (x = 0; x < height; x++) {
+        for (y = 0; y < width; y++) {
+            if (depth[x * width + y] != 0) {
+                J.push_back(y);
+            }
+        }
+        I.push_back(J.size());
+    }
+
+    fprintf(fp, "%d %d;\n", width, height);
+
+    for (i = 0; i < depth.size(); i++) {
+        if (depth[i] != 0) {
+            fprintf(fp, "%d ", labels[i]);
+        }
+    }
+    fprintf(fp, ";");
+
+    for (i = 0; i < depth.size(); i++) {
+        if (depth[i] != 0) {
+            fprintf(fp, "%d ", depth[i]);
+        }
+    }
+    fprintf(fp, ";");
+
+    for (i = 0; i < I.size(); i++) {
+        fprintf(fp, "%u ", I[i]);
+    }
+    fprintf(fp, ";");
+
+    for (i = 0; i < J.size(); i++) {
+        fprintf(fp, "%d ", J[i]);
+    }
+    fclose(fp);
+}
+
+/**
+ *  Writes the synthetic train images in a new temporary directory.
+ *
+ *  @param fileNames of the images written.
+ *
+ *  @return the directory.
+ */
+static string writeSyntheticImages(vector<string>& fileNames) {
+    char dirName[] = "/tmp/rdf_bench.XXXXXX";
+    vector<uint16_t> depth;
+    vector<Label> labels;
+    Rng rng(BENCH_SEED);
+    int i;
+
+    if (mkdtemp(dirName) == NULL) {
+        printf("Cannot create a temporary directory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < BENCH_IMAGE_NUM; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "/bench%03d%s", i, TEXT_IMAGE_EXT);
+        renderScene(rng, BENCH_IMAGE_WIDTH, BENCH_IMAGE_HEIGHT, depth, labels);
+        writeTextImage(dirName + string(name), BENCH_IMAGE_WIDTH,
+                       BENCH_IMAGE_HEIGHT, depth, labels);
+        fileNames.push_back(dirName + string(name));
+    }
+
+    return dirName;
+}
+
+/**
+ *  Times random lookups of TrainImage::getDepth.
+ *
+ *  @param img image of the lookups.
+ *  @param name of the benchmark.
+ */
+static void benchDepth(const rdf::TrainImage& img, const char* name) {
+    vector<short> xs(BENCH_LOOKUPS);
+    vector<short> ys(BENCH_LOOKUPS);
+    Rng rng(BENCH_SEED);
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        xs[i] = rng.below(img.height);
+        ys[i] = rng.below(img.width);
+    }
+
+    const double start = takeInitialTime();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        sum += img.getDepth(xs[i], ys[i]);
+    }
+    const double seconds = takeInitialTime() - start;
+
+    sink += sum;
+    report(name, BENCH_LOOKUPS, seconds, "lookups");
+}
+
+/**
+ *  Times the feature responses of BENCH_PAIRS random offset pairs on
+ *  BENCH_PIXELS random pixels of an image, one pixel at a time through
+ *  the version of RandomForest::calcFeature, and a block at a time
+ *  through the kernel of the split search.
+ *
+ *  @param sparse image in sparse storage.
+ *  @param dense the same image in dense storage.
+ */
+static void benchFeature(rdf::TrainImage& sparse, const rdf::TrainImage& dense) {
+    const double count = double(BENCH_PIXELS) * BENCH_PAIRS;
+    const rdf::DepthPlane plane = dense.plane();
+
+    vector<rdf::PixelInfo> pixels(BENCH_PIXELS);
+    vector<int> offsets(4 * BENCH_PAIRS);
+    vector<float> responses(BENCH_PIXELS);
+    rdf::FeatureBlock block;
+    Rng rng(BENCH_SEED);
+    double sum;
+    double start;
+    int i;
+    int p;
+
+    seedThreadRng(BENCH_SEED);
+    block.resize(BENCH_PIXELS);
+
+    for (i = 0; i < BENCH_PIXELS; i++) {
+        uint32_t row;
+        uint32_t col;
+
+        sparse.getRandomCoord(row, col);
+        pixels[i] = rdf::PixelInfo(row, col, 0);
+
+        block.x[i] = row;
+        block.y[i] = col;
+        block.depth[i] = dense.getDepth(row, col);
+        block.img[i] = 0;
+    }
+
+    for (i = 0; i < 4 * BENCH_PAIRS; i++) {
+        offsets[i] = int(rng.below(2 * BENCH_OFFSET + 1)) - BENCH_OFFSET;
+    }
+
+    const rdf::Image* images[] = {&sparse, &dense};
+    const char* names[] = {"calcFeature sparse", "calcFeature dense"};
+
+    for (int k = 0; k < 2; k++) {
+        sum = 0.0;
+        start = takeInitialTime();
+
+        for (p = 0; p < BENCH_PAIRS; p++) {
+            const int* o = &offsets[4 * p];
+
+            for (i = 0; i < BENCH_PIXELS; i++) {
+                sum += rdf::featureResponse(o[0], o[1], o[2], o[3], pixels[i],
+                                            images[k]);
+            }
+        }
+
+        sink += sum;
+        report(names[k], count, takeInitialTime() - start, "responses");
+    }
+
+    if (plane.data == nullptr) {
+        printf("  The image does not fit in dense storage\n");
+        return;
+    }
+
+    sum = 0.0;
+    start = takeInitialTime();
+
+    for (p = 0; p < BENCH_PAIRS; p++) {
+        const int* o = &offsets[4 * p];
+
+        rdf::featureResponses(o[0], o[1], o[2], o[3], block, &plane,
+                              responses.data());
+        sum += responses[p];
+    }
+
+    sink += sum;
+
+    const string name = string("feature kernel ") + rdf::featureKernelName();
+    report(name.c_str(), count, takeInitialTime() - start, "responses");
+}
+
+/**
+ *  Trains a forest on the images of a directory and prints the split
+ *  search, partition and node rates of the master process.
+ *
+ *  @param forest to train.
+ *  @param tp parameters of the training, they must outlive the forest.
+ *  @param imgDir directory of the train images.
+ *  @param mode evaluation of the thresholds.
+ *  @param name of the benchmark.
+ */
+static void benchTraining(
+    rdf::RandomForest& forest,
+    rdf::trainParams& tp,
+    const string& imgDir,
+    rdf::splitEval mode,
+    const char* name
+) {
+    int rank;
+    size_t i;
+
+    tp.treeNum = 3;
+    tp.labelNum = NUMBER_OF_LABELS;
+    tp.imgDir = imgDir;
+    tp.maxDepth = 16;
+    tp.minSampleCount = 10;
+    tp.samplePixelNum = 500;
+    tp.offsetNum = 100;
+    tp.thresholdNum = 20;
+    tp.offsetRange = NumRange(-BENCH_OFFSET, BENCH_OFFSET);
+    tp.thresholdRange = NumRange(0, 1000);
+    tp.splitMode = mode;
+    tp.seed = BENCH_SEED;
+
+    forest.trainForest(tp);
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank != 0) {
+        return;
+    }
+
+    const rdf::TrainStats& stats = forest.trainStats();
+    const rdf::RankStats& rs = stats.rankStats();
+    double treeTime = 0.0;
+    double nodes = 0.0;
+    double sorted = 0.0;
+
+    for (i = 0; i < stats.treeStats().size(); i++) {
+        treeTime += stats.treeStats()[i].time;
+        nodes += stats.treeStats()[i].nodes;
+    }
+
+    for (i = 0; i < stats.nodeStats().size(); i++) {
+        if (!stats.nodeStats()[i].leaf) {
+            sorted += stats.nodeStats()[i].pixels;
+        }
+    }
+
+    printf("%s\n", name);
+    report("split search (candidate x pixel)", rs.evaluations, rs.search, "");
+    report("sortData", sorted, rs.sort, "pixels");
+    printf("  %-34s %10.1f nodes/s  (%.3f s)\n", "tree growth",
+           (treeTime > 0.0) ? nodes / treeTime : 0.0, treeTime);
+    printf("  %-34s %10.3f s (wait %.3f s)\n", "training", rs.time, rs.wait);
+}
+
+/**
+ *  Times the classification of every pixel with depth of the images of a
+ *  pool with RandomForest::predict.
+ *
+ *  @param forest to evaluate.
+ *  @param pool of images.
+ */
+static void benchPredict(rdf::RandomForest& forest, rdf::ImagePool& pool) {
+    double pixels = 0.0;
+    double accuracy = 0.0;
+    int i;
+    int x;
+    int y;
+
+    for (i = 0; i < pool.size(); i++) {
+        for (x = 0; x < pool[i].height; x++) {
+            for (y = 0; y < pool[i].width; y++) {
+                pixels += pool[i].getLabel(x, y) != DEFAULT_LABEL;
+            }
+        }
+    }
+
+    const double start = takeInitialTime();
+    for (i = 0; i < pool.size(); i++) {
+        accuracy += forest.testClassification(pool[i]);
+    }
+    const double seconds = takeInitialTime() - start;
+
+    report("predict", pixels, seconds, "pixels");
+    printf("  %-34s %10.2f %%\n", "accuracy", 100.0 * accuracy / pool.size());
+}
+
+/**
+ *  Times the classification of whole synthetic WIDTH x HEIGHT frames.
+ *
+ *  @param forest to evaluate.
+ *  @param frames number of frames.
+ */
+static void benchFrames(rdf::RandomForest& forest, int frames) {
+    const int pixels = WIDTH * HEIGHT;
+
+    vector<vector<uint16_t> > depth(BENCH_FRAMES);
+    vector<Label> sceneLabels;
+    vector<Label> labels(pixels);
+    vector<float> probs(pixels);
+    vector<double> latency;
+    rdf::PaddedDepthImage padded(forest.guardBand());
+    rdf::classifyParams sparse;
+    Rng rng(BENCH_SEED);
+    double start;
+    int i;
+
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        renderScene(rng, WIDTH, HEIGHT, depth[i], sceneLabels);
+    }
+
+    // One frame to warm up the caches and the thread pool
+    rdf::KinectImage warm(depth[0].data());
+    forest.classifyFrame(warm, labels.data(), probs.data());
+
+    for (i = 0; i < frames; i++) {
+        rdf::KinectImage img(depth[i % BENCH_FRAMES].data());
+
+        start = takeInitialTime();
+        forest.classifyFrame(img, labels.data(), probs.data());
+        latency.push_back(takeInitialTime() - start);
+    }
+    reportLatency("classifyFrame KinectImage", latency, pixels);
+
+    latency.clear();
+    for (i = 0; i < frames; i++) {
+        start = takeInitialTime();
+        padded.assign(depth[i % BENCH_FRAMES].data());
+        forest.classifyFrame(padded, labels.data(), probs.data());
+        latency.push_back(takeInitialTime() - start);
+    }
+    reportLatency("classifyFrame PaddedDepthImage", latency, pixels);
+
+    sparse.stride = 2;
+    latency.clear();
+    for (i = 0; i < frames; i++) {
+        start = takeInitialTime();
+        padded.assign(depth[i % BENCH_FRAMES].data());
+        forest.classifyFrame(padded, labels.data(), probs.data(), sparse);
+        latency.push_back(takeInitialTime() - start);
+    }
+    reportLatency("classifyFrame stride 2", latency, pixels);
+
+    sink += labels[pixels / 2] + probs[pixels / 2];
+}
+
+/**
+ *  Quantizes a forest keeping every label and then the BENCH_TOP_K most
+ *  probable labels of the leaves, and times the quantized trees.
+ *
+ *  @param forest to quantize.
+ *  @param pool of images.
+ *  @param frames number of frames.
+ */
+static void benchQuantized(rdf::RandomForest& forest, rdf::ImagePool& pool, int frames) {
+    const int topK[] = {0, BENCH_TOP_K};
+
+    for (const int k : topK) {
+        forest.quantize(k);
+        printf("Quantized, %s\n", (k == 0) ? "every label" : "top labels");
+        benchPredict(forest, pool);
+        benchFrames(forest, frames);
+    }
+}
+
+/**
+ *  Returns the number of trees of a directory, named "i.tree" or
+ *  "i-tree.txt" from 0.
+ *
+ *  @param dirName of the trees.
+ */
+static int countTrees(const string& dirName) {
+    int n = 0;
+
+    while (true) {
+        stringstream a;
+        stringstream b;
+
+        a << dirName << "/" << n << ".tree";
+        b << dirName << "/" << n << "-tree.txt";
+
+        if ((access(a.str().c_str(), R_OK) != 0) &&
+            (access(b.str().c_str(), R_OK) != 0)) {
+            return n;
+        }
+        n++;
+    }
+}
+
+int main(int argc, char** argv) {
+    int rank;
+    int threads;
+    int frames;
+    int treeNum;
+    size_t i;
+
+    string imgDir;
+    string treeDir;
+    vector<string> synthetic;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (argc > 5) {
+        if (rank == 0) {
+            printf("Usage: %s [image_directory|-] [trees_directory] [threads] "
+                   "[frames]\n", argv[0]);
+        }
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    imgDir = (argc > 1) ? argv[1] : "-";
+    treeDir = (argc > 2) ? argv[2] : RDF_SAMPLE_TREES;
+    threads = (argc > 3) ? atoi(argv[3]) : 0;
+    frames = (argc > 4) ? atoi(argv[4]) : 100;
+
+    // The master writes the synthetic images for every process
+    if (imgDir == "-") {
+        char dirName[64] = "";
+
+        if (rank == 0) {
+            imgDir = writeSyntheticImages(synthetic);
+            strncpy(dirName, imgDir.c_str(), sizeof(dirName) - 1);
+        }
+        MPI_Bcast(dirName, sizeof(dirName), MPI_CHAR, 0, MPI_COMM_WORLD);
+        imgDir = dirName;
+    }
+    imgDir += "/";
+
+    rdf::ThreadPool::Ptr pool(new rdf::ThreadPool(threads));
+    rdf::trainParams tp;
+    rdf::RandomForest trained;
+    trained.setThreadPool(pool);
+
+    if (rank == 0) {
+        printf("rdf_bench: %d threads, feature kernel %s, images %s\n",
+               pool->size(), rdf::featureKernelName(), imgDir.c_str());
+    }
+
+    benchTraining(trained, tp, imgDir, rdf::EXHAUSTIVE_SPLIT, 
+                  "Training, exhaustive G()");
+    benchTraining(trained, tp, imgDir, rdf::HISTOGRAM_SPLIT, 
+                  "Training, histogram split search");
+
+    if (rank == 0) {
+        rdf::ImagePool images(imgDir, rdf::SPARSE_STORAGE);
+        rdf::TrainImage sparse = images[0];
+        rdf::TrainImage dense = images[0];
+
+        dense.densify();
+
+        printf("Images\n");
+        benchDepth(sparse, "TrainImage::getDepth sparse");
+        benchDepth(dense, "TrainImage::getDepth dense");
+        benchFeature(sparse, dense);
+
+        printf("Trained forest\n");
+        benchPredict(trained, images);
+        benchFrames(trained, frames);
+        benchQuantized(trained, images, frames);
+
+        treeNum = countTrees(treeDir);
+        if (treeNum > 0) {
+            rdf::RandomForest samples;
+            samples.setThreadPool(pool);
+            samples.loadForest(treeNum, NUMBER_OF_LABELS, treeDir);
+
+            printf("Trees of %s\n", treeDir.c_str());
+            benchPredict(samples, images);
+            benchFrames(samples, frames);
+            benchQuantized(samples, images, frames);
+        }
+        else {
+            printf("No trees in %s\n", treeDir.c_str());
+        }
+
+        for (i = 0; i < synthetic.size(); i++) {
+            unlink(synthetic[i].c_str());
+        }
+        if (!synthetic.empty()) {
+            rmdir(imgDir.c_str());
+        }
+    }
+
+    MPI_Finalize();
+    return EXIT_SUCCESS;
+}
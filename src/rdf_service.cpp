@@ -0,0 +1,86 @@
+/** \file rdf_service.cpp
+ *
+ *  \brief Classification service of the depth frames of the camera
+ *  clients of a host. The forest is mapped once by the service and the
+ *  clients queue their frames through shared memory with
+ *  rdf::ClassifyClient. Runs until SIGINT or SIGTERM.
+ *
+ *  Usage: ./rdf_service <forest.bforest|forest.qforest> [segment_name]
+ *         [slots] [threads]
+ */
+#include <pthread.h>
+#include <signal.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <rdf/ClassifyService.h>
+#include <rdf/FlatForest.h>
+#include <rdf/QuantizedForest.h>
+#include <rdf/RandomForest.h>
+
+/**
+ *  Main loop of the thread of the service.
+ */
+static void* serviceThread(void* args) {
+    ((rdf::ClassifyService*) args) -> run();
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int sig;
+    sigset_t signals;
+    pthread_t thread;
+
+    /**
+     *  Blocked before the thread pools start their workers, every thread
+     *  inherits the mask, so SIGINT and SIGTERM are only received by
+     *  sigwait in the main thread.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (argc < 2 || argc > 5) {
+        printf("Usage: %s forest%s|forest%s [segment name] [slots] [threads]\n",
+               argv[0], FLAT_FOREST_EXT, QUANT_FOREST_EXT);
+        return EXIT_FAILURE;
+    }
+
+    const std::string forestFile = argv[1];
+    const std::string segName = (argc > 2) ? argv[2] : CLASSIFY_SERVICE_NAME;
+    const int slots = (argc > 3) ? atoi(argv[3]) : CLASSIFY_SERVICE_SLOTS;
+    const int threads = (argc > 4) ? atoi(argv[4]) : 0;
+
+    rdf::ThreadPool::Ptr pool(new rdf::ThreadPool(threads));
+    rdf::RandomForest forest;
+
+    forest.setThreadPool(pool);
+    if (hasExtension(forestFile, QUANT_FOREST_EXT)) {
+        forest.loadQuantizedForest(forestFile);
+    }
+    else {
+        forest.loadFlatForest(forestFile);
+    }
+
+    rdf::ClassifyService service(forest, segName, slots);
+
+    if (pthread_create(&thread, NULL, serviceThread, &service) != 0) {
+        printf("pthread_create failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Serving %d labels with %d threads\n", forest.labels(), pool->size());
+    fflush(stdout);
+
+    sigwait(&signals, &sig);
+
+    service.stop();
+    pthread_join(thread, NULL);
+
+    printf("%llu frames classified in %llu batches\n",
+           (unsigned long long) service.frames(),
+           (unsigned long long) service.batches());
+    return EXIT_SUCCESS;
+}
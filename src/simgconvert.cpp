@@ -0,0 +1,54 @@
+/** \file simgconvert.cpp
+ *
+ *  \brief Converts the text train images (.simg) of a directory to the
+ *  binary format (.bimg) that the ImagePool maps in memory.
+ *
+ *  Usage: ./simgconvert <input_directory> <output_directory>
+ */
+#include <cstring>
+
+#include <rdf/Image.h>
+
+int main(int argc, char** argv) {
+    DIR *pdir = NULL;
+    struct dirent *pent = NULL;
+    int converted = 0;
+
+    std::string inDir;
+    std::string outDir;
+    std::string name;
+
+    if (argc != 3) {
+        printf("Usage: %s <input_directory> <output_directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    inDir = std::string(argv[1]) + "/";
+    outDir = std::string(argv[2]) + "/";
+
+    if ((pdir = opendir(inDir.c_str())) == NULL) {
+        printf("Error! could not open directory %s\n", inDir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    while ((pent = readdir(pdir))) {
+        name = std::string(pent->d_name);
+
+        if (!hasExtension(name, TEXT_IMAGE_EXT)) {
+            continue;
+        }
+
+        rdf::TrainImage img(inDir + name);
+
+        name = name.substr(0, name.size() - strlen(TEXT_IMAGE_EXT)) + 
+               BINARY_IMAGE_EXT;
+        img.writeBinary(outDir + name);
+
+        printf("Image %s converted\n", (outDir + name).c_str());
+        converted++;
+    }
+    closedir(pdir);
+
+    printf("%d images converted\n", converted);
+    return EXIT_SUCCESS;
+}